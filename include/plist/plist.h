@@ -43,6 +43,8 @@ extern "C"
 #else
 #include <stdint.h>
 #endif
+#include <stddef.h>
+#include <stdio.h>
 
 #ifdef __llvm__
   #if defined(__has_extension)
@@ -98,6 +100,21 @@ extern "C"
      */
     typedef void* plist_array_iter;
 
+    /**
+     * A read-only view over a binary plist buffer, see plist_bin_view_open().
+     */
+    typedef struct plist_bin_view_s *plist_bin_view_t;
+
+    /**
+     * Reference to an object inside a #plist_bin_view_t.
+     */
+    typedef uint64_t plist_bin_ref_t;
+
+    /**
+     * Invalid #plist_bin_ref_t, returned when an object could not be found.
+     */
+#define PLIST_BIN_REF_INVALID ((plist_bin_ref_t)-1)
+
     /**
      * The enumeration of plist node types.
      */
@@ -116,6 +133,61 @@ extern "C"
         PLIST_NONE	/**< No type */
     } plist_type;
 
+    /**
+     * Options for the plist_from_*_with_options() import functions.
+     */
+    typedef enum
+    {
+        PLIST_PARSE_DEFAULT = 0,	/**< Every node is allocated individually */
+        PLIST_PARSE_ARENA = 1 << 0,	/**< Allocate all nodes and values of the document from a single arena */
+        PLIST_PARSE_BORROW = 1 << 1,	/**< Let #PLIST_DATA nodes point into the input buffer instead of copying (binary plists only) */
+        PLIST_PARSE_PARALLEL = 1 << 2,	/**< Decode the entries of the root array or dictionary on multiple threads (binary plists only) */
+        PLIST_PARSE_UNBOUNDED = 1 << 3	/**< Don't limit the number of nodes shared objects expand to (binary plists only) */
+    } plist_parse_options_t;
+
+    /**
+     * Options for the plist_to_bin_with_options() family of export functions.
+     */
+    typedef enum
+    {
+        PLIST_WRITE_DEFAULT = 0,	/**< Equal scalar values are written once, containers once per occurrence */
+        PLIST_WRITE_COMPACT = 1 << 0,	/**< Also write equal #PLIST_DATA payloads and equal arrays/dictionaries only once, and share strings between keys and values */
+        PLIST_WRITE_PARALLEL = 1 << 1	/**< Encode the objects on multiple threads */
+    } plist_write_options_t;
+
+    /**
+     * The serialization format of a plist file, see plist_read_from_file()
+     * and plist_write_to_file().
+     */
+    typedef enum
+    {
+        PLIST_FORMAT_NONE = 0,	/**< Unknown or not determined */
+        PLIST_FORMAT_XML = 1,	/**< XML property list */
+        PLIST_FORMAT_BINARY = 2	/**< Binary property list (bplist00) */
+    } plist_format_t;
+
+    /**
+     * Output callback for plist_to_bin_stream(). Receives the next len
+     * bytes of output and returns 0 on success, non-zero on failure.
+     */
+    typedef int (*plist_write_func_t)(const void *buf, size_t len, void *user_data);
+
+    /**
+     * A change to a binary plist for plist_bin_update().
+     *
+     * For a dictionary, the entry with the given key is set to value, or
+     * added if there is none, or removed if value is NULL. For an array,
+     * the item at index is replaced by value, or removed if value is NULL;
+     * an index equal to the size of the array appends value.
+     */
+    typedef struct
+    {
+        plist_bin_ref_t container;	/**< #PLIST_ARRAY or #PLIST_DICT object to change, or #PLIST_BIN_REF_INVALID to replace the root */
+        const char *key;	/**< key of the dictionary entry */
+        uint64_t index;	/**< index of the array item */
+        plist_t value;	/**< the new value, or NULL to remove the entry */
+    } plist_bin_change_t;
+
 
     /********************************************
      *                                          *
@@ -214,6 +286,10 @@ extern "C"
     /**
      * Return a copy of passed node and it's children
      *
+     * Every node is copied. Only the payload of #PLIST_STRING and
+     * #PLIST_DATA nodes is not duplicated; original and copy share it
+     * until either of them is given a new value.
+     *
      * @param node the plist to copy
      * @return copied plist
      */
@@ -642,9 +718,21 @@ extern "C"
      * @param plist_xml a pointer to a C-string. This function allocates the memory,
      *            caller is responsible for freeing it. Data is UTF-8 encoded.
      * @param length a pointer to an uint32_t variable. Represents the length of the allocated buffer.
+     * @note Output larger than 4 GiB can not be represented and fails; use
+     *            plist_to_xml64() for such documents.
      */
     void plist_to_xml(plist_t plist, char **plist_xml, uint32_t * length);
 
+    /**
+     * Export the #plist_t structure to XML format, with a 64-bit length.
+     *
+     * @param plist the root node to export
+     * @param plist_xml a pointer to a C-string. This function allocates the memory,
+     *            caller is responsible for freeing it. Data is UTF-8 encoded.
+     * @param length a pointer to an uint64_t variable. Represents the length of the allocated buffer.
+     */
+    void plist_to_xml64(plist_t plist, char **plist_xml, uint64_t * length);
+
     /**
      * Frees the memory allocated by plist_to_xml().
      *
@@ -659,9 +747,49 @@ extern "C"
      * @param plist_bin a pointer to a char* buffer. This function allocates the memory,
      *            caller is responsible for freeing it.
      * @param length a pointer to an uint32_t variable. Represents the length of the allocated buffer.
+     * @note Output larger than 4 GiB can not be represented and fails; use
+     *            plist_to_bin64() for such documents.
      */
     void plist_to_bin(plist_t plist, char **plist_bin, uint32_t * length);
 
+    /**
+     * Export the #plist_t structure to binary format, with a 64-bit length.
+     *
+     * @param plist the root node to export
+     * @param plist_bin a pointer to a char* buffer. This function allocates the memory,
+     *            caller is responsible for freeing it.
+     * @param length a pointer to an uint64_t variable. Represents the length of the allocated buffer.
+     */
+    void plist_to_bin64(plist_t plist, char **plist_bin, uint64_t * length);
+
+    /**
+     * Export the #plist_t structure to binary format, with options.
+     *
+     * With #PLIST_WRITE_COMPACT objects are deduplicated by content: all
+     * #PLIST_DATA nodes with the same payload, and all arrays and
+     * dictionaries with equal contents (including the order of their
+     * items), are written as a single object that is referenced from every
+     * place it occurs. Strings used both as a key and as a value are
+     * written once as well. The result is a valid binary plist that reads
+     * back to an equal structure; it just takes more time to produce.
+     * Since every reference to a shared object is decoded into nodes of
+     * its own, plist_from_bin() accepts at most 8 nodes per input byte
+     * (but at least 1M) by default, which heavily deduplicated output can
+     * exceed. Read such documents with #PLIST_PARSE_UNBOUNDED.
+     *
+     * With #PLIST_WRITE_PARALLEL the objects are encoded on one thread per
+     * CPU once the document is large enough for that to pay off. The
+     * output is the same as without the option. The number of threads can
+     * be changed as for #PLIST_PARSE_PARALLEL.
+     *
+     * @param plist the root node to export
+     * @param plist_bin a pointer to a char* buffer. This function allocates the memory,
+     *            caller is responsible for freeing it.
+     * @param length a pointer to an uint64_t variable. Represents the length of the allocated buffer.
+     * @param options a combination of #plist_write_options_t values.
+     */
+    void plist_to_bin_with_options(plist_t plist, char **plist_bin, uint64_t * length, plist_write_options_t options);
+
     /**
      * Frees the memory allocated by plist_to_bin().
      *
@@ -669,6 +797,58 @@ extern "C"
      */
     void plist_to_bin_free(char *plist_bin);
 
+    /**
+     * Export the #plist_t structure to binary format through a write callback.
+     *
+     * The output is produced incrementally; only a small buffer is kept in
+     * memory and handed to write_func whenever it fills up. The offset table
+     * and trailer are written last.
+     *
+     * @param plist the root node to export
+     * @param write_func function called with consecutive chunks of the output.
+     *            It must return 0 on success; any other value aborts the
+     *            output, although write_func is not called again after that.
+     * @param user_data passed through to write_func
+     * @return 0 on success or -1 if plist or write_func is invalid or a
+     *            write failed
+     */
+    int plist_to_bin_stream(plist_t plist, plist_write_func_t write_func, void *user_data);
+
+    /**
+     * Export the #plist_t structure to binary format through a write callback, with options.
+     *
+     * See plist_to_bin_stream() and plist_to_bin_with_options().
+     *
+     * @param plist the root node to export
+     * @param write_func function called with consecutive chunks of the output
+     * @param user_data passed through to write_func
+     * @param options a combination of #plist_write_options_t values.
+     * @return 0 on success or -1 on error
+     */
+    int plist_to_bin_stream_with_options(plist_t plist, plist_write_func_t write_func, void *user_data, plist_write_options_t options);
+
+    /**
+     * Export the #plist_t structure to binary format, writing to a file descriptor.
+     *
+     * See plist_to_bin_stream().
+     *
+     * @param plist the root node to export
+     * @param fd file descriptor opened for writing
+     * @return 0 on success or -1 on error
+     */
+    int plist_to_bin_fd(plist_t plist, int fd);
+
+    /**
+     * Export the #plist_t structure to binary format, writing to a stdio stream.
+     *
+     * See plist_to_bin_stream(). The stream is flushed before returning.
+     *
+     * @param plist the root node to export
+     * @param file stream opened for writing in binary mode
+     * @return 0 on success or -1 on error
+     */
+    int plist_to_bin_file(plist_t plist, FILE *file);
+
     /**
      * Import the #plist_t structure from XML format.
      *
@@ -698,6 +878,98 @@ extern "C"
      */
     void plist_from_memory(const char *plist_data, uint32_t length, plist_t * plist);
 
+    /**
+     * Import the #plist_t structure from XML format, with a 64-bit length.
+     *
+     * @param plist_xml a pointer to the xml buffer.
+     * @param length length of the buffer to read.
+     * @param plist a pointer to the imported plist.
+     */
+    void plist_from_xml64(const char *plist_xml, uint64_t length, plist_t * plist);
+
+    /**
+     * Import the #plist_t structure from binary format, with a 64-bit length.
+     *
+     * @param plist_bin a pointer to the binary buffer.
+     * @param length length of the buffer to read.
+     * @param plist a pointer to the imported plist.
+     */
+    void plist_from_bin64(const char *plist_bin, uint64_t length, plist_t * plist);
+
+    /**
+     * Import the #plist_t structure from memory data, with a 64-bit length.
+     * See plist_from_memory().
+     *
+     * @param plist_data a pointer to the memory buffer containing plist data.
+     * @param length length of the buffer to read.
+     * @param plist a pointer to the imported plist.
+     */
+    void plist_from_memory64(const char *plist_data, uint64_t length, plist_t * plist);
+
+    /**
+     * Import the #plist_t structure from XML format, with options.
+     *
+     * With #PLIST_PARSE_ARENA all nodes and values of the document are
+     * allocated from one memory arena that is released as a whole when
+     * the returned root node is freed with plist_free(). The resulting
+     * structure can be used and modified like any other plist; however
+     * memory of nodes removed from it is only reclaimed once the root
+     * node is freed.
+     *
+     * With #PLIST_PARSE_BORROW the payload of #PLIST_DATA nodes is not
+     * copied; the nodes reference the input buffer directly. The caller
+     * must then keep the buffer alive and unmodified until the returned
+     * structure is freed. Setting a new value on such a node, or copying
+     * it with plist_copy(), detaches it from the buffer. This applies to
+     * binary plists only; strings are always copied since they need to be
+     * NUL-terminated, and XML data is base64-encoded. For XML input the
+     * option is ignored.
+     *
+     * With #PLIST_PARSE_PARALLEL the entries of a binary plist's root array
+     * or dictionary are spread over one thread per CPU, which speeds up
+     * parsing large documents. The result is the same as without the
+     * option. It is ignored for XML input, for small root objects, and in
+     * combination with #PLIST_PARSE_ARENA. The PLIST_BIN_THREADS
+     * environment variable, read when the library is loaded, sets a
+     * different number of threads.
+     *
+     * An object of a binary plist can be referenced many times, and is
+     * decoded into nodes of its own for each reference, so a small input
+     * can describe a huge tree. Unless #PLIST_PARSE_UNBOUNDED is given,
+     * parsing fails once more than 8 nodes per input byte (but at least
+     * 1M) would be created. Only pass it for trusted input.
+     *
+     * @param plist_xml a pointer to the xml buffer.
+     * @param length length of the buffer to read.
+     * @param plist a pointer to the imported plist.
+     * @param options a combination of #plist_parse_options_t values.
+     */
+    void plist_from_xml_with_options(const char *plist_xml, uint64_t length, plist_t * plist, plist_parse_options_t options);
+
+    /**
+     * Import the #plist_t structure from binary format, with options.
+     * See plist_from_xml_with_options() for a description of the options.
+     *
+     * @param plist_bin a pointer to the binary buffer.
+     * @param length length of the buffer to read.
+     * @param plist a pointer to the imported plist.
+     * @param options a combination of #plist_parse_options_t values.
+     */
+    void plist_from_bin_with_options(const char *plist_bin, uint64_t length, plist_t * plist, plist_parse_options_t options);
+
+    /**
+     * Import the #plist_t structure from memory data, with options.
+     * Like plist_from_memory() this determines the format by looking at the
+     * first bytes of plist_data.
+     * See plist_from_xml_with_options() for a description of the options.
+     *
+     * @param plist_data a pointer to the memory buffer containing plist data.
+     * @param length length of the buffer to read.
+     * @param plist a pointer to the imported plist.
+     * @param options a combination of #plist_parse_options_t values.
+     */
+    void plist_from_memory_with_options(const char *plist_data, uint64_t length, plist_t * plist, plist_parse_options_t options);
+
     /**
      * Test if in-memory plist data is binary or XML
      * This method will look at the first bytes of plist_data
@@ -712,6 +984,220 @@ extern "C"
      */
     int plist_is_binary(const char *plist_data, uint32_t length);
 
+    /**
+     * Import the #plist_t structure from a file.
+     * The file is mapped into memory and parsed in place where the platform
+     * allows it, so no copy of the file contents is made; otherwise, e.g.
+     * for pipes, it is read into a temporary buffer. The format is
+     * determined from the first bytes of the file like plist_from_memory()
+     * does.
+     *
+     * @param filename path of the file to read
+     * @param plist a pointer to the imported plist, set to NULL on failure.
+     * @param format if not NULL, receives the format of the file
+     * @return 0 on success, -1 if the file could not be read (errno is set
+     *     accordingly), or -2 if it does not contain a valid plist.
+     */
+    int plist_read_from_file(const char *filename, plist_t *plist, plist_format_t *format);
+
+    /**
+     * Import the #plist_t structure from a file, with options.
+     *
+     * See plist_read_from_file(). The mapping of the file is released
+     * before returning, so #PLIST_PARSE_BORROW is ignored.
+     *
+     * @param filename path of the file to read
+     * @param plist a pointer to the imported plist, set to NULL on failure.
+     * @param format if not NULL, receives the format of the file
+     * @param options a combination of #plist_parse_options_t values.
+     * @return 0 on success, -1 if the file could not be read, or -2 if it
+     *     does not contain a valid plist.
+     */
+    int plist_read_from_file_with_options(const char *filename, plist_t *plist, plist_format_t *format, plist_parse_options_t options);
+
+    /**
+     * Export the #plist_t structure to a file.
+     * Binary output is streamed to the file in chunks like
+     * plist_to_bin_stream() does; XML output is written in one go. The file
+     * is created or truncated, and removed again if writing fails.
+     *
+     * @param plist the root node to export
+     * @param filename path of the file to write
+     * @param format #PLIST_FORMAT_XML or #PLIST_FORMAT_BINARY
+     * @param options a combination of #plist_write_options_t values, only
+     *     used for #PLIST_FORMAT_BINARY.
+     * @return 0 on success or -1 on error
+     */
+    int plist_write_to_file(plist_t plist, const char *filename, plist_format_t format, plist_write_options_t options);
+
+    /**
+     * Check if a buffer holds a well-formed binary plist without importing
+     * it. This performs the same checks as plist_from_bin() - trailer,
+     * offset table, object and reference bounds, recursion - but no nodes
+     * are allocated. Every object is examined only once, even if it is
+     * referenced multiple times.
+     *
+     * @param plist_bin a pointer to the binary buffer.
+     * @param length length of the buffer to read.
+     * @param num_objects if not NULL, receives the number of values in the
+     *     document, not counting dictionary keys. Every dictionary entry
+     *     is counted, even if its key repeats.
+     * @param max_depth if not NULL, receives the nesting depth of the
+     *     document; a document with a non-structured root has depth 1.
+     * @return 0 if the buffer holds a valid binary plist, -1 otherwise.
+     */
+    int plist_validate_bin(const char *plist_bin, uint64_t length, uint64_t *num_objects, uint32_t *max_depth);
+
+    /**
+     * Check if a buffer holds a well-formed XML plist without importing
+     * it. The document is tokenized like plist_from_xml() does, checking
+     * tag balance and entities, but no nodes are allocated. Unlike the
+     * parser, which skips invalid characters, the content of data nodes
+     * must be strictly base64.
+     *
+     * @param plist_xml a pointer to the xml buffer.
+     * @param length length of the buffer to read.
+     * @param num_objects if not NULL, receives the number of values in the
+     *     document, not counting dictionary keys. Every dictionary entry
+     *     is counted, even if its key repeats.
+     * @param max_depth if not NULL, receives the nesting depth of the
+     *     document; a document with a non-structured root has depth 1.
+     * @return 0 if the buffer holds a valid XML plist, -1 otherwise.
+     */
+    int plist_validate_xml(const char *plist_xml, uint64_t length, uint64_t *num_objects, uint32_t *max_depth);
+
+    /********************************************
+     *                                          *
+     *           Binary plist views             *
+     *                                          *
+     ********************************************/
+
+    /**
+     * Open a read-only view over a binary plist.
+     * Unlike plist_from_bin(), nothing is decoded upfront; objects are
+     * located through the offset table of the binary plist and decoded
+     * only when they are accessed. The buffer must stay valid and
+     * unmodified until the view is closed.
+     *
+     * @param plist_bin a pointer to the binary buffer.
+     * @param length length of the buffer.
+     * @return a new view, or NULL if the buffer is not a valid binary plist.
+     *     Close it with plist_bin_view_close().
+     */
+    plist_bin_view_t plist_bin_view_open(const char *plist_bin, uint64_t length);
+
+    /**
+     * Close a view opened with plist_bin_view_open().
+     *
+     * @param view the view to close.
+     */
+    void plist_bin_view_close(plist_bin_view_t view);
+
+    /**
+     * Get the root object of a binary plist view.
+     *
+     * @param view the view.
+     * @return a reference to the root object.
+     */
+    plist_bin_ref_t plist_bin_view_get_root(plist_bin_view_t view);
+
+    /**
+     * Get the type of an object in a binary plist view.
+     *
+     * @param view the view.
+     * @param ref the object to look at.
+     * @return the type of the object, or #PLIST_NONE if ref is invalid.
+     */
+    plist_type plist_bin_view_get_type(plist_bin_view_t view, plist_bin_ref_t ref);
+
+    /**
+     * Get the number of items of an array or dictionary in a binary plist view.
+     *
+     * @param view the view.
+     * @param ref a #PLIST_ARRAY or #PLIST_DICT object.
+     * @return the number of items, or 0 if ref is not an array or dictionary.
+     */
+    uint64_t plist_bin_view_get_size(plist_bin_view_t view, plist_bin_ref_t ref);
+
+    /**
+     * Get the nth item of an array in a binary plist view.
+     *
+     * @param view the view.
+     * @param ref a #PLIST_ARRAY object.
+     * @param n the index of the item to get, starting at 0.
+     * @return a reference to the item, or #PLIST_BIN_REF_INVALID.
+     */
+    plist_bin_ref_t plist_bin_view_array_get_item(plist_bin_view_t view, plist_bin_ref_t ref, uint64_t n);
+
+    /**
+     * Look up an item of a dictionary in a binary plist view.
+     * The key is compared against the encoded key strings in the buffer;
+     * none of the other entries are decoded.
+     *
+     * @param view the view.
+     * @param ref a #PLIST_DICT object.
+     * @param key the key to look up.
+     * @return a reference to the item, or #PLIST_BIN_REF_INVALID.
+     */
+    plist_bin_ref_t plist_bin_view_dict_get_item(plist_bin_view_t view, plist_bin_ref_t ref, const char *key);
+
+    /**
+     * Get the nth entry of a dictionary in a binary plist view.
+     *
+     * @param view the view.
+     * @param ref a #PLIST_DICT object.
+     * @param n the index of the entry, starting at 0.
+     * @param key a location to store the key of the entry, or NULL. The
+     *     caller is responsible for freeing the returned string.
+     * @return a reference to the item, or #PLIST_BIN_REF_INVALID.
+     */
+    plist_bin_ref_t plist_bin_view_dict_get_item_at(plist_bin_view_t view, plist_bin_ref_t ref, uint64_t n, char **key);
+
+    /**
+     * Decode an object of a binary plist view into a #plist_t, including
+     * everything below it.
+     *
+     * @param view the view.
+     * @param ref the object to decode.
+     * @return the decoded node, or NULL on error. The caller is responsible
+     *     for freeing it with plist_free().
+     */
+    plist_t plist_bin_view_get_node(plist_bin_view_t view, plist_bin_ref_t ref);
+
+    /**
+     * Update a binary plist by appending to it.
+     *
+     * Instead of writing the whole document again, only the values of the
+     * changes and the arrays and dictionaries they are applied to are
+     * encoded, followed by a new offset table and trailer. Everything else
+     * keeps its place in the original buffer. The output of write_func is
+     * meant to be appended to plist_bin; the result is a valid binary plist
+     * with the changes applied.
+     *
+     * Changes to the same container are applied in the order given. A
+     * container that is referenced more than once in the document, as
+     * written by #PLIST_WRITE_COMPACT, changes everywhere.
+     *
+     * The data that is no longer referenced stays in the file. If it would
+     * exceed compact_threshold bytes, or if the new objects can not be
+     * referenced with the reference size of the original, the whole
+     * document is written instead, and has to replace plist_bin.
+     *
+     * @param plist_bin a pointer to the binary buffer. Only the objects
+     *     that are changed are checked for validity.
+     * @param length length of the buffer.
+     * @param changes the changes to apply, with references obtained from a
+     *     #plist_bin_view_t over plist_bin.
+     * @param num_changes number of changes.
+     * @param compact_threshold the number of unreferenced bytes above which
+     *     the document is written in full, or 0 to always append if possible.
+     * @param write_func function called with consecutive chunks of the output.
+     * @param user_data passed through to write_func.
+     * @return 0 if the output is to be appended to plist_bin, 1 if it is a
+     *     complete document replacing plist_bin, or -1 on error.
+     */
+    int plist_bin_update(const char *plist_bin, uint64_t length, const plist_bin_change_t *changes, uint64_t num_changes, uint64_t compact_threshold, plist_write_func_t write_func, void *user_data);
+
     /********************************************
      *                                          *
      *                 Utils                    *
@@ -22,25 +22,43 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "node.h"
 
+static node_t* create_node(node_t* parent) {
+	node_t* node = (node_t*)calloc(1, sizeof(node_t));
+	if (node && parent) {
+		node_attach(parent, node);
+	}
+	return node;
+}
+
+static void destroy_node(node_t* node) {
+	node_t* ch;
+	while ((ch = node_first_child(node))) {
+		node_detach(node, ch);
+		destroy_node(ch);
+	}
+	free(node);
+}
+
 int main(int argc, char* argv[]) {
 	puts("Creating root node");
-	node_t* root = node_create(NULL, NULL);
+	node_t* root = create_node(NULL);
 
 	puts("Creating child 1 node");
-	node_t* one = node_create(root, NULL);
+	node_t* one = create_node(root);
 	puts("Creating child 2 node");
-	node_t* two = node_create(root, NULL);
+	create_node(root);
 
 	puts("Creating child 3 node");
-	node_t* three = node_create(one, NULL);
+	create_node(one);
 
 	puts("Debugging root node");
 	node_debug(root);
 
 	puts("Destroying root node");
-	node_destroy(root);
+	destroy_node(root);
 	return 0;
 }
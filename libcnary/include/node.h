@@ -28,27 +28,27 @@
 
 #define NODE_TYPE 1;
 
-struct node_list_t;
-
-// This class implements the abstract iterator class
+// A node of the tree. It is meant to be embedded as the first member of the
+// actual node structure of the user, which also takes care of allocating it.
 typedef struct node_t {
-	// Super class
+	// Siblings
 	struct node_t* next;
 	struct node_t* prev;
-	unsigned int count;
 
 	// Local Members
-	void *data;
 	struct node_t* parent;
-	struct node_list_t* children;
-} node_t;
+	struct node_t* first;
+	struct node_t* last;
+	unsigned int count;
 
-void node_destroy(struct node_t* node);
-struct node_t* node_create(struct node_t* parent, void* data);
+	// Position of this node among its siblings
+	unsigned int index;
+} node_t;
 
 int node_attach(struct node_t* parent, struct node_t* child);
 int node_detach(struct node_t* parent, struct node_t* child);
 int node_insert(struct node_t* parent, unsigned int index, struct node_t* child);
+int node_replace(struct node_t* parent, struct node_t* old_child, struct node_t* new_child);
 
 unsigned int node_n_children(struct node_t* node);
 node_t* node_nth_child(struct node_t* node, unsigned int n);
@@ -57,8 +57,13 @@ node_t* node_prev_sibling(struct node_t* node);
 node_t* node_next_sibling(struct node_t* node);
 int node_child_position(struct node_t* parent, node_t* child);
 
-typedef void* (*copy_func_t)(const void *src);
-node_t* node_copy_deep(node_t* node, copy_func_t copy_func);
+// Depth-first walk of the subtree below root without recursion. Starting
+// with node = root and *leaving = 0, every node is returned once when it is
+// entered (*leaving == 0) and, if it has children, once more after all of
+// them when it is left (*leaving == 1). Setting *leaving to 1 on an entered
+// node skips its children. Only node itself is read, so it may be freed
+// once the next node was determined. Returns NULL when the walk is done.
+node_t* node_walk_next(node_t* root, node_t* node, int* leaving);
 
 void node_debug(struct node_t* node);
 
@@ -23,91 +23,128 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "node.h"
-#include "node_list.h"
 
-void node_destroy(node_t* node) {
-	if(!node) return;
+int node_attach(node_t* parent, node_t* child) {
+	if (!parent || !child) return -1;
+	// count and index would wrap around
+	if (parent->count == UINT_MAX) return -1;
 
-	if (node->children && node->children->count > 0) {
-		node_t* ch;
-		while ((ch = node->children->begin)) {
-			node_list_remove(node->children, ch);
-			node_destroy(ch);
-		}
+	// Setup our new node as the new last child
+	child->parent = parent;
+	child->next = NULL;
+	child->prev = parent->last;
+	child->index = parent->count;
+
+	if (parent->last) {
+		// but only if the parent has children already
+		parent->last->next = child;
+	} else {
+		// otherwise this is the first child
+		parent->first = child;
 	}
-	node_list_destroy(node->children);
-	node->children = NULL;
+	parent->last = child;
 
-	free(node);
+	parent->count++;
+	return 0;
 }
 
-node_t* node_create(node_t* parent, void* data) {
-	int error = 0;
+int node_detach(node_t* parent, node_t* child) {
+	if (!parent || !child) return -1;
+	if (child->parent != parent) return -1;
 
-	node_t* node = (node_t*) malloc(sizeof(node_t));
-	if(node == NULL) {
-		return NULL;
+	int node_index = (int)child->index;
+	node_t* n;
+
+	// the following siblings move up by one
+	for (n = child->next; n; n = n->next) {
+		n->index--;
 	}
-	memset(node, '\0', sizeof(node_t));
-
-	node->data = data;
-	node->next = NULL;
-	node->prev = NULL;
-	node->count = 0;
-	node->parent = NULL;
-	node->children = NULL;
-
-	// Pass NULL to create a root node
-	if(parent != NULL) {
-		// This is a child node so attach it to it's parent
-		error = node_attach(parent, node);
-		if(error < 0) {
-			// Unable to attach nodes
-			printf("ERROR: %d \"Unable to attach nodes\"\n", error);
-			node_destroy(node);
-			return NULL;
-		}
+
+	if (child->prev) {
+		child->prev->next = child->next;
+	} else {
+		// we just removed the first child
+		parent->first = child->next;
+	}
+	if (child->next) {
+		child->next->prev = child->prev;
+	} else {
+		// we just removed the last child
+		parent->last = child->prev;
 	}
+	child->next = NULL;
+	child->prev = NULL;
+	child->parent = NULL;
 
-	return node;
+	parent->count--;
+	return node_index;
 }
 
-int node_attach(node_t* parent, node_t* child) {
+int node_insert(node_t* parent, unsigned int node_index, node_t* child)
+{
 	if (!parent || !child) return -1;
-	child->parent = parent;
-	if(!parent->children) {
-		parent->children = node_list_create();
+	if (parent->count == UINT_MAX) return -1;
+	if (node_index >= parent->count) {
+		return node_attach(parent, child);
 	}
-	int res = node_list_add(parent->children, child);
-	if (res == 0) {
-		parent->count++;
+
+	// Find the child that will follow our new node
+	node_t* cur = parent->first;
+	unsigned int pos = 0;
+	while (pos < node_index) {
+		cur = cur->next;
+		pos++;
 	}
-	return res;
-}
 
-int node_detach(node_t* parent, node_t* child) {
-	if (!parent || !child) return -1;
-	int node_index = node_list_remove(parent->children, child);
-	if (node_index >= 0) {
-		parent->count--;
+	child->parent = parent;
+	child->index = node_index;
+	child->next = cur;
+	child->prev = cur->prev;
+	if (cur->prev) {
+		cur->prev->next = child;
+	} else {
+		// new first child
+		parent->first = child;
 	}
-	return node_index;
+	cur->prev = child;
+
+	// the following siblings move down by one
+	for (; cur; cur = cur->next) {
+		cur->index++;
+	}
+
+	parent->count++;
+	return 0;
 }
 
-int node_insert(node_t* parent, unsigned int node_index, node_t* child)
+int node_replace(node_t* parent, node_t* old_child, node_t* new_child)
 {
-	if (!parent || !child) return -1;
-	child->parent = parent;
-	if(!parent->children) {
-		parent->children = node_list_create();
+	if (!parent || !old_child || !new_child) return -1;
+	if (old_child->parent != parent) return -1;
+
+	// put the new node at the exact position of the old one
+	new_child->parent = parent;
+	new_child->index = old_child->index;
+	new_child->next = old_child->next;
+	new_child->prev = old_child->prev;
+	if (old_child->prev) {
+		old_child->prev->next = new_child;
+	} else {
+		parent->first = new_child;
 	}
-	int res = node_list_insert(parent->children, node_index, child);
-	if (res == 0) {
-		parent->count++;
+	if (old_child->next) {
+		old_child->next->prev = new_child;
+	} else {
+		parent->last = new_child;
 	}
-	return res;
+	old_child->next = NULL;
+	old_child->prev = NULL;
+	old_child->parent = NULL;
+
+	return (int)new_child->index;
 }
 
 static void _node_debug(node_t* node, unsigned int depth) {
@@ -120,7 +157,7 @@ static void _node_debug(node_t* node, unsigned int depth) {
 		printf("ROOT\n");
 	}
 
-	if(!node->children && node->parent) {
+	if(!node->first && node->parent) {
 		printf("LEAF\n");
 	} else {
 		if(node->parent) {
@@ -146,26 +183,18 @@ unsigned int node_n_children(struct node_t* node)
 
 node_t* node_nth_child(struct node_t* node, unsigned int n)
 {
-	if (!node || !node->children || !node->children->begin) return NULL;
-	unsigned int node_index = 0;
-	int found = 0;
-	node_t *ch;
-	for (ch = node_first_child(node); ch; ch = node_next_sibling(ch)) {
-		if (node_index++ == n) {
-			found = 1;
-			break;
-		}
-	}
-	if (!found) {
-		return NULL;
+	if (!node || n >= node->count) return NULL;
+	node_t *ch = node->first;
+	while (n-- > 0) {
+		ch = ch->next;
 	}
 	return ch;
 }
 
 node_t* node_first_child(struct node_t* node)
 {
-	if (!node || !node->children) return NULL;
-	return node->children->begin;
+	if (!node) return NULL;
+	return node->first;
 }
 
 node_t* node_prev_sibling(struct node_t* node)
@@ -182,35 +211,23 @@ node_t* node_next_sibling(struct node_t* node)
 
 int node_child_position(struct node_t* parent, node_t* child)
 {
-	if (!parent || !parent->children || !parent->children->begin || !child) return -1;
-	int node_index = 0;
-	int found = 0;
-	node_t *ch;
-	for (ch = node_first_child(parent); ch; ch = node_next_sibling(ch)) {
-		if (ch == child) {
-			found = 1;
-			break;
-		}
-		node_index++;
-	}
-	if (!found) {
-		return -1;
-	}
-	return node_index;
+	if (!parent || !child || child->parent != parent) return -1;
+	return (int)child->index;
 }
 
-node_t* node_copy_deep(node_t* node, copy_func_t copy_func)
+node_t* node_walk_next(node_t* root, node_t* node, int* leaving)
 {
 	if (!node) return NULL;
-	void *data = NULL;
-	if (copy_func) {
-		data = copy_func(node->data);
+	if (!*leaving && node->first) {
+		return node->first;
+	}
+	if (node == root) {
+		return NULL;
 	}
-	node_t* copy = node_create(NULL, data);
-	node_t* ch;
-	for (ch = node_first_child(node); ch; ch = node_next_sibling(ch)) {
-		node_t* cc = node_copy_deep(ch, copy_func);
-		node_attach(copy, cc);
+	if (node->next) {
+		*leaving = 0;
+		return node->next;
 	}
-	return copy;
+	*leaving = 1;
+	return node->parent;
 }
@@ -53,8 +53,8 @@ uint32_t Structure::GetSize() const
 std::string Structure::ToXml() const
 {
     char* xml = NULL;
-    uint32_t length = 0;
-    plist_to_xml(_node, &xml, &length);
+    uint64_t length = 0;
+    plist_to_xml64(_node, &xml, &length);
     std::string ret(xml, xml+length);
     free(xml);
     return ret;
@@ -63,8 +63,8 @@ std::string Structure::ToXml() const
 std::vector<char> Structure::ToBin() const
 {
     char* bin = NULL;
-    uint32_t length = 0;
-    plist_to_bin(_node, &bin, &length);
+    uint64_t length = 0;
+    plist_to_bin64(_node, &bin, &length);
     std::vector<char> ret(bin, bin+length);
     free(bin);
     return ret;
@@ -105,7 +105,7 @@ static Structure* ImportStruct(plist_t root)
 Structure* Structure::FromXml(const std::string& xml)
 {
     plist_t root = NULL;
-    plist_from_xml(xml.c_str(), xml.size(), &root);
+    plist_from_xml64(xml.c_str(), xml.size(), &root);
 
     return ImportStruct(root);
 }
@@ -113,7 +113,7 @@ Structure* Structure::FromXml(const std::string& xml)
 Structure* Structure::FromBin(const std::vector<char>& bin)
 {
     plist_t root = NULL;
-    plist_from_bin(&bin[0], bin.size(), &root);
+    plist_from_bin64(&bin[0], bin.size(), &root);
 
     return ImportStruct(root);
 
@@ -0,0 +1,130 @@
+/*
+ * arena.c
+ * simple arena (region) allocator implementation
+ *
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN 8
+#define ARENA_MIN_CHUNK 4096
+#define ARENA_ALIGN_SIZE(x) (((x) + (ARENA_ALIGN-1)) & ~((size_t)ARENA_ALIGN-1))
+#define ARENA_CHUNK_HEADER ARENA_ALIGN_SIZE(sizeof(arena_chunk_t))
+
+static arena_chunk_t *arena_chunk_new(size_t capacity)
+{
+	arena_chunk_t *chunk = (arena_chunk_t*)malloc(ARENA_CHUNK_HEADER + capacity);
+	if (!chunk) return NULL;
+	chunk->next = NULL;
+	chunk->capacity = capacity;
+	chunk->used = 0;
+	return chunk;
+}
+
+arena_t *arena_new(size_t initial)
+{
+	arena_t *arena = (arena_t*)malloc(sizeof(arena_t));
+	if (!arena) return NULL;
+	arena->chunk_size = (initial > ARENA_MIN_CHUNK) ? ARENA_ALIGN_SIZE(initial) : ARENA_MIN_CHUNK;
+	arena->chunks = arena_chunk_new(arena->chunk_size);
+	if (!arena->chunks) {
+		free(arena);
+		return NULL;
+	}
+	arena->cleanups = NULL;
+	arena->count = 0;
+	return arena;
+}
+
+void arena_free(arena_t *arena)
+{
+	if (!arena) return;
+	arena_cleanup_t *c = arena->cleanups;
+	while (c) {
+		c->func(c->ptr);
+		c = c->next;
+	}
+	arena_chunk_t *chunk = arena->chunks;
+	while (chunk) {
+		arena_chunk_t *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+	if (!arena) return NULL;
+	size = ARENA_ALIGN_SIZE(size);
+	arena_chunk_t *chunk = arena->chunks;
+	if (chunk->capacity - chunk->used < size) {
+		/* grow geometrically so that the number of chunks stays small */
+		arena->chunk_size <<= 1;
+		size_t capacity = (size > arena->chunk_size) ? size : arena->chunk_size;
+		chunk = arena_chunk_new(capacity);
+		if (!chunk) return NULL;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	void *ptr = (char*)chunk + ARENA_CHUNK_HEADER + chunk->used;
+	chunk->used += size;
+	arena->count++;
+	return ptr;
+}
+
+void *arena_calloc(arena_t *arena, size_t size)
+{
+	void *ptr = arena_alloc(arena, size);
+	if (ptr) {
+		memset(ptr, '\0', size);
+	}
+	return ptr;
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len)
+{
+	char *res = (char*)arena_alloc(arena, len+1);
+	if (!res) return NULL;
+	memcpy(res, str, len);
+	res[len] = '\0';
+	return res;
+}
+
+void arena_shrink(arena_t *arena, void *ptr, size_t old_size, size_t new_size)
+{
+	if (!arena || !ptr || new_size >= old_size) return;
+	arena_chunk_t *chunk = arena->chunks;
+	char *chunk_top = (char*)chunk + ARENA_CHUNK_HEADER + chunk->used;
+	/* only the most recent allocation can give back memory */
+	if ((char*)ptr + ARENA_ALIGN_SIZE(old_size) == chunk_top) {
+		chunk->used -= ARENA_ALIGN_SIZE(old_size) - ARENA_ALIGN_SIZE(new_size);
+	}
+}
+
+int arena_add_cleanup(arena_t *arena, arena_cleanup_func_t func, void *ptr)
+{
+	if (!arena || !func) return -1;
+	arena_cleanup_t *c = (arena_cleanup_t*)arena_alloc(arena, sizeof(arena_cleanup_t));
+	if (!c) return -1;
+	c->func = func;
+	c->ptr = ptr;
+	c->next = arena->cleanups;
+	arena->cleanups = c;
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * arena.h
+ * header file for simple arena (region) allocator
+ *
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef ARENA_H
+#define ARENA_H
+#include <stdlib.h>
+
+typedef void (*arena_cleanup_func_t)(void *ptr);
+
+typedef struct arena_chunk_t {
+	struct arena_chunk_t *next;
+	size_t capacity;
+	size_t used;
+} arena_chunk_t;
+
+typedef struct arena_cleanup_t {
+	struct arena_cleanup_t *next;
+	arena_cleanup_func_t func;
+	void *ptr;
+} arena_cleanup_t;
+
+typedef struct arena_t {
+	arena_chunk_t *chunks;
+	arena_cleanup_t *cleanups;
+	size_t chunk_size;
+	size_t count;
+} arena_t;
+
+arena_t *arena_new(size_t initial);
+void arena_free(arena_t *arena);
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_calloc(arena_t *arena, size_t size);
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+void arena_shrink(arena_t *arena, void *ptr, size_t old_size, size_t new_size);
+int arena_add_cleanup(arena_t *arena, arena_cleanup_func_t func, void *ptr);
+
+#endif
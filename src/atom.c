@@ -0,0 +1,167 @@
+/*
+ * atom.c
+ * interned, reference counted key strings
+ *
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <string.h>
+#include <stddef.h>
+#include "atom.h"
+#include "hashtable.h"
+#include "refcount.h"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+typedef struct atom_key_t {
+	const char *str;
+	size_t length;
+	unsigned int hash;
+} atom_key_t;
+
+typedef struct atom_t {
+	refcount_t refcount;
+	atom_key_t key;
+	char str[];
+} atom_t;
+
+#define ATOM_FROM_STR(s) ((atom_t*)((char*)(s) - offsetof(atom_t, str)))
+
+static hashtable_t *atom_table = NULL;
+
+#ifdef WIN32
+static CRITICAL_SECTION atom_mutex;
+#define ATOM_LOCK() EnterCriticalSection(&atom_mutex)
+#define ATOM_UNLOCK() LeaveCriticalSection(&atom_mutex)
+#else
+static pthread_mutex_t atom_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define ATOM_LOCK() pthread_mutex_lock(&atom_mutex)
+#define ATOM_UNLOCK() pthread_mutex_unlock(&atom_mutex)
+#endif
+
+static unsigned int atom_key_hash(const void *key)
+{
+	return ((const atom_key_t*)key)->hash;
+}
+
+static int atom_key_compare(const void *a, const void *b)
+{
+	const atom_key_t *key_a = (const atom_key_t*)a;
+	const atom_key_t *key_b = (const atom_key_t*)b;
+	if (key_a->length != key_b->length) {
+		return 0;
+	}
+	return (memcmp(key_a->str, key_b->str, key_a->length) == 0);
+}
+
+void atom_init(void)
+{
+#ifdef WIN32
+	InitializeCriticalSection(&atom_mutex);
+#endif
+}
+
+void atom_deinit(void)
+{
+	/* atoms may still be referenced by nodes that outlive the library,
+	 * so the table is left alone */
+}
+
+unsigned int atom_hash_str(const char *str, size_t len)
+{
+	/* djb2 */
+	unsigned int hash = 5381;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash = ((hash << 5) + hash) + (unsigned char)str[i];
+	}
+	return hash;
+}
+
+char *atom_intern(const char *str, size_t len)
+{
+	atom_key_t key;
+	key.str = str;
+	key.length = len;
+	key.hash = atom_hash_str(str, len);
+
+	ATOM_LOCK();
+	if (!atom_table) {
+		atom_table = hash_table_new(atom_key_hash, atom_key_compare, NULL);
+		if (!atom_table) {
+			ATOM_UNLOCK();
+			return NULL;
+		}
+	}
+	atom_t *atom = (atom_t*)hash_table_lookup(atom_table, &key);
+	if (atom && refcount_try_add(&atom->refcount)) {
+		ATOM_UNLOCK();
+		return atom->str;
+	}
+	/* not there yet, or a dying atom that is about to be released;
+	 * the latter is replaced in the table by the new one */
+	atom = (atom_t*)malloc(sizeof(atom_t) + len + 1);
+	if (!atom) {
+		ATOM_UNLOCK();
+		return NULL;
+	}
+	atom->refcount = 1;
+	memcpy(atom->str, str, len);
+	atom->str[len] = '\0';
+	atom->key.str = atom->str;
+	atom->key.length = len;
+	atom->key.hash = key.hash;
+	hash_table_remove(atom_table, &key);
+	hash_table_insert(atom_table, &atom->key, atom);
+	ATOM_UNLOCK();
+	return atom->str;
+}
+
+void atom_retain(const char *str)
+{
+	if (!str) return;
+	refcount_add(&ATOM_FROM_STR(str)->refcount, 1);
+}
+
+void atom_release(const char *str)
+{
+	if (!str) return;
+	atom_t *atom = ATOM_FROM_STR(str);
+	if (refcount_add(&atom->refcount, -1) > 0) {
+		return;
+	}
+	/* a released atom can not be revived, so only this thread gets here */
+	ATOM_LOCK();
+	if (hash_table_lookup(atom_table, &atom->key) == atom) {
+		hash_table_remove(atom_table, &atom->key);
+	}
+	ATOM_UNLOCK();
+	free(atom);
+}
+
+size_t atom_length(const char *str)
+{
+	return ATOM_FROM_STR(str)->key.length;
+}
+
+unsigned int atom_hash(const char *str)
+{
+	return ATOM_FROM_STR(str)->key.hash;
+}
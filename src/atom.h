@@ -1,10 +1,8 @@
 /*
- * node_list.h
+ * atom.h
+ * header file for interned, reference counted key strings
  *
- *  Created on: Mar 8, 2011
- *      Author: posixninja
- *
- * Copyright (c) 2011 Joshua Hill. All Rights Reserved.
+ * Copyright (c) 2026 agent, All Rights Reserved.
  *
  * This library is free software; you can redistribute it and/or
  * modify it under the terms of the GNU Lesser General Public
@@ -20,28 +18,23 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
+#ifndef ATOM_H
+#define ATOM_H
+#include <stdlib.h>
 
-#ifndef NODE_LIST_H_
-#define NODE_LIST_H_
-
-struct node_t;
-
-// This class implements the list_t abstract class
-typedef struct node_list_t {
-	// list_t members
-	struct node_t* begin;
-	struct node_t* end;
-
-	// node_list_t members
-	unsigned int count;
+/* Atoms are immutable, NUL-terminated strings that exist only once per
+ * process. They are handed out as plain char pointers, so two atoms are
+ * equal exactly if the pointers are equal. */
 
-} node_list_t;
+void atom_init(void);
+void atom_deinit(void);
 
-void node_list_destroy(struct node_list_t* list);
-struct node_list_t* node_list_create();
+unsigned int atom_hash_str(const char *str, size_t len);
 
-int node_list_add(node_list_t* list, node_t* node);
-int node_list_insert(node_list_t* list, unsigned int index, node_t* node);
-int node_list_remove(node_list_t* list, node_t* node);
+char *atom_intern(const char *str, size_t len);
+void atom_retain(const char *atom);
+void atom_release(const char *atom);
+size_t atom_length(const char *atom);
+unsigned int atom_hash(const char *atom);
 
-#endif /* NODE_LIST_H_ */
+#endif
@@ -71,14 +71,10 @@ size_t base64encode(char *outbuf, const unsigned char *buf, size_t size)
 	return m;
 }
 
-unsigned char *base64decode(const char *buf, size_t *size)
+size_t base64decode_buf(unsigned char *outbuf, const char *buf, size_t len)
 {
-	if (!buf || !size) return NULL;
-	size_t len = (*size > 0) ? *size : strlen(buf);
-	if (len <= 0) return NULL;
-	unsigned char *outbuf = (unsigned char*)malloc((len/4)*3+3);
 	const char *ptr = buf;
-	int p = 0;
+	size_t p = 0;
 	int wv, w1, w2, w3, w4;
 	int tmpval[4];
 	int tmpcnt = 0;
@@ -114,6 +110,31 @@ unsigned char *base64decode(const char *buf, size_t *size)
 	} while (1);
 
 	outbuf[p] = 0;
-	*size = p;
+	return p;
+}
+
+unsigned char *base64decode(const char *buf, size_t *size)
+{
+	if (!buf || !size) return NULL;
+	size_t len = (*size > 0) ? *size : strlen(buf);
+	if (len <= 0) return NULL;
+	unsigned char *outbuf = (unsigned char*)malloc(BASE64_DECODE_BUFSIZE(len));
+	if (!outbuf) return NULL;
+	*size = base64decode_buf(outbuf, buf, len);
 	return outbuf;
 }
+
+int base64check(const char *buf, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)buf[i];
+		if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+			continue;
+		}
+		if (base64_table[c] == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
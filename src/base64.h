@@ -22,7 +22,14 @@
 #define BASE64_H
 #include <stdlib.h>
 
+/* size of the output buffer base64decode_buf() needs for len input bytes */
+#define BASE64_DECODE_BUFSIZE(len) (((len)/4)*3+3)
+
 size_t base64encode(char *outbuf, const unsigned char *buf, size_t size);
+size_t base64decode_buf(unsigned char *outbuf, const char *buf, size_t len);
 unsigned char *base64decode(const char *buf, size_t *size);
 
+/* 0 if buf only holds base64 characters, padding and whitespace, -1 otherwise */
+int base64check(const char *buf, size_t len);
+
 #endif
@@ -31,12 +31,24 @@
 
 #include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#ifdef WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#endif
 
 #include <plist/plist.h>
 #include "plist.h"
 #include "hashtable.h"
 #include "bytearray.h"
 #include "ptrarray.h"
+#include "atom.h"
+#include "refbuf.h"
+#include "utf.h"
 
 #include <node.h>
 
@@ -47,6 +59,8 @@
 #define BPLIST_VERSION          ((uint8_t*)"00")
 #define BPLIST_VERSION_SIZE     2
 
+#define BPLIST_STREAM_BUFSIZE   65536
+
 typedef struct __attribute__((packed)) {
     uint8_t unused[6];
     uint8_t offset_size;
@@ -200,10 +214,47 @@ struct bplist_data {
     uint8_t ref_size;
     uint8_t offset_size;
     const char* offset_table;
+    uint64_t* offsets;
     uint32_t level;
-    ptrarray_t* used_indexes;
+    uint8_t* on_path;
+    arena_t* arena;
+    char** keys;
+    int borrow;
+    plist_t* objects;
+    uint64_t budget;
+    volatile uint64_t* budget_pool;
+    int parallel;
 };
 
+/* on_path holds one bit per object, set while the object is being decoded,
+ * i.e. while it is an ancestor of the objects decoded below it */
+#define BPLIST_ON_PATH_SIZE(num_objects) (((num_objects) + 7) / 8)
+#define BPLIST_ON_PATH(bplist, i) ((bplist)->on_path[(i) >> 3] & (1 << ((i) & 7)))
+#define BPLIST_SET_ON_PATH(bplist, i) ((bplist)->on_path[(i) >> 3] |= (uint8_t)(1 << ((i) & 7)))
+#define BPLIST_CLEAR_ON_PATH(bplist, i) ((bplist)->on_path[(i) >> 3] &= (uint8_t)~(1 << ((i) & 7)))
+
+/* Objects may be referenced any number of times, so a small file can
+ * describe a huge tree. The number of nodes a parse may create is limited
+ * to this many per input byte (but at least BPLIST_MIN_NODE_BUDGET). */
+#define BPLIST_NODES_PER_BYTE 8
+#define BPLIST_MIN_NODE_BUDGET (1 << 20)
+
+/* Workers of a parallel parse take their node budget from a shared pool
+ * in batches of this size. */
+#define BPLIST_BUDGET_BATCH 4096
+
+/* A parallel parse uses at most this many threads, and at least this many
+ * root entries per thread. */
+#define BPLIST_PARALLEL_MAX_THREADS 64
+#define BPLIST_PARALLEL_MIN_ENTRIES 4
+
+/* Encoding objects is cheap, so a parallel write uses at least this many
+ * objects per thread. */
+#define BPLIST_PARALLEL_MIN_OBJECTS 4096
+
+/* number of threads for parallel parsing and writing, 0 for one per CPU */
+static long plist_bin_threads = 0;
+
 #ifdef DEBUG
 static int plist_bin_debug = 0;
 #define PLIST_BIN_ERR(...) if (plist_bin_debug) { fprintf(stderr, "libplist[binparser] ERROR: " __VA_ARGS__); }
@@ -214,6 +265,13 @@ static int plist_bin_debug = 0;
 void plist_bin_init(void)
 {
     /* init binary plist stuff */
+    char *env_threads = getenv("PLIST_BIN_THREADS");
+    if (env_threads) {
+        plist_bin_threads = strtol(env_threads, NULL, 10);
+        if (plist_bin_threads < 0) {
+            plist_bin_threads = 0;
+        }
+    }
 #ifdef DEBUG
     char *env_debug = getenv("PLIST_BIN_DEBUG");
     if (env_debug && !strcmp(env_debug, "1")) {
@@ -227,11 +285,19 @@ void plist_bin_deinit(void)
     /* deinit binary plist stuff */
 }
 
-static plist_t parse_bin_node_at_index(struct bplist_data *bplist, uint32_t node_index);
+static plist_t parse_bin_node_at_index(struct bplist_data *bplist, uint64_t node_index);
+static void bplist_release_keys(struct bplist_data *bplist);
+
+static plist_t bplist_new_node(struct bplist_data *bplist)
+{
+    /* the root object is parsed at level 1 */
+    return plist_new_node_in(bplist->arena, bplist->level == 1);
+}
 
-static plist_t parse_uint_node(const char **bnode, uint8_t size)
+static plist_t parse_uint_node(struct bplist_data *bplist, const char **bnode, uint8_t size)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = bplist_new_node(bplist);
+    plist_data_t data = plist_get_data(node);
 
     size = 1 << size;			// make length less misleading
     switch (size)
@@ -246,7 +312,7 @@ static plist_t parse_uint_node(const char **bnode, uint8_t size)
         data->length = size;
         break;
     default:
-        free(data);
+        plist_free(node);
         PLIST_BIN_ERR("%s: Invalid byte size for integer node\n", __func__);
         return NULL;
     };
@@ -256,12 +322,13 @@ static plist_t parse_uint_node(const char **bnode, uint8_t size)
     (*bnode) += size;
     data->type = PLIST_UINT;
 
-    return node_create(NULL, data);
+    return node;
 }
 
-static plist_t parse_real_node(const char **bnode, uint8_t size)
+static plist_t parse_real_node(struct bplist_data *bplist, const char **bnode, uint8_t size)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = bplist_new_node(bplist);
+    plist_data_t data = plist_get_data(node);
     uint8_t buf[8];
 
     size = 1 << size;			// make length less misleading
@@ -276,19 +343,19 @@ static plist_t parse_real_node(const char **bnode, uint8_t size)
         data->realval = *(double *) buf;
         break;
     default:
-        free(data);
+        plist_free(node);
         PLIST_BIN_ERR("%s: Invalid byte size for real node\n", __func__);
         return NULL;
     }
     data->type = PLIST_REAL;
     data->length = sizeof(double);
 
-    return node_create(NULL, data);
+    return node;
 }
 
-static plist_t parse_date_node(const char **bnode, uint8_t size)
+static plist_t parse_date_node(struct bplist_data *bplist, const char **bnode, uint8_t size)
 {
-    plist_t node = parse_real_node(bnode, size);
+    plist_t node = parse_real_node(bplist, bnode, size);
     plist_data_t data = plist_get_data(node);
 
     data->type = PLIST_DATE;
@@ -296,14 +363,20 @@ static plist_t parse_date_node(const char **bnode, uint8_t size)
     return node;
 }
 
-static plist_t parse_string_node(const char **bnode, uint64_t size)
+static plist_t parse_string_node(struct bplist_data *bplist, const char **bnode, uint64_t size)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = bplist_new_node(bplist);
+    plist_data_t data = plist_get_data(node);
 
     data->type = PLIST_STRING;
-    data->strval = (char *) malloc(sizeof(char) * (size + 1));
+    if (bplist->arena) {
+        data->strval = (char *) arena_alloc(bplist->arena, sizeof(char) * (size + 1));
+    } else {
+        data->strval = (char *) refbuf_alloc(sizeof(char) * (size + 1));
+        data->flags |= PLIST_FLAG_REFBUF;
+    }
     if (!data->strval) {
-        plist_free_data(data);
+        plist_free(node);
         PLIST_BIN_ERR("%s: Could not allocate %" PRIu64 " bytes\n", __func__, sizeof(char) * (size + 1));
         return NULL;
     }
@@ -311,173 +384,585 @@ static plist_t parse_string_node(const char **bnode, uint64_t size)
     data->strval[size] = '\0';
     data->length = strlen(data->strval);
 
-    return node_create(NULL, data);
-}
-
-static char *plist_utf16be_to_utf8(uint16_t *unistr, long len, long *items_read, long *items_written)
-{
-	if (!unistr || (len <= 0)) return NULL;
-	char *outbuf;
-	int p = 0;
-	long i = 0;
-
-	uint16_t wc;
-	uint32_t w;
-	int read_lead_surrogate = 0;
-
-	outbuf = (char*)malloc(4*(len+1));
-	if (!outbuf) {
-		PLIST_BIN_ERR("%s: Could not allocate %" PRIu64 " bytes\n", __func__, (uint64_t)(4*(len+1)));
-		return NULL;
-	}
-
-	while (i < len) {
-		wc = be16toh(get_unaligned(unistr + i));
-		i++;
-		if (wc >= 0xD800 && wc <= 0xDBFF) {
-			if (!read_lead_surrogate) {
-				read_lead_surrogate = 1;
-				w = 0x010000 + ((wc & 0x3FF) << 10);
-			} else {
-				// This is invalid, the next 16 bit char should be a trail surrogate. 
-				// Handling error by skipping.
-				read_lead_surrogate = 0;
-			}
-		} else if (wc >= 0xDC00 && wc <= 0xDFFF) {
-			if (read_lead_surrogate) {
-				read_lead_surrogate = 0;
-				w = w | (wc & 0x3FF);
-				outbuf[p++] = (char)(0xF0 + ((w >> 18) & 0x7));
-				outbuf[p++] = (char)(0x80 + ((w >> 12) & 0x3F));
-				outbuf[p++] = (char)(0x80 + ((w >> 6) & 0x3F));
-				outbuf[p++] = (char)(0x80 + (w & 0x3F));
-			} else {
-				// This is invalid.  A trail surrogate should always follow a lead surrogate.
-				// Handling error by skipping
-			}
-		} else if (wc >= 0x800) {
-			outbuf[p++] = (char)(0xE0 + ((wc >> 12) & 0xF));
-			outbuf[p++] = (char)(0x80 + ((wc >> 6) & 0x3F));
-			outbuf[p++] = (char)(0x80 + (wc & 0x3F));
-		} else if (wc >= 0x80) {
-			outbuf[p++] = (char)(0xC0 + ((wc >> 6) & 0x1F));
-			outbuf[p++] = (char)(0x80 + (wc & 0x3F));
-		} else {
-			outbuf[p++] = (char)(wc & 0x7F);
-		}
-	}
-	if (items_read) {
-		*items_read = i;
-	}
-	if (items_written) {
-		*items_written = p;
-	}
-	outbuf[p] = 0;
-
-	return outbuf;
-}
-
-static plist_t parse_unicode_node(const char **bnode, uint64_t size)
-{
-    plist_data_t data = plist_new_plist_data();
+    return node;
+}
+
+static plist_t parse_unicode_node(struct bplist_data *bplist, const char **bnode, uint64_t size)
+{
+    plist_t node = bplist_new_node(bplist);
+    plist_data_t data = plist_get_data(node);
     char *tmpstr = NULL;
-    long items_read = 0;
-    long items_written = 0;
+    size_t len = 0;
 
     data->type = PLIST_STRING;
 
-    tmpstr = plist_utf16be_to_utf8((uint16_t*)(*bnode), size, &items_read, &items_written);
+    if (size == 0) {
+        plist_free(node);
+        return NULL;
+    }
+    /* size the buffer exactly, the ASCII fast path makes this cheap */
+    len = utf16be_to_utf8((const uint8_t*)*bnode, size, NULL);
+    if (bplist->arena) {
+        tmpstr = (char*)arena_alloc(bplist->arena, len+1);
+    } else {
+        tmpstr = (char*)refbuf_alloc(len+1);
+        data->flags |= PLIST_FLAG_REFBUF;
+    }
     if (!tmpstr) {
-        plist_free_data(data);
+        plist_free(node);
+        PLIST_BIN_ERR("%s: Could not allocate %" PRIu64 " bytes\n", __func__, (uint64_t)(len+1));
         return NULL;
     }
-    tmpstr[items_written] = '\0';
-
-    data->type = PLIST_STRING;
-    data->strval = realloc(tmpstr, items_written+1);
-    if (!data->strval)
-        data->strval = tmpstr;
-    data->length = items_written;
-    return node_create(NULL, data);
+    utf16be_to_utf8((const uint8_t*)*bnode, size, tmpstr);
+    data->strval = tmpstr;
+    data->length = len;
+    return node;
 }
 
-static plist_t parse_data_node(const char **bnode, uint64_t size)
+static plist_t parse_data_node(struct bplist_data *bplist, const char **bnode, uint64_t size)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = bplist_new_node(bplist);
+    plist_data_t data = plist_get_data(node);
 
     data->type = PLIST_DATA;
     data->length = size;
-    data->buff = (uint8_t *) malloc(sizeof(uint8_t) * size);
+    if (bplist->borrow) {
+        /* the caller keeps the input buffer alive for us */
+        data->buff = (uint8_t *) *bnode;
+        data->flags |= PLIST_FLAG_BORROWED;
+        return node;
+    }
+    if (bplist->arena) {
+        data->buff = (uint8_t *) arena_alloc(bplist->arena, sizeof(uint8_t) * size);
+    } else {
+        data->buff = (uint8_t *) refbuf_alloc(sizeof(uint8_t) * size);
+        data->flags |= PLIST_FLAG_REFBUF;
+    }
     if (!data->strval) {
-        plist_free_data(data);
+        plist_free(node);
         PLIST_BIN_ERR("%s: Could not allocate %" PRIu64 " bytes\n", __func__, sizeof(uint8_t) * size);
         return NULL;
     }
     memcpy(data->buff, *bnode, sizeof(uint8_t) * size);
 
-    return node_create(NULL, data);
+    return node;
 }
 
-static plist_t parse_dict_node(struct bplist_data *bplist, const char** bnode, uint64_t size)
+static inline uint64_t bplist_atomic_fetch_add(volatile uint64_t *ptr, uint64_t n)
 {
-    uint64_t j;
-    uint64_t str_i = 0, str_j = 0;
-    uint64_t index1, index2;
-    plist_data_t data = plist_new_plist_data();
-    const char *index1_ptr = NULL;
-    const char *index2_ptr = NULL;
+#ifdef WIN32
+    return (uint64_t)InterlockedExchangeAdd64((volatile LONG64*)ptr, (LONG64)n);
+#else
+    return __atomic_fetch_add(ptr, n, __ATOMIC_ACQ_REL);
+#endif
+}
 
-    data->type = PLIST_DICT;
-    data->length = size;
+/* take up to n from a shared counter, returns the amount taken */
+static uint64_t bplist_atomic_take(volatile uint64_t *ptr, uint64_t n)
+{
+#ifdef WIN32
+    LONG64 cur = *(volatile LONG64*)ptr;
+    while (cur > 0) {
+        LONG64 take = ((uint64_t)cur < n) ? cur : (LONG64)n;
+        LONG64 prev = InterlockedCompareExchange64((volatile LONG64*)ptr, cur - take, cur);
+        if (prev == cur) return (uint64_t)take;
+        cur = prev;
+    }
+#else
+    uint64_t cur = __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+    while (cur > 0) {
+        uint64_t take = (cur < n) ? cur : n;
+        if (__atomic_compare_exchange_n(ptr, &cur, cur - take, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return take;
+        }
+    }
+#endif
+    return 0;
+}
 
-    plist_t node = node_create(NULL, data);
+static int bplist_charge_node(struct bplist_data *bplist)
+{
+    if (bplist->budget == 0 && bplist->budget_pool) {
+        bplist->budget = bplist_atomic_take(bplist->budget_pool, BPLIST_BUDGET_BATCH);
+    }
+    if (bplist->budget == 0) {
+        PLIST_BIN_ERR("node budget exhausted, too many object references\n");
+        return 0;
+    }
+    bplist->budget--;
+    return 1;
+}
 
-    for (j = 0; j < data->length; j++) {
-        str_i = j * bplist->ref_size;
-        str_j = (j + size) * bplist->ref_size;
-        index1_ptr = (*bnode) + str_i;
-        index2_ptr = (*bnode) + str_j;
+/* Make another instance of an already decoded object. This is a lot
+ * cheaper than decoding it again; the payload is shared with the source
+ * since nothing ever modifies it in place. */
+static plist_t bplist_clone_single(struct bplist_data *bplist, plist_t src)
+{
+    if (!bplist_charge_node(bplist)) {
+        return NULL;
+    }
+    plist_t node = plist_new_node_in(bplist->arena, 0);
+    if (!node) {
+        return NULL;
+    }
+    plist_data_t srcdata = plist_get_data(src);
+    plist_data_t data = plist_get_data(node);
+    uint32_t flags = data->flags;
+    memcpy(data, srcdata, sizeof(struct plist_data_s));
+    data->flags = flags;
 
-        if ((index1_ptr < bplist->data || index1_ptr + bplist->ref_size > bplist->offset_table) ||
-            (index2_ptr < bplist->data || index2_ptr + bplist->ref_size > bplist->offset_table)) {
-            plist_free(node);
-            PLIST_BIN_ERR("%s: dict entry %" PRIu64 " is outside of valid range\n", __func__, j);
-            return NULL;
+    switch (data->type) {
+    case PLIST_KEY:
+        if (srcdata->flags & PLIST_FLAG_ATOM) {
+            atom_retain(data->strval);
+            data->flags |= PLIST_FLAG_ATOM;
+        }
+        break;
+    case PLIST_STRING:
+        if (srcdata->flags & PLIST_FLAG_REFBUF) {
+            refbuf_retain(data->strval);
+            data->flags |= PLIST_FLAG_REFBUF;
+        }
+        break;
+    case PLIST_DATA:
+        if (srcdata->flags & PLIST_FLAG_BORROWED) {
+            data->flags |= PLIST_FLAG_BORROWED;
+        } else if (srcdata->flags & PLIST_FLAG_REFBUF) {
+            refbuf_retain(data->buff);
+            data->flags |= PLIST_FLAG_REFBUF;
+        }
+        break;
+    case PLIST_ARRAY:
+        data->hashtable = NULL;
+        if (((node_t*)src)->count > 0) {
+            ptrarray_t *pa = ptr_array_new(((node_t*)src)->count);
+            if (pa && bplist->arena && arena_add_cleanup(bplist->arena, plist_arena_free_ptrarray, pa) < 0) {
+                /* go without a lookup array rather than leak it */
+                ptr_array_free(pa);
+                pa = NULL;
+            }
+            data->hashtable = pa;
         }
+        break;
+    case PLIST_DICT:
+        /* built once the entries are attached */
+        data->hashtable = NULL;
+        break;
+    default:
+        break;
+    }
 
-        index1 = UINT_TO_HOST(index1_ptr, bplist->ref_size);
-        index2 = UINT_TO_HOST(index2_ptr, bplist->ref_size);
+    return node;
+}
 
-        if (index1 >= bplist->num_objects) {
-            plist_free(node);
-            PLIST_BIN_ERR("%s: dict entry %" PRIu64 ": key index (%" PRIu64 ") must be smaller than the number of objects (%" PRIu64 ")\n", __func__, j, index1, bplist->num_objects);
-            return NULL;
+static plist_t bplist_clone_node(struct bplist_data *bplist, plist_t src)
+{
+    node_t *top = (node_t*)src;
+    node_t *cur = top;
+    node_t *clone = NULL;
+    node_t *parent = NULL;
+    int leaving = 0;
+    while (cur) {
+        if (leaving) {
+            if (plist_get_data(parent)->type == PLIST_DICT) {
+                plist_dict_index_in(bplist->arena, parent);
+            }
+            parent = parent->parent;
+        } else {
+            node_t *node = (node_t*)bplist_clone_single(bplist, cur);
+            if (!node) {
+                plist_free(clone);
+                return NULL;
+            }
+            if (parent) {
+                plist_data_t pdata = plist_get_data(parent);
+                node_attach(parent, node);
+                if (pdata->type == PLIST_ARRAY && pdata->hashtable) {
+                    ptr_array_add((ptrarray_t*)pdata->hashtable, node);
+                }
+            } else {
+                clone = node;
+            }
+            if (cur->first) {
+                parent = node;
+            }
         }
-        if (index2 >= bplist->num_objects) {
-            plist_free(node);
-            PLIST_BIN_ERR("%s: dict entry %" PRIu64 ": value index (%" PRIu64 ") must be smaller than the number of objects (%" PRIu64 ")\n", __func__, j, index1, bplist->num_objects);
+        cur = node_walk_next(top, cur, &leaving);
+    }
+    return clone;
+}
+
+/* Keys repeat a lot and the writer stores each distinct key only once,
+ * so the string of every key object is kept per object index and shared
+ * by all key nodes referring to it: an interned atom for heap nodes, or
+ * a single arena copy for arena documents. */
+static plist_t parse_key_node_at_index(struct bplist_data *bplist, uint64_t key_index)
+{
+    if (!bplist->keys) {
+        bplist->keys = (char**)calloc(bplist->num_objects, sizeof(char*));
+    }
+    if (bplist->keys && bplist->keys[key_index]) {
+        if (!bplist_charge_node(bplist)) {
             return NULL;
         }
-
-        /* process key node */
-        plist_t key = parse_bin_node_at_index(bplist, index1);
+        plist_t key = plist_new_node_in(bplist->arena, 0);
         if (!key) {
-            plist_free(node);
             return NULL;
         }
+        plist_data_t data = plist_get_data(key);
+        data->type = PLIST_KEY;
+        data->strval = bplist->keys[key_index];
+        if (bplist->arena) {
+            data->length = strlen(data->strval);
+        } else {
+            atom_retain(data->strval);
+            data->length = atom_length(data->strval);
+            data->flags |= PLIST_FLAG_ATOM;
+        }
+        return key;
+    }
+
+    plist_t key = parse_bin_node_at_index(bplist, key_index);
+    if (!key) {
+        return NULL;
+    }
+    plist_data_t data = plist_get_data(key);
+    if (data->type != PLIST_STRING || !data->strval) {
+        plist_free(key);
+        return NULL;
+    }
 
-        if (plist_get_data(key)->type != PLIST_STRING) {
-            PLIST_BIN_ERR("%s: dict entry %" PRIu64 ": invalid node type for key\n", __func__, j);
+    /* enforce key type */
+    data->type = PLIST_KEY;
+    if (bplist->objects) {
+        /* the node is a key now and can't be cloned as string value */
+        bplist->objects[key_index] = NULL;
+    }
+    if (!bplist->arena) {
+        char *atom = atom_intern(data->strval, data->length);
+        if (!atom) {
             plist_free(key);
+            return NULL;
+        }
+        refbuf_release(data->strval);
+        data->strval = atom;
+        data->flags = (data->flags & ~PLIST_FLAG_REFBUF) | PLIST_FLAG_ATOM;
+        if (bplist->keys) {
+            /* the cache holds a reference of its own */
+            atom_retain(atom);
+        }
+    }
+    if (bplist->keys) {
+        bplist->keys[key_index] = data->strval;
+    }
+    return key;
+}
+
+/* make sure the count references of a container starting at refs are
+ * within the object data, so that they can be read without further checks */
+static int bplist_check_refs(struct bplist_data *bplist, const char *refs, uint64_t count)
+{
+    if (refs < bplist->data || refs > bplist->offset_table || count * bplist->ref_size > (uint64_t)(bplist->offset_table - refs)) {
+        PLIST_BIN_ERR("%s: references point outside of valid range\n", __func__);
+        return 0;
+    }
+    return 1;
+}
+
+/* read reference n of a run of references checked with bplist_check_refs() */
+static int bplist_read_ref(struct bplist_data *bplist, const char *refs, uint64_t n, uint64_t *index)
+{
+    *index = UINT_TO_HOST(refs + n * bplist->ref_size, bplist->ref_size);
+
+    if (*index >= bplist->num_objects) {
+        PLIST_BIN_ERR("%s: reference %" PRIu64 ": object index (%" PRIu64 ") must be smaller than the number of objects (%" PRIu64 ")\n", __func__, n, *index, bplist->num_objects);
+        return 0;
+    }
+    return 1;
+}
+
+struct bplist_parallel {
+    const char *refs;
+    uint64_t count;
+    int is_dict;
+    uint64_t batch;
+    volatile uint64_t next;
+    plist_t *keys;
+    plist_t *values;
+};
+
+struct bplist_worker {
+    struct bplist_data bplist;
+    struct bplist_parallel *job;
+    int failed;
+};
+
+static void bplist_parallel_work(void *arg)
+{
+    struct bplist_worker *worker = (struct bplist_worker*)arg;
+    struct bplist_parallel *job = worker->job;
+    struct bplist_data *bplist = &worker->bplist;
+
+    if (worker->failed) {
+        return;
+    }
+    while (1) {
+        uint64_t j = bplist_atomic_fetch_add(&job->next, job->batch);
+        uint64_t end;
+        if (j >= job->count) {
+            break;
+        }
+        end = (job->count - j < job->batch) ? job->count : j + job->batch;
+        for (; j < end; j++) {
+            uint64_t index;
+            if (job->is_dict) {
+                if (!bplist_read_ref(bplist, job->refs, j, &index)) {
+                    goto fail;
+                }
+                job->keys[j] = parse_key_node_at_index(bplist, index);
+                if (!job->keys[j]) {
+                    PLIST_BIN_ERR("%s: dict entry %" PRIu64 ": invalid key\n", __func__, j);
+                    goto fail;
+                }
+                if (!bplist_read_ref(bplist, job->refs, j + job->count, &index)) {
+                    goto fail;
+                }
+            } else if (!bplist_read_ref(bplist, job->refs, j, &index)) {
+                goto fail;
+            }
+            job->values[j] = parse_bin_node_at_index(bplist, index);
+            if (!job->values[j]) {
+                goto fail;
+            }
+        }
+    }
+    return;
+
+fail:
+    worker->failed = 1;
+    /* make the other workers run out of entries */
+    bplist_atomic_fetch_add(&job->next, job->count);
+}
+
+struct bplist_thread {
+    void (*func)(void*);
+    void *arg;
+    int started;
+#ifdef WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+};
+
+#ifdef WIN32
+static DWORD WINAPI bplist_thread_main(LPVOID arg)
+{
+    struct bplist_thread *thread = (struct bplist_thread*)arg;
+    thread->func(thread->arg);
+    return 0;
+}
+#else
+static void* bplist_thread_main(void *arg)
+{
+    struct bplist_thread *thread = (struct bplist_thread*)arg;
+    thread->func(thread->arg);
+    return NULL;
+}
+#endif
+
+/* Call func on nthreads threads, the calling one included, and wait for
+ * all of them. Thread i gets args + i*arg_size. If a thread can't be
+ * started, its call is made on the calling thread instead. */
+static void bplist_run_threads(unsigned int nthreads, void (*func)(void*), void *args, size_t arg_size)
+{
+    struct bplist_thread *threads = (struct bplist_thread*)calloc(nthreads, sizeof(struct bplist_thread));
+    unsigned int i;
+
+    for (i = 1; threads && i < nthreads; i++) {
+        threads[i].func = func;
+        threads[i].arg = (char*)args + i * arg_size;
+#ifdef WIN32
+        threads[i].handle = CreateThread(NULL, 0, bplist_thread_main, &threads[i], 0, NULL);
+        threads[i].started = (threads[i].handle != NULL);
+#else
+        threads[i].started = (pthread_create(&threads[i].handle, NULL, bplist_thread_main, &threads[i]) == 0);
+#endif
+    }
+
+    func(args);
+
+    for (i = 1; i < nthreads; i++) {
+        if (threads && threads[i].started) {
+#ifdef WIN32
+            WaitForSingleObject(threads[i].handle, INFINITE);
+            CloseHandle(threads[i].handle);
+#else
+            pthread_join(threads[i].handle, NULL);
+#endif
+        } else {
+            func((char*)args + i * arg_size);
+        }
+    }
+    free(threads);
+}
+
+/* number of threads to process count items with, given that a thread
+ * should have at least min_per_thread of them */
+static unsigned int bplist_parallel_threads(uint64_t count, uint64_t min_per_thread)
+{
+    long ncpu = plist_bin_threads;
+    if (ncpu == 0) {
+#ifdef WIN32
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        ncpu = (long)si.dwNumberOfProcessors;
+#else
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    }
+    if (ncpu < 1) {
+        /* unknown, do not guess */
+        return 1;
+    }
+    if (ncpu > BPLIST_PARALLEL_MAX_THREADS) {
+        ncpu = BPLIST_PARALLEL_MAX_THREADS;
+    }
+    if (count / min_per_thread < (uint64_t)ncpu) {
+        return (unsigned int)(count / min_per_thread);
+    }
+    return (unsigned int)ncpu;
+}
+
+/* Decode the entries of the root container on nthreads threads (including
+ * the calling one) and attach them to node in order. Every worker has its
+ * own recursion tracking, object and key caches; only the node budget is
+ * shared. The caches are indexed by object, but a worker only touches the
+ * pages for the objects it actually decodes. */
+static plist_t parse_root_entries_parallel(struct bplist_data *bplist, plist_t node, const char *refs, uint64_t count, int is_dict, unsigned int nthreads)
+{
+    plist_data_t data = plist_get_data(node);
+    struct bplist_parallel job;
+    struct bplist_worker *workers = NULL;
+    volatile uint64_t budget_pool = bplist->budget;
+    unsigned int i;
+    uint64_t j;
+    int failed = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.refs = refs;
+    job.count = count;
+    job.is_dict = is_dict;
+    job.batch = count / ((uint64_t)nthreads * 16);
+    if (job.batch == 0) {
+        job.batch = 1;
+    }
+    job.next = 0;
+    job.values = (plist_t*)calloc(count, sizeof(plist_t));
+    if (is_dict) {
+        job.keys = (plist_t*)calloc(count, sizeof(plist_t));
+    }
+    workers = (struct bplist_worker*)calloc(nthreads, sizeof(struct bplist_worker));
+    if (!job.values || (is_dict && !job.keys) || !workers) {
+        PLIST_BIN_ERR("%s: out of memory\n", __func__);
+        free(job.values);
+        free(job.keys);
+        free(workers);
+        plist_free(node);
+        return NULL;
+    }
+    bplist->budget = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        struct bplist_data *wb = &workers[i].bplist;
+        memcpy(wb, bplist, sizeof(struct bplist_data));
+        /* the root object is the only ancestor of the entries */
+        wb->on_path = (uint8_t*)malloc(BPLIST_ON_PATH_SIZE(bplist->num_objects));
+        wb->keys = NULL;
+        wb->objects = (bplist->objects) ? (plist_t*)calloc(bplist->num_objects, sizeof(plist_t)) : NULL;
+        wb->budget_pool = &budget_pool;
+        wb->parallel = 0;
+        workers[i].job = &job;
+        if (!wb->on_path || (bplist->objects && !wb->objects)) {
+            workers[i].failed = 1;
+            continue;
+        }
+        memcpy(wb->on_path, bplist->on_path, BPLIST_ON_PATH_SIZE(bplist->num_objects));
+    }
+
+    bplist_run_threads(nthreads, bplist_parallel_work, workers, sizeof(struct bplist_worker));
+
+    for (i = 0; i < nthreads; i++) {
+        if (workers[i].failed) {
+            failed = 1;
+        }
+        free(workers[i].bplist.objects);
+        bplist_release_keys(&workers[i].bplist);
+        free(workers[i].bplist.on_path);
+    }
+    free(workers);
+    bplist->budget = budget_pool;
+
+    if (failed) {
+        for (j = 0; j < count; j++) {
+            if (is_dict) {
+                plist_free(job.keys[j]);
+            }
+            plist_free(job.values[j]);
+        }
+        plist_free(node);
+        node = NULL;
+    } else {
+        for (j = 0; j < count; j++) {
+            if (is_dict) {
+                node_attach(node, job.keys[j]);
+            }
+            node_attach(node, job.values[j]);
+            if (!is_dict && data->hashtable) {
+                ptr_array_add((ptrarray_t*)data->hashtable, job.values[j]);
+            }
+        }
+        if (is_dict) {
+            plist_dict_index_in(bplist->arena, node);
+        }
+    }
+    free(job.keys);
+    free(job.values);
+    return node;
+}
+
+static plist_t parse_dict_node(struct bplist_data *bplist, const char** bnode, uint64_t size)
+{
+    uint64_t j;
+    uint64_t index1, index2;
+    plist_t node = bplist_new_node(bplist);
+    plist_data_t data = plist_get_data(node);
+    unsigned int nthreads;
+
+    data->type = PLIST_DICT;
+    data->length = size;
+
+    if (!bplist_check_refs(bplist, *bnode, size * 2)) {
+        plist_free(node);
+        return NULL;
+    }
+
+    /* the entries of the root object may be decoded concurrently */
+    if (bplist->parallel && bplist->level == 1 && (nthreads = bplist_parallel_threads(size, BPLIST_PARALLEL_MIN_ENTRIES)) > 1) {
+        return parse_root_entries_parallel(bplist, node, *bnode, size, 1, nthreads);
+    }
+
+    for (j = 0; j < data->length; j++) {
+        if (!bplist_read_ref(bplist, *bnode, j, &index1) || !bplist_read_ref(bplist, *bnode, j + size, &index2)) {
             plist_free(node);
+            PLIST_BIN_ERR("%s: dict entry %" PRIu64 " is invalid\n", __func__, j);
             return NULL;
         }
 
-        /* enforce key type */
-        plist_get_data(key)->type = PLIST_KEY;
-        if (!plist_get_data(key)->strval) {
-            PLIST_BIN_ERR("%s: dict entry %" PRIu64 ": key must not be NULL\n", __func__, j);
-            plist_free(key);
+        /* process key node */
+        plist_t key = parse_key_node_at_index(bplist, index1);
+        if (!key) {
+            PLIST_BIN_ERR("%s: dict entry %" PRIu64 ": invalid key\n", __func__, j);
             plist_free(node);
             return NULL;
         }
@@ -493,6 +978,7 @@ static plist_t parse_dict_node(struct bplist_data *bplist, const char** bnode, u
         node_attach(node, key);
         node_attach(node, val);
     }
+    plist_dict_index_in(bplist->arena, node);
 
     return node;
 }
@@ -500,31 +986,38 @@ static plist_t parse_dict_node(struct bplist_data *bplist, const char** bnode, u
 static plist_t parse_array_node(struct bplist_data *bplist, const char** bnode, uint64_t size)
 {
     uint64_t j;
-    uint64_t str_j = 0;
     uint64_t index1;
-    plist_data_t data = plist_new_plist_data();
-    const char *index1_ptr = NULL;
+    plist_t node = bplist_new_node(bplist);
+    plist_data_t data = plist_get_data(node);
+    unsigned int nthreads;
 
     data->type = PLIST_ARRAY;
     data->length = size;
 
-    plist_t node = node_create(NULL, data);
-
-    for (j = 0; j < data->length; j++) {
-        str_j = j * bplist->ref_size;
-        index1_ptr = (*bnode) + str_j;
-
-        if (index1_ptr < bplist->data || index1_ptr + bplist->ref_size > bplist->offset_table) {
-            plist_free(node);
-            PLIST_BIN_ERR("%s: array item %" PRIu64 " is outside of valid range\n", __func__, j);
-            return NULL;
+    if (size > 0 && size <= LONG_MAX) {
+        /* the item count is known upfront, so size the lookup array exactly */
+        ptrarray_t *pa = ptr_array_new((long)size);
+        if (pa && bplist->arena && arena_add_cleanup(bplist->arena, plist_arena_free_ptrarray, pa) < 0) {
+            /* go without a lookup array rather than leak it */
+            ptr_array_free(pa);
+            pa = NULL;
         }
+        data->hashtable = pa;
+    }
+
+    if (!bplist_check_refs(bplist, *bnode, size)) {
+        plist_free(node);
+        return NULL;
+    }
 
-        index1 = UINT_TO_HOST(index1_ptr, bplist->ref_size);
+    if (bplist->parallel && bplist->level == 1 && (nthreads = bplist_parallel_threads(size, BPLIST_PARALLEL_MIN_ENTRIES)) > 1) {
+        return parse_root_entries_parallel(bplist, node, *bnode, size, 0, nthreads);
+    }
 
-        if (index1 >= bplist->num_objects) {
+    for (j = 0; j < data->length; j++) {
+        if (!bplist_read_ref(bplist, *bnode, j, &index1)) {
             plist_free(node);
-            PLIST_BIN_ERR("%s: array item %" PRIu64 " object index (%" PRIu64 ") must be smaller than the number of objects (%" PRIu64 ")\n", __func__, j, index1, bplist->num_objects);
+            PLIST_BIN_ERR("%s: array item %" PRIu64 " is invalid\n", __func__, j);
             return NULL;
         }
 
@@ -536,19 +1029,23 @@ static plist_t parse_array_node(struct bplist_data *bplist, const char** bnode,
         }
 
         node_attach(node, val);
+        if (data->hashtable) {
+            ptr_array_add((ptrarray_t*)data->hashtable, val);
+        }
     }
 
     return node;
 }
 
-static plist_t parse_uid_node(const char **bnode, uint8_t size)
+static plist_t parse_uid_node(struct bplist_data *bplist, const char **bnode, uint8_t size)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = bplist_new_node(bplist);
+    plist_data_t data = plist_get_data(node);
     size = size + 1;
     data->intval = UINT_TO_HOST(*bnode, size);
     if (data->intval > UINT32_MAX) {
         PLIST_BIN_ERR("%s: value %" PRIu64 " too large for UID node (must be <= %u)\n", __func__, (uint64_t)data->intval, UINT32_MAX);
-        free(data);
+        plist_free(node);
         return NULL;
     }
 
@@ -556,25 +1053,19 @@ static plist_t parse_uid_node(const char **bnode, uint8_t size)
     data->type = PLIST_UID;
     data->length = sizeof(uint64_t);
 
-    return node_create(NULL, data);
+    return node;
 }
 
-static plist_t parse_bin_node(struct bplist_data *bplist, const char** object)
+/* read the marker byte and, where present, the extended size of an object;
+ * object is advanced to the payload */
+static int bplist_read_header(struct bplist_data *bplist, const char** object, uint16_t *type, uint64_t *size)
 {
-    uint16_t type = 0;
-    uint64_t size = 0;
-    uint64_t pobject = 0;
-    uint64_t poffset_table = (uint64_t)(uintptr_t)bplist->offset_table;
-
-    if (!object)
-        return NULL;
-
-    type = (**object) & BPLIST_MASK;
-    size = (**object) & BPLIST_FILL;
+    *type = (**object) & BPLIST_MASK;
+    *size = (**object) & BPLIST_FILL;
     (*object)++;
 
-    if (size == BPLIST_FILL) {
-        switch (type) {
+    if (*size == BPLIST_FILL) {
+        switch (*type) {
         case BPLIST_DATA:
         case BPLIST_STRING:
         case BPLIST_UNICODE:
@@ -584,16 +1075,16 @@ static plist_t parse_bin_node(struct bplist_data *bplist, const char** object)
         {
             uint16_t next_size = **object & BPLIST_FILL;
             if ((**object & BPLIST_MASK) != BPLIST_UINT) {
-                PLIST_BIN_ERR("%s: invalid size node type for node type 0x%02x: found 0x%02x, expected 0x%02x\n", __func__, type, **object & BPLIST_MASK, BPLIST_UINT);
-                return NULL;
+                PLIST_BIN_ERR("%s: invalid size node type for node type 0x%02x: found 0x%02x, expected 0x%02x\n", __func__, *type, **object & BPLIST_MASK, BPLIST_UINT);
+                return 0;
             }
             (*object)++;
             next_size = 1 << next_size;
             if (*object + next_size > bplist->offset_table) {
-                PLIST_BIN_ERR("%s: size node data bytes for node type 0x%02x point outside of valid range\n", __func__, type);
-                return NULL;
+                PLIST_BIN_ERR("%s: size node data bytes for node type 0x%02x point outside of valid range\n", __func__, *type);
+                return 0;
             }
-            size = UINT_TO_HOST(*object, next_size);
+            *size = UINT_TO_HOST(*object, next_size);
             (*object) += next_size;
             break;
         }
@@ -601,786 +1092,2510 @@ static plist_t parse_bin_node(struct bplist_data *bplist, const char** object)
             break;
         }
     }
+    return 1;
+}
+
+/* read the header of the object at *object and make sure its payload is
+ * within the object data and of a valid size for its type; *object is
+ * advanced to the payload */
+static int bplist_check_object(struct bplist_data *bplist, const char** object, uint16_t *type, uint64_t *size)
+{
+    uint64_t pobject = 0;
+    uint64_t poffset_table = (uint64_t)(uintptr_t)bplist->offset_table;
+
+    if (!bplist_read_header(bplist, object, type, size))
+        return 0;
 
     pobject = (uint64_t)(uintptr_t)*object;
 
-    switch (type)
+    switch (*type)
     {
 
     case BPLIST_NULL:
-        switch (size)
-        {
-
-        case BPLIST_TRUE:
-        {
-            plist_data_t data = plist_new_plist_data();
-            data->type = PLIST_BOOLEAN;
-            data->boolval = TRUE;
-            data->length = 1;
-            return node_create(NULL, data);
-        }
-
-        case BPLIST_FALSE:
-        {
-            plist_data_t data = plist_new_plist_data();
-            data->type = PLIST_BOOLEAN;
-            data->boolval = FALSE;
-            data->length = 1;
-            return node_create(NULL, data);
-        }
-
-        case BPLIST_NULL:
-        default:
-            return NULL;
+        if (*size != BPLIST_TRUE && *size != BPLIST_FALSE) {
+            return 0;
         }
+        return 1;
 
     case BPLIST_UINT:
-        if (pobject + (uint64_t)(1 << size) > poffset_table) {
+        if (*size > 4) {
+            PLIST_BIN_ERR("%s: Invalid byte size for integer node\n", __func__);
+            return 0;
+        }
+        if (pobject + (uint64_t)(1 << *size) > poffset_table) {
             PLIST_BIN_ERR("%s: BPLIST_UINT data bytes point outside of valid range\n", __func__);
-            return NULL;
+            return 0;
         }
-        return parse_uint_node(object, size);
+        return 1;
 
     case BPLIST_REAL:
-        if (pobject + (uint64_t)(1 << size) > poffset_table) {
+        if (*size != 2 && *size != 3) {
+            PLIST_BIN_ERR("%s: Invalid byte size for real node\n", __func__);
+            return 0;
+        }
+        if (pobject + (uint64_t)(1 << *size) > poffset_table) {
             PLIST_BIN_ERR("%s: BPLIST_REAL data bytes point outside of valid range\n", __func__);
-            return NULL;
+            return 0;
         }
-        return parse_real_node(object, size);
+        return 1;
 
     case BPLIST_DATE:
-        if (3 != size) {
+        if (3 != *size) {
             PLIST_BIN_ERR("%s: invalid data size for BPLIST_DATE node\n", __func__);
-            return NULL;
+            return 0;
         }
-        if (pobject + (uint64_t)(1 << size) > poffset_table) {
+        if (pobject + (uint64_t)(1 << *size) > poffset_table) {
             PLIST_BIN_ERR("%s: BPLIST_DATE data bytes point outside of valid range\n", __func__);
-            return NULL;
+            return 0;
         }
-        return parse_date_node(object, size);
+        return 1;
 
     case BPLIST_DATA:
-        if (pobject + size < pobject || pobject + size > poffset_table) {
+        if (pobject + *size < pobject || pobject + *size > poffset_table) {
             PLIST_BIN_ERR("%s: BPLIST_DATA data bytes point outside of valid range\n", __func__);
-            return NULL;
+            return 0;
         }
-        return parse_data_node(object, size);
+        return 1;
 
     case BPLIST_STRING:
-        if (pobject + size < pobject || pobject + size > poffset_table) {
+        if (pobject + *size < pobject || pobject + *size > poffset_table) {
             PLIST_BIN_ERR("%s: BPLIST_STRING data bytes point outside of valid range\n", __func__);
-            return NULL;
+            return 0;
         }
-        return parse_string_node(object, size);
+        return 1;
 
     case BPLIST_UNICODE:
-        if (size*2 < size) {
+        if (*size == 0) {
+            PLIST_BIN_ERR("%s: empty BPLIST_UNICODE node\n", __func__);
+            return 0;
+        }
+        if (*size*2 < *size) {
             PLIST_BIN_ERR("%s: Integer overflow when calculating BPLIST_UNICODE data size.\n", __func__);
-            return NULL;
+            return 0;
         }
-        if (pobject + size*2 < pobject || pobject + size*2 > poffset_table) {
+        if (pobject + *size*2 < pobject || pobject + *size*2 > poffset_table) {
             PLIST_BIN_ERR("%s: BPLIST_UNICODE data bytes point outside of valid range\n", __func__);
-            return NULL;
+            return 0;
         }
-        return parse_unicode_node(object, size);
+        return 1;
 
     case BPLIST_SET:
     case BPLIST_ARRAY:
-        if (pobject + size < pobject || pobject + size > poffset_table) {
+        if (pobject + *size < pobject || pobject + *size > poffset_table) {
             PLIST_BIN_ERR("%s: BPLIST_ARRAY data bytes point outside of valid range\n", __func__);
-            return NULL;
+            return 0;
         }
-        return parse_array_node(bplist, object, size);
+        if (*size > UINT_MAX) {
+            PLIST_BIN_ERR("%s: BPLIST_ARRAY has too many items\n", __func__);
+            return 0;
+        }
+        return 1;
 
     case BPLIST_UID:
-        if (pobject + size+1 > poffset_table) {
+    {
+        /* parse_uid_node() takes the size as uint8_t */
+        uint8_t uid_size = (uint8_t)(*size + 1);
+        if (uid_size == 0 || pobject + *size + 1 > poffset_table) {
             PLIST_BIN_ERR("%s: BPLIST_UID data bytes point outside of valid range\n", __func__);
-            return NULL;
+            return 0;
+        }
+        if (UINT_TO_HOST(*object, uid_size) > UINT32_MAX) {
+            PLIST_BIN_ERR("%s: value too large for UID node (must be <= %u)\n", __func__, UINT32_MAX);
+            return 0;
         }
-        return parse_uid_node(object, size);
+        return 1;
+    }
 
     case BPLIST_DICT:
-        if (pobject + size < pobject || pobject + size > poffset_table) {
+        if (pobject + *size < pobject || pobject + *size > poffset_table) {
             PLIST_BIN_ERR("%s: BPLIST_DICT data bytes point outside of valid range\n", __func__);
-            return NULL;
+            return 0;
         }
+        if (*size > UINT_MAX / 2) {
+            PLIST_BIN_ERR("%s: BPLIST_DICT has too many items\n", __func__);
+            return 0;
+        }
+        return 1;
+
+    default:
+        PLIST_BIN_ERR("%s: unexpected node type 0x%02x\n", __func__, *type);
+        return 0;
+    }
+}
+
+static plist_t parse_bin_node(struct bplist_data *bplist, const char** object)
+{
+    uint16_t type = 0;
+    uint64_t size = 0;
+
+    if (!object)
+        return NULL;
+
+    if (!bplist_check_object(bplist, object, &type, &size))
+        return NULL;
+
+    switch (type)
+    {
+
+    case BPLIST_NULL:
+    {
+        plist_t node = bplist_new_node(bplist);
+        plist_data_t data = plist_get_data(node);
+        data->type = PLIST_BOOLEAN;
+        data->boolval = (size == BPLIST_TRUE) ? TRUE : FALSE;
+        data->length = 1;
+        return node;
+    }
+
+    case BPLIST_UINT:
+        return parse_uint_node(bplist, object, size);
+
+    case BPLIST_REAL:
+        return parse_real_node(bplist, object, size);
+
+    case BPLIST_DATE:
+        return parse_date_node(bplist, object, size);
+
+    case BPLIST_DATA:
+        return parse_data_node(bplist, object, size);
+
+    case BPLIST_STRING:
+        return parse_string_node(bplist, object, size);
+
+    case BPLIST_UNICODE:
+        return parse_unicode_node(bplist, object, size);
+
+    case BPLIST_SET:
+    case BPLIST_ARRAY:
+        return parse_array_node(bplist, object, size);
+
+    case BPLIST_UID:
+        return parse_uid_node(bplist, object, size);
+
+    case BPLIST_DICT:
         return parse_dict_node(bplist, object, size);
 
     default:
-        PLIST_BIN_ERR("%s: unexpected node type 0x%02x\n", __func__, type);
         return NULL;
     }
-    return NULL;
 }
 
-static plist_t parse_bin_node_at_index(struct bplist_data *bplist, uint32_t node_index)
+/* locate the encoded object with the given index through the offset table */
+static const char* bplist_object_at(struct bplist_data *bplist, uint64_t node_index)
 {
-    int i = 0;
-    const char* ptr = NULL;
-    plist_t plist = NULL;
     const char* idx_ptr = NULL;
+    const char* ptr = NULL;
 
     if (node_index >= bplist->num_objects) {
-        PLIST_BIN_ERR("node index (%u) must be smaller than the number of objects (%" PRIu64 ")\n", node_index, bplist->num_objects);
+        PLIST_BIN_ERR("node index (%" PRIu64 ") must be smaller than the number of objects (%" PRIu64 ")\n", node_index, bplist->num_objects);
         return NULL;
     }
 
+    if (bplist->offsets) {
+        return bplist->data + bplist->offsets[node_index];
+    }
+
     idx_ptr = bplist->offset_table + node_index * bplist->offset_size;
     if (idx_ptr < bplist->offset_table ||
         idx_ptr >= bplist->offset_table + bplist->num_objects * bplist->offset_size) {
-        PLIST_BIN_ERR("node index %u points outside of valid range\n", node_index);
+        PLIST_BIN_ERR("node index %" PRIu64 " points outside of valid range\n", node_index);
         return NULL;
     }
 
     ptr = bplist->data + UINT_TO_HOST(idx_ptr, bplist->offset_size);
     /* make sure the node offset is in a sane range */
     if ((ptr < bplist->data) || (ptr >= bplist->offset_table)) {
-        PLIST_BIN_ERR("offset for node index %u points outside of valid range\n", node_index);
+        PLIST_BIN_ERR("offset for node index %" PRIu64 " points outside of valid range\n", node_index);
+        return NULL;
+    }
+    return ptr;
+}
+
+static plist_t parse_bin_node_at_index(struct bplist_data *bplist, uint64_t node_index)
+{
+    const char* ptr = NULL;
+    plist_t plist = NULL;
+
+    ptr = bplist_object_at(bplist, node_index);
+    if (!ptr) {
+        return NULL;
+    }
+
+    /* an object that is complete already can't be one of our ancestors */
+    if (bplist->objects && bplist->objects[node_index]) {
+        return bplist_clone_node(bplist, bplist->objects[node_index]);
+    }
+
+    if (!bplist_charge_node(bplist)) {
         return NULL;
     }
 
-    /* store node_index for current recursion level */
-    if ((uint32_t)ptr_array_size(bplist->used_indexes) < bplist->level+1) {
-        while ((uint32_t)ptr_array_size(bplist->used_indexes) < bplist->level+1) {
-            ptr_array_add(bplist->used_indexes, (void*)(uintptr_t)node_index);
+    if (!bplist->on_path) {
+        bplist->on_path = (uint8_t*)calloc(1, BPLIST_ON_PATH_SIZE(bplist->num_objects));
+        if (!bplist->on_path) {
+            PLIST_BIN_ERR("failed to allocate recursion tracking. Out of memory?\n");
+            return NULL;
         }
-    } else {
-	ptr_array_set(bplist->used_indexes, (void*)(uintptr_t)node_index, bplist->level);
     }
 
     /* recursion check */
-    if (bplist->level > 0) {
-        for (i = bplist->level-1; i >= 0; i--) {
-            uint32_t node_i = (uint32_t)(uintptr_t)ptr_array_index(bplist->used_indexes, i);
-            uint32_t node_level = (uint32_t)(uintptr_t)ptr_array_index(bplist->used_indexes, bplist->level);
-            if (node_i == node_level) {
-                PLIST_BIN_ERR("recursion detected in binary plist\n");
-                return NULL;
-            }
-        }
+    if (BPLIST_ON_PATH(bplist, node_index)) {
+        PLIST_BIN_ERR("recursion detected in binary plist\n");
+        return NULL;
     }
 
     /* finally parse node */
+    BPLIST_SET_ON_PATH(bplist, node_index);
     bplist->level++;
     plist = parse_bin_node(bplist, &ptr);
     bplist->level--;
+    BPLIST_CLEAR_ON_PATH(bplist, node_index);
+    if (plist && bplist->objects) {
+        bplist->objects[node_index] = plist;
+    }
     return plist;
 }
 
 PLIST_API void plist_from_bin(const char *plist_bin, uint32_t length, plist_t * plist)
+{
+    plist_from_bin_with_options(plist_bin, length, plist, PLIST_PARSE_DEFAULT);
+}
+
+PLIST_API void plist_from_bin64(const char *plist_bin, uint64_t length, plist_t * plist)
+{
+    plist_from_bin_with_options(plist_bin, length, plist, PLIST_PARSE_DEFAULT);
+}
+
+static uint64_t bplist_node_budget(uint64_t length)
+{
+    return (length > BPLIST_MIN_NODE_BUDGET / BPLIST_NODES_PER_BYTE) ? length * BPLIST_NODES_PER_BYTE : BPLIST_MIN_NODE_BUDGET;
+}
+
+/* validate the header and trailer of a binary plist and set up bplist for it */
+static int bplist_data_init(struct bplist_data *bplist, const char *plist_bin, uint64_t length, uint64_t *root_object)
 {
     bplist_trailer_t *trailer = NULL;
     uint8_t offset_size = 0;
     uint8_t ref_size = 0;
     uint64_t num_objects = 0;
-    uint64_t root_object = 0;
     const char *offset_table = NULL;
+    uint64_t offset_table_offset = 0;
     uint64_t offset_table_size = 0;
-    const char *start_data = NULL;
-    const char *end_data = NULL;
+    uint64_t start_data = 0;
+    uint64_t end_data = 0;
 
     //first check we have enough data
     if (!(length >= BPLIST_MAGIC_SIZE + BPLIST_VERSION_SIZE + sizeof(bplist_trailer_t))) {
         PLIST_BIN_ERR("plist data is to small to hold a binary plist\n");
-        return;
+        return 0;
     }
     //check that plist_bin in actually a plist
     if (memcmp(plist_bin, BPLIST_MAGIC, BPLIST_MAGIC_SIZE) != 0) {
         PLIST_BIN_ERR("bplist magic mismatch\n");
-        return;
+        return 0;
     }
     //check for known version
     if (memcmp(plist_bin + BPLIST_MAGIC_SIZE, BPLIST_VERSION, BPLIST_VERSION_SIZE) != 0) {
         PLIST_BIN_ERR("unsupported binary plist version '%.2s\n", plist_bin+BPLIST_MAGIC_SIZE);
-        return;
+        return 0;
     }
 
-    start_data = plist_bin + BPLIST_MAGIC_SIZE + BPLIST_VERSION_SIZE;
-    end_data = plist_bin + length - sizeof(bplist_trailer_t);
+    start_data = BPLIST_MAGIC_SIZE + BPLIST_VERSION_SIZE;
+    end_data = length - sizeof(bplist_trailer_t);
 
     //now parse trailer
-    trailer = (bplist_trailer_t*)end_data;
+    trailer = (bplist_trailer_t*)(plist_bin + end_data);
 
     offset_size = trailer->offset_size;
     ref_size = trailer->ref_size;
     num_objects = be64toh(trailer->num_objects);
-    root_object = be64toh(trailer->root_object_index);
-    offset_table = (char *)(plist_bin + be64toh(trailer->offset_table_offset));
+    *root_object = be64toh(trailer->root_object_index);
+    offset_table_offset = be64toh(trailer->offset_table_offset);
 
     if (num_objects == 0) {
         PLIST_BIN_ERR("number of objects must be larger than 0\n");
-        return;
+        return 0;
     }
 
     if (offset_size == 0) {
         PLIST_BIN_ERR("offset size in trailer must be larger than 0\n");
-        return;
+        return 0;
     }
 
     if (ref_size == 0) {
         PLIST_BIN_ERR("object reference size in trailer must be larger than 0\n");
-        return;
+        return 0;
     }
 
-    if (root_object >= num_objects) {
-        PLIST_BIN_ERR("root object index (%" PRIu64 ") must be smaller than number of objects (%" PRIu64 ")\n", root_object, num_objects);
-        return;
+    if (*root_object >= num_objects) {
+        PLIST_BIN_ERR("root object index (%" PRIu64 ") must be smaller than number of objects (%" PRIu64 ")\n", *root_object, num_objects);
+        return 0;
     }
 
-    if (offset_table < start_data || offset_table >= end_data) {
+    /* range checks are done on offsets, pointers past the input are undefined */
+    if (offset_table_offset < start_data || offset_table_offset >= end_data) {
         PLIST_BIN_ERR("offset table offset points outside of valid range\n");
-        return;
+        return 0;
     }
 
     if (uint64_mul_overflow(num_objects, offset_size, &offset_table_size)) {
         PLIST_BIN_ERR("integer overflow when calculating offset table size\n");
-        return;
+        return 0;
     }
 
-    if ((offset_table + offset_table_size < offset_table) || (offset_table + offset_table_size > end_data)) {
+    if (offset_table_size > end_data - offset_table_offset) {
         PLIST_BIN_ERR("offset table points outside of valid range\n");
-        return;
-    }
-
-    struct bplist_data bplist;
-    bplist.data = plist_bin;
-    bplist.size = length;
-    bplist.num_objects = num_objects;
-    bplist.ref_size = ref_size;
-    bplist.offset_size = offset_size;
-    bplist.offset_table = offset_table;
-    bplist.level = 0;
-    bplist.used_indexes = ptr_array_new(16);
-
-    if (!bplist.used_indexes) {
-        PLIST_BIN_ERR("failed to create array to hold used node indexes. Out of memory?\n");
-        return;
+        return 0;
     }
-
-    *plist = parse_bin_node_at_index(&bplist, root_object);
-
-    ptr_array_free(bplist.used_indexes);
+    offset_table = plist_bin + offset_table_offset;
+
+    bplist->data = plist_bin;
+    bplist->size = length;
+    bplist->num_objects = num_objects;
+    bplist->ref_size = ref_size;
+    bplist->offset_size = offset_size;
+    bplist->offset_table = offset_table;
+    bplist->offsets = NULL;
+    bplist->level = 0;
+    bplist->on_path = NULL;
+    bplist->arena = NULL;
+    bplist->keys = NULL;
+    bplist->borrow = 0;
+    bplist->objects = NULL;
+    bplist->budget = bplist_node_budget(length);
+    bplist->budget_pool = NULL;
+    bplist->parallel = 0;
+
+    return 1;
 }
 
-static unsigned int plist_data_hash(const void* key)
+/* Decode the offset table into native integers once, instead of decoding
+ * and range checking an entry whenever an object is looked up. Each width
+ * gets its own loop, which the compiler can vectorize. A document with an
+ * entry pointing outside of the object data is rejected up front, whether
+ * the object is used or not; returns 0 then. Without memory for the
+ * decoded table, the entries are only checked and lookups use the table. */
+static int bplist_decode_offsets(struct bplist_data *bplist)
 {
-    plist_data_t data = plist_get_data((plist_t) key);
-
-    unsigned int hash = data->type;
-    unsigned int i = 0;
-
-    char *buff = NULL;
-    unsigned int size = 0;
-
-    switch (data->type)
-    {
-    case PLIST_BOOLEAN:
-    case PLIST_UINT:
-    case PLIST_REAL:
-    case PLIST_DATE:
-    case PLIST_UID:
-        buff = (char *) &data->intval;	//works also for real as we use an union
-        size = 8;
+    const char *table = bplist->offset_table;
+    uint64_t limit = (uint64_t)(bplist->offset_table - bplist->data);
+    uint64_t *offsets;
+    uint64_t i;
+
+    offsets = (uint64_t*)malloc(bplist->num_objects * sizeof(uint64_t));
+    if (!offsets) {
+        for (i = 0; i < bplist->num_objects; i++) {
+            if (UINT_TO_HOST(table + i * bplist->offset_size, bplist->offset_size) >= limit) {
+                PLIST_BIN_ERR("offset for node index %" PRIu64 " points outside of valid range\n", i);
+                return 0;
+            }
+        }
+        return 1;
+    }
+    switch (bplist->offset_size) {
+    case 1:
+        for (i = 0; i < bplist->num_objects; i++) {
+            offsets[i] = (uint8_t)table[i];
+        }
         break;
-    case PLIST_KEY:
-    case PLIST_STRING:
-        buff = data->strval;
-        size = data->length;
+    case 2:
+        for (i = 0; i < bplist->num_objects; i++) {
+            offsets[i] = UINT_TO_HOST(table + i * 2, 2);
+        }
         break;
-    case PLIST_DATA:
-    case PLIST_ARRAY:
-    case PLIST_DICT:
-        //for these types only hash pointer
-        buff = (char *) &key;
-        size = sizeof(const void*);
+    case 4:
+        for (i = 0; i < bplist->num_objects; i++) {
+            offsets[i] = UINT_TO_HOST(table + i * 4, 4);
+        }
+        break;
+    case 8:
+        for (i = 0; i < bplist->num_objects; i++) {
+            offsets[i] = UINT_TO_HOST(table + i * 8, 8);
+        }
         break;
     default:
+        for (i = 0; i < bplist->num_objects; i++) {
+            offsets[i] = UINT_TO_HOST(table + i * bplist->offset_size, bplist->offset_size);
+        }
         break;
     }
-
-    // now perform hash using djb2 hashing algorithm
-    // see: http://www.cse.yorku.ca/~oz/hash.html
-    hash += 5381;
-    for (i = 0; i < size; buff++, i++) {
-        hash = ((hash << 5) + hash) + *buff;
+    for (i = 0; i < bplist->num_objects; i++) {
+        if (offsets[i] >= limit) {
+            PLIST_BIN_ERR("offset for node index %" PRIu64 " points outside of valid range\n", i);
+            free(offsets);
+            return 0;
+        }
     }
-
-    return hash;
+    bplist->offsets = offsets;
+    return 1;
 }
 
-struct serialize_s
+/* drop the key strings cached by parse_key_node_at_index() */
+static void bplist_release_keys(struct bplist_data *bplist)
 {
-    ptrarray_t* objects;
-    hashtable_t* ref_table;
-};
+    if (bplist->keys) {
+        if (!bplist->arena) {
+            uint64_t i;
+            for (i = 0; i < bplist->num_objects; i++) {
+                atom_release(bplist->keys[i]);
+            }
+        }
+        free(bplist->keys);
+        bplist->keys = NULL;
+    }
+}
 
-static void serialize_plist(node_t* node, void* data)
+PLIST_API void plist_from_bin_with_options(const char *plist_bin, uint64_t length, plist_t * plist, plist_parse_options_t options)
 {
-    uint64_t *index_val = NULL;
-    struct serialize_s *ser = (struct serialize_s *) data;
-    uint64_t current_index = ser->objects->len;
+    struct bplist_data bplist;
+    uint64_t root_object = 0;
 
-    //first check that node is not yet in objects
-    void* val = hash_table_lookup(ser->ref_table, node);
-    if (val)
-    {
-        //data is already in table
+    if (!bplist_data_init(&bplist, plist_bin, length, &root_object)) {
         return;
     }
-    //insert new ref
-    index_val = (uint64_t *) malloc(sizeof(uint64_t));
-    assert(index_val != NULL);
-    *index_val = current_index;
-    hash_table_insert(ser->ref_table, node, index_val);
+    bplist.borrow = (options & PLIST_PARSE_BORROW) ? 1 : 0;
+    /* arenas can't be shared between threads */
+    bplist.parallel = ((options & PLIST_PARSE_PARALLEL) && !(options & PLIST_PARSE_ARENA)) ? 1 : 0;
+    if (options & PLIST_PARSE_UNBOUNDED) {
+        bplist.budget = UINT64_MAX;
+    }
 
-    //now append current node to object array
-    ptr_array_add(ser->objects, node);
+    if (!bplist_decode_offsets(&bplist)) {
+        return;
+    }
 
-    //now recurse on children
-    node_t *ch;
-    for (ch = node_first_child(node); ch; ch = node_next_sibling(ch)) {
-        serialize_plist(ch, data);
+    if (options & PLIST_PARSE_ARENA) {
+        /* node structures plus at most the payload of the objects */
+        uint64_t size_hint = bplist.num_objects * (sizeof(struct plist_node_s) + 16) + (bplist.offset_table - plist_bin);
+        bplist.arena = arena_new((size_hint > (1 << 26)) ? (1 << 26) : size_hint);
+        if (!bplist.arena) {
+            PLIST_BIN_ERR("failed to create memory arena. Out of memory?\n");
+            free(bplist.offsets);
+            return;
+        }
     }
 
-    return;
-}
+    /* remember every decoded object so that further references to it
+     * are cloned instead of decoded again */
+    bplist.objects = (plist_t*)calloc(bplist.num_objects, sizeof(plist_t));
 
-#define Log2(x) (x == 8 ? 3 : (x == 4 ? 2 : (x == 2 ? 1 : 0)))
+    *plist = parse_bin_node_at_index(&bplist, root_object);
 
-static void write_int(bytearray_t * bplist, uint64_t val)
-{
-    int size = get_needed_bytes(val);
-    uint8_t sz;
-    //do not write 3bytes int node
-    if (size == 3)
-        size++;
-    sz = BPLIST_UINT | Log2(size);
+    free(bplist.objects);
+    bplist_release_keys(&bplist);
 
-    val = be64toh(val);
-    byte_array_append(bplist, &sz, 1);
-    byte_array_append(bplist, (uint8_t*)&val + (8-size), size);
+    if (bplist.arena) {
+        plist_arena_finish(bplist.arena, *plist);
+    }
+
+    free(bplist.on_path);
+    free(bplist.offsets);
 }
 
-static void write_uint(bytearray_t * bplist, uint64_t val)
-{
-    uint8_t sz = BPLIST_UINT | 4;
-    uint64_t zero = 0;
+/* Per object state of plist_validate_bin(). Once an object is done, the
+ * size of the subtree it describes is known, so further references to it
+ * cost nothing. An object that is still on the path from the root when it
+ * is referenced again is part of a cycle. */
+enum {
+    BPLIST_VALIDATE_NEW = 0,
+    BPLIST_VALIDATE_ON_PATH,
+    BPLIST_VALIDATE_DONE
+};
 
-    val = be64toh(val);
-    byte_array_append(bplist, &sz, 1);
-    byte_array_append(bplist, &zero, sizeof(uint64_t));
-    byte_array_append(bplist, &val, sizeof(uint64_t));
-}
+struct bplist_validate_info {
+    uint64_t nodes;	/* nodes created when parsing, keys included */
+    uint64_t values;	/* nodes without keys */
+    uint32_t depth;
+    uint8_t state;
+    uint8_t type;
+};
 
-static void write_real(bytearray_t * bplist, double val)
-{
-    int size = get_real_bytes(val);	//cheat to know used space
-    uint8_t buff[16];
-    buff[7] = BPLIST_REAL | Log2(size);
-    if (size == sizeof(float)) {
-        float floatval = (float)val;
-        *(uint32_t*)(buff+8) = float_bswap32(*(uint32_t*)&floatval);
-    } else {
-        *(uint64_t*)(buff+8) = float_bswap64(*(uint64_t*)&val);
-    }
-    byte_array_append(bplist, buff+7, size+1);
-}
+struct bplist_validate_frame {
+    uint64_t index;
+    const char *refs;
+    uint64_t count;
+    uint64_t next;
+    int is_dict;
+    int key_done;
+    struct bplist_validate_info sum;
+};
 
-static void write_date(bytearray_t * bplist, double val)
+static uint64_t uint64_add_sat(uint64_t a, uint64_t b)
 {
-    uint8_t buff[16];
-    buff[7] = BPLIST_DATE | 3;
-    *(uint64_t*)(buff+8) = float_bswap64(*(uint64_t*)&val);
-    byte_array_append(bplist, buff+7, 9);
+    return (a + b < a) ? UINT64_MAX : a + b;
 }
 
-static void write_raw_data(bytearray_t * bplist, uint8_t mark, uint8_t * val, uint64_t size)
+/* dict keys have to be strings */
+static int bplist_validate_key(struct bplist_data *bplist, struct bplist_validate_info *info, uint64_t index)
 {
-    uint8_t marker = mark | (size < 15 ? size : 0xf);
-    byte_array_append(bplist, &marker, sizeof(uint8_t));
-    if (size >= 15) {
-        write_int(bplist, size);
+    if (info[index].state == BPLIST_VALIDATE_NEW) {
+        const char *ptr = bplist_object_at(bplist, index);
+        uint16_t type = 0;
+        uint64_t size = 0;
+        if (!ptr || !bplist_check_object(bplist, &ptr, &type, &size)) {
+            return 0;
+        }
+        if (type != BPLIST_STRING && type != BPLIST_UNICODE) {
+            return 0;
+        }
+        info[index].type = (uint8_t)type;
+        info[index].state = BPLIST_VALIDATE_DONE;
+        info[index].nodes = 1;
+        info[index].values = 1;
+        info[index].depth = 1;
+        return 1;
     }
-    if (BPLIST_UNICODE==mark) size <<= 1;
-    byte_array_append(bplist, val, size);
+    return (info[index].type == BPLIST_STRING || info[index].type == BPLIST_UNICODE);
 }
 
-static void write_data(bytearray_t * bplist, uint8_t * val, uint64_t size)
+/* check the object with the given index; containers are only entered,
+ * their info is complete once their frame is popped */
+static int bplist_validate_enter(struct bplist_data *bplist, struct bplist_validate_info *info, uint64_t index, struct bplist_validate_frame *frame, int *entered)
 {
-    write_raw_data(bplist, BPLIST_DATA, val, size);
+    const char *ptr = bplist_object_at(bplist, index);
+    uint16_t type = 0;
+    uint64_t size = 0;
+
+    *entered = 0;
+    if (!ptr || !bplist_check_object(bplist, &ptr, &type, &size)) {
+        return 0;
+    }
+    info[index].type = (uint8_t)type;
+    if (type == BPLIST_ARRAY || type == BPLIST_SET || type == BPLIST_DICT) {
+        if (!bplist_check_refs(bplist, ptr, (type == BPLIST_DICT) ? size * 2 : size)) {
+            return 0;
+        }
+        info[index].state = BPLIST_VALIDATE_ON_PATH;
+        memset(frame, 0, sizeof(struct bplist_validate_frame));
+        frame->index = index;
+        frame->refs = ptr;
+        frame->count = size;
+        frame->is_dict = (type == BPLIST_DICT);
+        *entered = 1;
+        return 1;
+    }
+    info[index].state = BPLIST_VALIDATE_DONE;
+    info[index].nodes = 1;
+    info[index].values = 1;
+    info[index].depth = 1;
+    return 1;
 }
 
-static void write_string(bytearray_t * bplist, char *val, uint64_t size)
+PLIST_API int plist_validate_bin(const char *plist_bin, uint64_t length, uint64_t *num_objects, uint32_t *max_depth)
 {
-    write_raw_data(bplist, BPLIST_STRING, (uint8_t *) val, size);
-}
+    struct bplist_data bplist;
+    struct bplist_validate_info *info = NULL;
+    struct bplist_validate_frame *stack = NULL;
+    uint64_t stack_size = 0;
+    uint64_t depth = 0;
+    uint64_t root_object = 0;
+    int entered = 0;
+    int res = -1;
 
-static uint16_t *plist_utf8_to_utf16be(char *unistr, long size, long *items_read, long *items_written)
-{
-	uint16_t *outbuf;
-	int p = 0;
-	long i = 0;
-
-	unsigned char c0;
-	unsigned char c1;
-	unsigned char c2;
-	unsigned char c3;
-
-	uint32_t w;
-
-	outbuf = (uint16_t*)malloc(((size*2)+1)*sizeof(uint16_t));
-	if (!outbuf) {
-		PLIST_BIN_ERR("%s: Could not allocate %" PRIu64 " bytes\n", __func__, (uint64_t)((size*2)+1)*sizeof(uint16_t));
-		return NULL;
-	}
-
-	while (i < size) {
-		c0 = unistr[i];
-		c1 = (i < size-1) ? unistr[i+1] : 0;
-		c2 = (i < size-2) ? unistr[i+2] : 0;
-		c3 = (i < size-3) ? unistr[i+3] : 0;
-		if ((c0 >= 0xF0) && (i < size-3) && (c1 >= 0x80) && (c2 >= 0x80) && (c3 >= 0x80)) {
-			// 4 byte sequence.  Need to generate UTF-16 surrogate pair
-			w = ((((c0 & 7) << 18) + ((c1 & 0x3F) << 12) + ((c2 & 0x3F) << 6) + (c3 & 0x3F)) & 0x1FFFFF) - 0x010000;
-			outbuf[p++] = be16toh(0xD800 + (w >> 10));
-			outbuf[p++] = be16toh(0xDC00 + (w & 0x3FF));
-			i+=4;
-		} else if ((c0 >= 0xE0) && (i < size-2) && (c1 >= 0x80) && (c2 >= 0x80)) {
-			// 3 byte sequence
-			outbuf[p++] = be16toh(((c2 & 0x3F) + ((c1 & 3) << 6)) + (((c1 >> 2) & 15) << 8) + ((c0 & 15) << 12));
-			i+=3;
-		} else if ((c0 >= 0xC0) && (i < size-1) && (c1 >= 0x80)) {
-			// 2 byte sequence
-			outbuf[p++] = be16toh(((c1 & 0x3F) + ((c0 & 3) << 6)) + (((c0 >> 2) & 7) << 8));
-			i+=2;
-		} else if (c0 < 0x80) {
-			// 1 byte sequence
-			outbuf[p++] = be16toh(c0);
-			i+=1;
-		} else {
-			// invalid character
-			PLIST_BIN_ERR("%s: invalid utf8 sequence in string at index %lu\n", __func__, i);
-			break;
-		}
-	}
-	if (items_read) {
-		*items_read = i;
-	}
-	if (items_written) {
-		*items_written = p;
-	}
-	outbuf[p] = 0;
-
-	return outbuf;
-}
-
-static void write_unicode(bytearray_t * bplist, char *val, uint64_t size)
-{
-    long items_read = 0;
-    long items_written = 0;
-    uint16_t *unicodestr = NULL;
-
-    unicodestr = plist_utf8_to_utf16be(val, size, &items_read, &items_written);
-    write_raw_data(bplist, BPLIST_UNICODE, (uint8_t*)unicodestr, items_written);
-    free(unicodestr);
-}
-
-static void write_array(bytearray_t * bplist, node_t* node, hashtable_t* ref_table, uint8_t ref_size)
-{
-    node_t* cur = NULL;
-    uint64_t i = 0;
+    if (!plist_bin || !bplist_data_init(&bplist, plist_bin, length, &root_object) || !bplist_decode_offsets(&bplist)) {
+        return -1;
+    }
 
-    uint64_t size = node_n_children(node);
-    uint8_t marker = BPLIST_ARRAY | (size < 15 ? size : 0xf);
-    byte_array_append(bplist, &marker, sizeof(uint8_t));
-    if (size >= 15) {
-        write_int(bplist, size);
+    info = (struct bplist_validate_info*)calloc(bplist.num_objects, sizeof(struct bplist_validate_info));
+    stack_size = 64;
+    stack = (struct bplist_validate_frame*)malloc(stack_size * sizeof(struct bplist_validate_frame));
+    if (!info || !stack) {
+        PLIST_BIN_ERR("%s: out of memory\n", __func__);
+        goto out;
     }
 
-    for (i = 0, cur = node_first_child(node); cur && i < size; cur = node_next_sibling(cur), i++) {
-        uint64_t idx = *(uint64_t *) (hash_table_lookup(ref_table, cur));
-        idx = be64toh(idx);
+    if (!bplist_validate_enter(&bplist, info, root_object, &stack[0], &entered)) {
+        goto out;
+    }
+    depth = entered;
+
+    while (depth > 0) {
+        struct bplist_validate_frame *frame = &stack[depth-1];
+        struct bplist_validate_info *child;
+        uint64_t index;
+
+        if (frame->next >= frame->count) {
+            /* container done, hand its totals to the parent */
+            struct bplist_validate_info *done = &info[frame->index];
+            done->nodes = uint64_add_sat(frame->sum.nodes, 1);
+            done->values = uint64_add_sat(frame->sum.values, 1);
+            done->depth = (frame->sum.depth < UINT32_MAX) ? frame->sum.depth + 1 : UINT32_MAX;
+            done->state = BPLIST_VALIDATE_DONE;
+            depth--;
+            if (depth > 0) {
+                frame = &stack[depth-1];
+                frame->sum.nodes = uint64_add_sat(frame->sum.nodes, done->nodes);
+                frame->sum.values = uint64_add_sat(frame->sum.values, done->values);
+                if (done->depth > frame->sum.depth) {
+                    frame->sum.depth = done->depth;
+                }
+                frame->next++;
+                frame->key_done = 0;
+            }
+            continue;
+        }
+
+        if (frame->is_dict && !frame->key_done) {
+            if (!bplist_read_ref(&bplist, frame->refs, frame->next, &index)) {
+                goto out;
+            }
+            if (!bplist_validate_key(&bplist, info, index)) {
+                PLIST_BIN_ERR("%s: dict entry %" PRIu64 ": invalid key\n", __func__, frame->next);
+                goto out;
+            }
+            frame->sum.nodes = uint64_add_sat(frame->sum.nodes, 1);
+            frame->key_done = 1;
+            continue;
+        }
+
+        if (!bplist_read_ref(&bplist, frame->refs, (frame->is_dict) ? frame->next + frame->count : frame->next, &index)) {
+            goto out;
+        }
+        child = &info[index];
+        if (child->state == BPLIST_VALIDATE_ON_PATH) {
+            PLIST_BIN_ERR("recursion detected in binary plist\n");
+            goto out;
+        }
+        if (child->state == BPLIST_VALIDATE_NEW) {
+            if (depth == stack_size) {
+                struct bplist_validate_frame *new_stack = (struct bplist_validate_frame*)realloc(stack, stack_size * 2 * sizeof(struct bplist_validate_frame));
+                if (!new_stack) {
+                    PLIST_BIN_ERR("%s: out of memory\n", __func__);
+                    goto out;
+                }
+                stack = new_stack;
+                stack_size *= 2;
+                frame = &stack[depth-1];
+            }
+            if (!bplist_validate_enter(&bplist, info, index, &stack[depth], &entered)) {
+                goto out;
+            }
+            if (entered) {
+                depth++;
+                continue;
+            }
+        }
+        frame->sum.nodes = uint64_add_sat(frame->sum.nodes, child->nodes);
+        frame->sum.values = uint64_add_sat(frame->sum.values, child->values);
+        if (child->depth > frame->sum.depth) {
+            frame->sum.depth = child->depth;
+        }
+        frame->next++;
+        frame->key_done = 0;
+    }
+
+    /* the parser gives up on documents that expand to too many nodes */
+    if (info[root_object].nodes > bplist_node_budget(length)) {
+        PLIST_BIN_ERR("node budget exhausted, too many object references\n");
+        goto out;
+    }
+
+    if (num_objects) {
+        *num_objects = info[root_object].values;
+    }
+    if (max_depth) {
+        *max_depth = info[root_object].depth;
+    }
+    res = 0;
+
+out:
+    free(stack);
+    free(info);
+    free(bplist.offsets);
+    return res;
+}
+
+struct plist_bin_view_s {
+    struct bplist_data bplist;
+    uint64_t root_object;
+};
+
+PLIST_API plist_bin_view_t plist_bin_view_open(const char *plist_bin, uint64_t length)
+{
+    if (!plist_bin) {
+        return NULL;
+    }
+    plist_bin_view_t view = (plist_bin_view_t)malloc(sizeof(struct plist_bin_view_s));
+    if (!view) {
+        return NULL;
+    }
+    if (!bplist_data_init(&view->bplist, plist_bin, length, &view->root_object)) {
+        free(view);
+        return NULL;
+    }
+    return view;
+}
+
+PLIST_API void plist_bin_view_close(plist_bin_view_t view)
+{
+    if (!view) {
+        return;
+    }
+    free(view->bplist.on_path);
+    free(view);
+}
+
+PLIST_API plist_bin_ref_t plist_bin_view_get_root(plist_bin_view_t view)
+{
+    return (view) ? view->root_object : PLIST_BIN_REF_INVALID;
+}
+
+/* locate an object and read its header; returns a pointer to its payload
+ * or NULL if the object or its payload are outside of the valid range */
+static const char* bplist_view_object(plist_bin_view_t view, plist_bin_ref_t ref, uint16_t *type, uint64_t *size)
+{
+    struct bplist_data *bplist = &view->bplist;
+    const char *ptr = bplist_object_at(bplist, ref);
+    if (!ptr || !bplist_read_header(bplist, &ptr, type, size)) {
+        return NULL;
+    }
+    uint64_t avail = (uint64_t)(bplist->offset_table - ptr);
+    uint64_t need = 0;
+    switch (*type) {
+    case BPLIST_STRING:
+    case BPLIST_DATA:
+        need = *size;
+        break;
+    case BPLIST_UNICODE:
+        need = (*size > avail) ? avail + 1 : *size * 2;
+        break;
+    case BPLIST_SET:
+    case BPLIST_ARRAY:
+        need = (*size > avail) ? avail + 1 : *size * bplist->ref_size;
+        break;
+    case BPLIST_DICT:
+        need = (*size > avail) ? avail + 1 : *size * 2 * bplist->ref_size;
+        break;
+    default:
+        break;
+    }
+    if (need > avail) {
+        PLIST_BIN_ERR("%s: data bytes of object %" PRIu64 " point outside of valid range\n", __func__, ref);
+        return NULL;
+    }
+    return ptr;
+}
+
+PLIST_API plist_type plist_bin_view_get_type(plist_bin_view_t view, plist_bin_ref_t ref)
+{
+    uint16_t type = 0;
+    uint64_t size = 0;
+    if (!view || !bplist_view_object(view, ref, &type, &size)) {
+        return PLIST_NONE;
+    }
+    switch (type) {
+    case BPLIST_NULL:
+        return (size == BPLIST_TRUE || size == BPLIST_FALSE) ? PLIST_BOOLEAN : PLIST_NONE;
+    case BPLIST_UINT:
+        return PLIST_UINT;
+    case BPLIST_REAL:
+        return PLIST_REAL;
+    case BPLIST_DATE:
+        return PLIST_DATE;
+    case BPLIST_DATA:
+        return PLIST_DATA;
+    case BPLIST_STRING:
+    case BPLIST_UNICODE:
+        return PLIST_STRING;
+    case BPLIST_SET:
+    case BPLIST_ARRAY:
+        return PLIST_ARRAY;
+    case BPLIST_UID:
+        return PLIST_UID;
+    case BPLIST_DICT:
+        return PLIST_DICT;
+    default:
+        return PLIST_NONE;
+    }
+}
+
+PLIST_API uint64_t plist_bin_view_get_size(plist_bin_view_t view, plist_bin_ref_t ref)
+{
+    uint16_t type = 0;
+    uint64_t size = 0;
+    if (!view || !bplist_view_object(view, ref, &type, &size)) {
+        return 0;
+    }
+    switch (type) {
+    case BPLIST_SET:
+    case BPLIST_ARRAY:
+    case BPLIST_DICT:
+        return size;
+    default:
+        return 0;
+    }
+}
+
+/* read the nth object reference stored at refs */
+static plist_bin_ref_t bplist_view_ref(plist_bin_view_t view, const char *refs, uint64_t n)
+{
+    uint64_t ref = UINT_TO_HOST(refs + n * view->bplist.ref_size, view->bplist.ref_size);
+    return (ref < view->bplist.num_objects) ? ref : PLIST_BIN_REF_INVALID;
+}
+
+PLIST_API plist_bin_ref_t plist_bin_view_array_get_item(plist_bin_view_t view, plist_bin_ref_t ref, uint64_t n)
+{
+    uint16_t type = 0;
+    uint64_t size = 0;
+    const char *refs = (view) ? bplist_view_object(view, ref, &type, &size) : NULL;
+    if (!refs || (type != BPLIST_ARRAY && type != BPLIST_SET) || n >= size) {
+        return PLIST_BIN_REF_INVALID;
+    }
+    return bplist_view_ref(view, refs, n);
+}
+
+/* Decode a single object of a view. Every decode gets a fresh node
+ * budget, so that the lookups on a long-lived view don't use it up. */
+static plist_t bplist_view_decode(plist_bin_view_t view, plist_bin_ref_t ref)
+{
+    view->bplist.budget = bplist_node_budget(view->bplist.size);
+    plist_t node = parse_bin_node_at_index(&view->bplist, ref);
+    bplist_release_keys(&view->bplist);
+    return node;
+}
+
+/* compare a key object with key without decoding ASCII keys */
+static int bplist_view_key_equals(plist_bin_view_t view, plist_bin_ref_t key_ref, const char *key, size_t key_len)
+{
+    uint16_t type = 0;
+    uint64_t size = 0;
+    const char *str = bplist_view_object(view, key_ref, &type, &size);
+    if (!str) {
+        return 0;
+    }
+    if (type == BPLIST_STRING) {
+        return (size == key_len && memcmp(str, key, key_len) == 0);
+    }
+    if (type == BPLIST_UNICODE) {
+        /* an UTF-8 encoded key is at least as long as its UTF-16 units */
+        if (size > key_len) {
+            return 0;
+        }
+        int res = 0;
+        plist_t node = bplist_view_decode(view, key_ref);
+        if (node) {
+            plist_data_t data = plist_get_data(node);
+            res = (data->length == key_len && memcmp(data->strval, key, key_len) == 0);
+            plist_free(node);
+        }
+        return res;
+    }
+    return 0;
+}
+
+PLIST_API plist_bin_ref_t plist_bin_view_dict_get_item(plist_bin_view_t view, plist_bin_ref_t ref, const char *key)
+{
+    uint16_t type = 0;
+    uint64_t size = 0;
+    uint64_t i;
+    const char *refs = (view && key) ? bplist_view_object(view, ref, &type, &size) : NULL;
+    if (!refs || type != BPLIST_DICT) {
+        return PLIST_BIN_REF_INVALID;
+    }
+    size_t key_len = strlen(key);
+    for (i = 0; i < size; i++) {
+        plist_bin_ref_t key_ref = bplist_view_ref(view, refs, i);
+        if (key_ref != PLIST_BIN_REF_INVALID && bplist_view_key_equals(view, key_ref, key, key_len)) {
+            return bplist_view_ref(view, refs, size + i);
+        }
+    }
+    return PLIST_BIN_REF_INVALID;
+}
+
+PLIST_API plist_bin_ref_t plist_bin_view_dict_get_item_at(plist_bin_view_t view, plist_bin_ref_t ref, uint64_t n, char **key)
+{
+    uint16_t type = 0;
+    uint64_t size = 0;
+    if (key) {
+        *key = NULL;
+    }
+    const char *refs = (view) ? bplist_view_object(view, ref, &type, &size) : NULL;
+    if (!refs || type != BPLIST_DICT || n >= size) {
+        return PLIST_BIN_REF_INVALID;
+    }
+    if (key) {
+        plist_bin_ref_t key_ref = bplist_view_ref(view, refs, n);
+        plist_t node = (key_ref != PLIST_BIN_REF_INVALID) ? bplist_view_decode(view, key_ref) : NULL;
+        if (PLIST_STRING != plist_get_node_type(node)) {
+            plist_free(node);
+            return PLIST_BIN_REF_INVALID;
+        }
+        /* not through plist_get_string_val(), a key may contain U+0000 */
+        plist_data_t data = plist_get_data(node);
+        *key = (char*)malloc(data->length + 1);
+        if (*key) {
+            memcpy(*key, data->strval, data->length);
+            (*key)[data->length] = '\0';
+        }
+        plist_free(node);
+        if (!*key) {
+            return PLIST_BIN_REF_INVALID;
+        }
+    }
+    return bplist_view_ref(view, refs, size + n);
+}
+
+PLIST_API plist_t plist_bin_view_get_node(plist_bin_view_t view, plist_bin_ref_t ref)
+{
+    if (!view || ref >= view->bplist.num_objects) {
+        return NULL;
+    }
+    return bplist_view_decode(view, ref);
+}
+
+static unsigned int plist_data_hash(const void* key)
+{
+    plist_data_t data = plist_get_data((plist_t) key);
+
+    unsigned int hash = data->type;
+    uint64_t i = 0;
+
+    char *buff = NULL;
+    uint64_t size = 0;
+
+    switch (data->type)
+    {
+    case PLIST_BOOLEAN:
+    case PLIST_UINT:
+    case PLIST_REAL:
+    case PLIST_DATE:
+    case PLIST_UID:
+        buff = (char *) &data->intval;	//works also for real as we use an union
+        size = 8;
+        break;
+    case PLIST_KEY:
+    case PLIST_STRING:
+        buff = data->strval;
+        size = data->length;
+        break;
+    case PLIST_DATA:
+    case PLIST_ARRAY:
+    case PLIST_DICT:
+        //for these types only hash pointer
+        buff = (char *) &key;
+        size = sizeof(const void*);
+        break;
+    default:
+        break;
+    }
+
+    // now perform hash using djb2 hashing algorithm
+    // see: http://www.cse.yorku.ca/~oz/hash.html
+    hash += 5381;
+    for (i = 0; i < size; buff++, i++) {
+        hash = ((hash << 5) + hash) + *buff;
+    }
+
+    return hash;
+}
+
+/* The objects to write, in order, and the object indices of the children
+ * of every container: the references of object i start at
+ * refs[refs_start[i]], keys of a dictionary alternating with values. */
+struct serialize_s
+{
+    ptrarray_t* objects;
+    uint64_t* refs;
+    uint64_t* refs_start;
+    uint64_t root_index;
+};
+
+/* number of nodes of the tree below top, and its depth */
+static uint64_t count_nodes(node_t* top, uint32_t *depth)
+{
+    node_t *node = top;
+    uint64_t count = 0;
+    uint32_t cur = 0;
+    int leaving = 0;
+
+    *depth = 0;
+    while (node) {
+        if (!leaving) {
+            count++;
+            if (node->first && ++cur > *depth) {
+                *depth = cur;
+            }
+        } else {
+            cur--;
+        }
+        node = node_walk_next(top, node, &leaving);
+    }
+    return count;
+}
+
+/* Objects are assigned in the order of a depth-first walk. Equal leaf
+ * values share one object, containers get one per occurrence. Data nodes
+ * are hashed by their pointer, so equal payloads are only merged when the
+ * hashes meet (PLIST_WRITE_COMPACT merges them by content). Each
+ * container reserves a run of refs for its children, which are filled in
+ * as the children are visited. */
+static void serialize_plist(node_t* top, struct serialize_s *ser, uint32_t depth)
+{
+    hashtable_t *values = hash_table_new(plist_data_hash, plist_data_compare, NULL);
+    /* the next free slot in refs of each open container */
+    uint64_t *cursors = (uint64_t*)malloc(((depth > 0) ? depth : 1) * sizeof(uint64_t));
+    uint64_t refs_len = 0;
+    uint32_t open = 0;
+    node_t *node = top;
+    int leaving = 0;
+
+    assert(values != NULL && cursors != NULL);
+    while (node) {
+        if (!leaving) {
+            plist_data_t data = plist_get_data(node);
+            uint64_t index = 0;
+            if (data->type == PLIST_ARRAY || data->type == PLIST_DICT) {
+                index = ser->objects->len;
+                ser->refs_start[index] = refs_len;
+                refs_len += node->count;
+                ptr_array_add(ser->objects, node);
+            } else {
+                //values are stored off by one, NULL means not found
+                void* val = hash_table_lookup(values, node);
+                if (val) {
+                    index = (uint64_t)(uintptr_t)val - 1;
+                } else {
+                    index = ser->objects->len;
+                    ser->refs_start[index] = 0;
+                    hash_table_insert(values, node, (void*)(uintptr_t)(index + 1));
+                    ptr_array_add(ser->objects, node);
+                }
+            }
+            if (node == top) {
+                ser->root_index = index;
+            } else {
+                ser->refs[cursors[open-1]++] = index;
+            }
+            if (node->first) {
+                cursors[open++] = ser->refs_start[index];
+            }
+        } else {
+            //all children of node are done
+            open--;
+        }
+        node = node_walk_next(top, node, &leaving);
+    }
+
+    free(cursors);
+    hash_table_destroy(values);
+}
+
+/* Identity of an object in compact mode. Leaves are identified by their
+ * content, containers by their type and the indices of their children, so
+ * equal subtrees collapse into one object once their children did. Keys
+ * and strings with the same text share one object, as keys are written as
+ * strings anyway. */
+struct compact_obj_s
+{
+    node_t *node;
+    plist_type type;
+    unsigned int hash;
+    uint64_t index;
+    uint64_t count;
+    uint64_t *children;
+};
+
+static unsigned int compact_hash_bytes(unsigned int hash, const void *buf, uint64_t size)
+{
+    const unsigned char *p = (const unsigned char*)buf;
+    uint64_t i = 0;
+    for (i = 0; i < size; i++) {
+        hash = ((hash << 5) + hash) + p[i];
+    }
+    return hash;
+}
+
+static unsigned int compact_obj_hash(const void *key)
+{
+    return ((const struct compact_obj_s*)key)->hash;
+}
+
+static int compact_obj_compare(const void *a, const void *b)
+{
+    const struct compact_obj_s *obj_a = (const struct compact_obj_s*)a;
+    const struct compact_obj_s *obj_b = (const struct compact_obj_s*)b;
+    plist_data_t data_a = NULL;
+    plist_data_t data_b = NULL;
+
+    if (obj_a->type != obj_b->type || obj_a->hash != obj_b->hash) {
+        return FALSE;
+    }
+    switch (obj_a->type) {
+    case PLIST_ARRAY:
+    case PLIST_DICT:
+        return (obj_a->count == obj_b->count && (obj_a->count == 0 || memcmp(obj_a->children, obj_b->children, obj_a->count * sizeof(uint64_t)) == 0));
+    case PLIST_STRING:
+        data_a = plist_get_data(obj_a->node);
+        data_b = plist_get_data(obj_b->node);
+        return (data_a->length == data_b->length && memcmp(data_a->strval, data_b->strval, data_a->length) == 0);
+    default:
+        return plist_data_compare(obj_a->node, obj_b->node);
+    }
+}
+
+/* like serialize_plist, but children are assigned their object first so
+ * that each container can be matched against the ones already written.
+ * The indices of completed nodes wait on a stack until their parent is
+ * complete; the children of a container are the topmost entries then. */
+static void serialize_plist_compact(node_t* top, struct serialize_s *ser, uint64_t num_nodes)
+{
+    hashtable_t *content = hash_table_new(compact_obj_hash, compact_obj_compare, free);
+    uint64_t *pending = (uint64_t*)malloc(num_nodes * sizeof(uint64_t));
+    uint64_t num_pending = 0;
+    uint64_t refs_len = 0;
+    node_t *node = top;
+    int leaving = 0;
+
+    assert(content != NULL && pending != NULL);
+
+    while (node) {
+        if (!leaving && node->first) {
+            node = node_walk_next(top, node, &leaving);
+            continue;
+        }
+        plist_data_t data = plist_get_data(node);
+        struct compact_obj_s obj;
+        struct compact_obj_s *found = NULL;
+
+        obj.node = node;
+        obj.type = (data->type == PLIST_KEY) ? PLIST_STRING : data->type;
+        obj.hash = 5381 + obj.type;
+        obj.count = 0;
+        obj.children = NULL;
+        switch (obj.type) {
+        case PLIST_ARRAY:
+        case PLIST_DICT:
+            obj.count = node->count;
+            num_pending -= obj.count;
+            obj.children = pending + num_pending;
+            obj.hash = compact_hash_bytes(obj.hash, obj.children, obj.count * sizeof(uint64_t));
+            break;
+        case PLIST_STRING:
+            obj.hash = compact_hash_bytes(obj.hash, data->strval, data->length);
+            break;
+        case PLIST_DATA:
+            obj.hash = compact_hash_bytes(obj.hash, data->buff, data->length);
+            break;
+        default:
+            obj.hash = compact_hash_bytes(obj.hash, &data->intval, sizeof(data->intval));
+            break;
+        }
+
+        found = (struct compact_obj_s*)hash_table_lookup(content, &obj);
+        if (!found) {
+            found = (struct compact_obj_s*)malloc(sizeof(struct compact_obj_s));
+            assert(found != NULL);
+            memcpy(found, &obj, sizeof(struct compact_obj_s));
+            found->index = ser->objects->len;
+            //the stack is reused, keep the children where they are written from
+            found->children = ser->refs + refs_len;
+            if (obj.count > 0) {
+                memcpy(found->children, obj.children, obj.count * sizeof(uint64_t));
+            }
+            ser->refs_start[found->index] = refs_len;
+            refs_len += obj.count;
+            ptr_array_add(ser->objects, node);
+            if (hash_table_insert(content, found, found) < 0) {
+                //written without being shared with equal objects then
+                pending[num_pending++] = found->index;
+                free(found);
+                found = NULL;
+            }
+        }
+        if (found) {
+            pending[num_pending++] = found->index;
+        }
+
+        node = node_walk_next(top, node, &leaving);
+    }
+    ser->root_index = pending[0];
+
+    free(pending);
+    hash_table_destroy(content);
+}
+
+/* collect the objects to write and the references of every container;
+ * there are at most as many of either as there are nodes */
+static void bplist_serialize(plist_t plist, struct serialize_s *ser, plist_write_options_t options)
+{
+    uint32_t depth = 0;
+    uint64_t num_nodes = count_nodes((node_t*)plist, &depth);
+
+    ser->objects = ptr_array_new(4096);
+    ser->refs = (uint64_t*)malloc(num_nodes * sizeof(uint64_t));
+    ser->refs_start = (uint64_t*)malloc(num_nodes * sizeof(uint64_t));
+    ser->root_index = 0;
+    assert(ser->refs != NULL && ser->refs_start != NULL);
+    if (options & PLIST_WRITE_COMPACT) {
+        serialize_plist_compact((node_t*)plist, ser, num_nodes);
+    } else {
+        serialize_plist((node_t*)plist, ser, depth);
+    }
+}
+
+static void bplist_serialize_free(struct serialize_s *ser)
+{
+    ptr_array_free(ser->objects);
+    free(ser->refs);
+    free(ser->refs_start);
+}
+
+#define Log2(x) (x == 8 ? 3 : (x == 4 ? 2 : (x == 2 ? 1 : 0)))
+
+static void write_int(bytearray_t * bplist, uint64_t val)
+{
+    int size = get_needed_bytes(val);
+    uint8_t sz;
+    //do not write 3bytes int node
+    if (size == 3)
+        size++;
+    sz = BPLIST_UINT | Log2(size);
+
+    val = be64toh(val);
+    byte_array_append(bplist, &sz, 1);
+    byte_array_append(bplist, (uint8_t*)&val + (8-size), size);
+}
+
+static void write_uint(bytearray_t * bplist, uint64_t val)
+{
+    uint8_t sz = BPLIST_UINT | 4;
+    uint64_t zero = 0;
+
+    val = be64toh(val);
+    byte_array_append(bplist, &sz, 1);
+    byte_array_append(bplist, &zero, sizeof(uint64_t));
+    byte_array_append(bplist, &val, sizeof(uint64_t));
+}
+
+static void write_real(bytearray_t * bplist, double val)
+{
+    int size = get_real_bytes(val);	//cheat to know used space
+    uint8_t buff[16];
+    buff[7] = BPLIST_REAL | Log2(size);
+    if (size == sizeof(float)) {
+        float floatval = (float)val;
+        *(uint32_t*)(buff+8) = float_bswap32(*(uint32_t*)&floatval);
+    } else {
+        *(uint64_t*)(buff+8) = float_bswap64(*(uint64_t*)&val);
+    }
+    byte_array_append(bplist, buff+7, size+1);
+}
+
+static void write_date(bytearray_t * bplist, double val)
+{
+    uint8_t buff[16];
+    buff[7] = BPLIST_DATE | 3;
+    *(uint64_t*)(buff+8) = float_bswap64(*(uint64_t*)&val);
+    byte_array_append(bplist, buff+7, 9);
+}
+
+static void write_raw_data(bytearray_t * bplist, uint8_t mark, uint8_t * val, uint64_t size)
+{
+    uint8_t marker = mark | (size < 15 ? size : 0xf);
+    byte_array_append(bplist, &marker, sizeof(uint8_t));
+    if (size >= 15) {
+        write_int(bplist, size);
+    }
+    byte_array_append(bplist, val, size);
+}
+
+static void write_data(bytearray_t * bplist, uint8_t * val, uint64_t size)
+{
+    write_raw_data(bplist, BPLIST_DATA, val, size);
+}
+
+static void write_string(bytearray_t * bplist, char *val, uint64_t size)
+{
+    write_raw_data(bplist, BPLIST_STRING, (uint8_t *) val, size);
+}
+
+static void write_unicode(bytearray_t * bplist, char *val, uint64_t size, uint64_t units)
+{
+    uint8_t marker = BPLIST_UNICODE | (units < 15 ? units : 0xf);
+    uint8_t *outbuf = NULL;
+    byte_array_append(bplist, &marker, sizeof(uint8_t));
+    if (units >= 15) {
+        write_int(bplist, units);
+    }
+    //convert straight into the output unless it doesn't fit the stream window
+    outbuf = (uint8_t*)byte_array_reserve(bplist, units * 2);
+    if (outbuf) {
+        utf8_to_utf16be(val, size, outbuf, NULL);
+        bplist->len += units * 2;
+        return;
+    }
+    outbuf = (uint8_t*)malloc(units * 2);
+    if (!outbuf) {
+        PLIST_BIN_ERR("%s: Could not allocate %" PRIu64 " bytes\n", __func__, units * 2);
+        bplist->error = 1;
+        return;
+    }
+    utf8_to_utf16be(val, size, outbuf, NULL);
+    byte_array_append(bplist, outbuf, units * 2);
+    free(outbuf);
+}
+
+static void write_array_refs(bytearray_t * bplist, uint64_t size, const uint64_t* refs, uint8_t ref_size)
+{
+    uint64_t i = 0;
+
+    uint8_t marker = BPLIST_ARRAY | (size < 15 ? size : 0xf);
+    byte_array_append(bplist, &marker, sizeof(uint8_t));
+    if (size >= 15) {
+        write_int(bplist, size);
+    }
+
+    for (i = 0; i < size; i++) {
+        uint64_t idx = be64toh(refs[i]);
         byte_array_append(bplist, (uint8_t*)&idx + (sizeof(uint64_t) - ref_size), ref_size);
     }
 }
 
-static void write_dict(bytearray_t * bplist, node_t* node, hashtable_t* ref_table, uint8_t ref_size)
+/* refs holds size key/value pairs */
+static void write_dict_refs(bytearray_t * bplist, uint64_t size, const uint64_t* refs, uint8_t ref_size)
+{
+    uint64_t i = 0;
+
+    uint8_t marker = BPLIST_DICT | (size < 15 ? size : 0xf);
+    byte_array_append(bplist, &marker, sizeof(uint8_t));
+    if (size >= 15) {
+        write_int(bplist, size);
+    }
+
+    for (i = 0; i < size; i++) {
+        uint64_t idx1 = be64toh(refs[2*i]);
+        byte_array_append(bplist, (uint8_t*)&idx1 + (sizeof(uint64_t) - ref_size), ref_size);
+    }
+
+    for (i = 0; i < size; i++) {
+        uint64_t idx2 = be64toh(refs[2*i+1]);
+        byte_array_append(bplist, (uint8_t*)&idx2 + (sizeof(uint64_t) - ref_size), ref_size);
+    }
+}
+
+static void write_array(bytearray_t * bplist, node_t* node, const uint64_t* refs, uint8_t ref_size)
+{
+    write_array_refs(bplist, node_n_children(node), refs, ref_size);
+}
+
+static void write_dict(bytearray_t * bplist, node_t* node, const uint64_t* refs, uint8_t ref_size)
+{
+    write_dict_refs(bplist, node_n_children(node) / 2, refs, ref_size);
+}
+
+static void write_uid(bytearray_t * bplist, uint64_t val)
+{
+    val = (uint32_t)val;
+    int size = get_needed_bytes(val);
+    uint8_t sz;
+    //do not write 3bytes int node
+    if (size == 3)
+        size++;
+    sz = BPLIST_UID | (size-1); // yes, this is what Apple does...
+
+    val = be64toh(val);
+    byte_array_append(bplist, &sz, 1);
+    byte_array_append(bplist, (uint8_t*)&val + (8-size), size);
+}
+
+/* String objects are written either as ASCII or as UTF-16. Which one, and
+ * the UTF-16 length, is determined once per object before sizing and
+ * writing; non-string objects get 0. */
+#define BPLIST_STR_ASCII UINT64_MAX
+
+static uint64_t *classify_strings(ptrarray_t *objects)
+{
+    uint64_t i = 0;
+    uint64_t *str_units = (uint64_t*)malloc(sizeof(uint64_t) * (objects->len > 0 ? objects->len : 1));
+    if (!str_units) {
+        return NULL;
+    }
+    for (i = 0; i < (uint64_t)objects->len; i++) {
+        plist_data_t data = plist_get_data(ptr_array_index(objects, i));
+        if (data->type != PLIST_KEY && data->type != PLIST_STRING) {
+            str_units[i] = 0;
+        } else if (utf8_is_ascii(data->strval, data->length)) {
+            str_units[i] = BPLIST_STR_ASCII;
+        } else {
+            size_t consumed = 0;
+            str_units[i] = utf8_to_utf16be(data->strval, data->length, NULL, &consumed);
+            if (consumed < data->length) {
+                PLIST_BIN_ERR("%s: invalid utf8 sequence in string at index %" PRIu64 "\n", __func__, (uint64_t)consumed);
+            }
+        }
+    }
+    return str_units;
+}
+
+/* number of bytes write_object() needs for node; exact except for
+ * integers, where it is an upper bound */
+static uint64_t object_size(node_t *node, uint64_t str_units, uint8_t ref_size)
+{
+    plist_data_t data = plist_get_data(node);
+    uint64_t req = 0;
+    uint64_t size;
+    uint8_t bsize;
+    switch (data->type)
+    {
+    case PLIST_BOOLEAN:
+        req += 1;
+        break;
+    case PLIST_KEY:
+    case PLIST_STRING:
+        size = (str_units == BPLIST_STR_ASCII) ? data->length : str_units;
+        req += 1;
+        if (size >= 15) {
+            bsize = get_needed_bytes(size);
+            if (bsize == 3) bsize = 4;
+            req += 1;
+            req += bsize;
+        }
+        req += (str_units == BPLIST_STR_ASCII) ? size : size * 2;
+        break;
+    case PLIST_REAL:
+        size = get_real_bytes(data->realval);
+        req += 1;
+        req += size;
+        break;
+    case PLIST_DATE:
+        req += 9;
+        break;
+    case PLIST_ARRAY:
+        size = node_n_children(node);
+        req += 1;
+        if (size >= 15) {
+            bsize = get_needed_bytes(size);
+            if (bsize == 3) bsize = 4;
+            req += 1;
+            req += bsize;
+        }
+        req += size * ref_size;
+        break;
+    case PLIST_DICT:
+        size = node_n_children(node) / 2;
+        req += 1;
+        if (size >= 15) {
+            bsize = get_needed_bytes(size);
+            if (bsize == 3) bsize = 4;
+            req += 1;
+            req += bsize;
+        }
+        req += size * 2 * ref_size;
+        break;
+    default:
+        size = data->length;
+        req += 1;
+        if (size >= 15) {
+            bsize = get_needed_bytes(size);
+            if (bsize == 3) bsize = 4;
+            req += 1;
+            req += bsize;
+        }
+        req += data->length;
+        break;
+    }
+    return req;
+}
+
+static void write_object(bytearray_t *bplist_buff, node_t *node, const uint64_t *refs, uint64_t str_units, uint8_t ref_size)
+{
+    plist_data_t data = plist_get_data(node);
+    uint8_t buff;
+
+    switch (data->type)
+    {
+    case PLIST_BOOLEAN:
+        buff = data->boolval ? BPLIST_TRUE : BPLIST_FALSE;
+        byte_array_append(bplist_buff, &buff, sizeof(uint8_t));
+        break;
+
+    case PLIST_UINT:
+        if (data->length == 16) {
+            write_uint(bplist_buff, data->intval);
+        } else {
+            write_int(bplist_buff, data->intval);
+        }
+        break;
+
+    case PLIST_REAL:
+        write_real(bplist_buff, data->realval);
+        break;
+
+    case PLIST_KEY:
+    case PLIST_STRING:
+        if (str_units == BPLIST_STR_ASCII)
+        {
+            write_string(bplist_buff, data->strval, data->length);
+        }
+        else
+        {
+            write_unicode(bplist_buff, data->strval, data->length, str_units);
+        }
+        break;
+    case PLIST_DATA:
+        write_data(bplist_buff, data->buff, data->length);
+        break;
+    case PLIST_ARRAY:
+        write_array(bplist_buff, node, refs, ref_size);
+        break;
+    case PLIST_DICT:
+        write_dict(bplist_buff, node, refs, ref_size);
+        break;
+    case PLIST_DATE:
+        write_date(bplist_buff, data->realval);
+        break;
+    case PLIST_UID:
+        write_uid(bplist_buff, data->intval);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Objects are encoded independently of each other, so with
+ * PLIST_WRITE_PARALLEL consecutive runs of them are encoded into separate
+ * buffers on multiple threads. The offsets recorded by each chunk are
+ * relative to its start and fixed up when the chunks are concatenated. */
+struct bplist_encoder {
+    const struct serialize_s *ser;
+    const uint64_t *str_units;
+    uint8_t ref_size;
+    uint64_t *offsets;
+    uint64_t chunk_size;
+    uint64_t num_chunks;
+    volatile uint64_t next;
+    bytearray_t **chunks;
+};
+
+static void write_objects_chunked(void *arg)
+{
+    struct bplist_encoder *enc = (struct bplist_encoder*)arg;
+    uint64_t c;
+
+    while ((c = bplist_atomic_fetch_add(&enc->next, 1)) < enc->num_chunks) {
+        uint64_t i = c * enc->chunk_size;
+        uint64_t end = (enc->ser->objects->len - i < enc->chunk_size) ? (uint64_t)enc->ser->objects->len : i + enc->chunk_size;
+        uint64_t req = 0;
+        uint64_t j;
+        bytearray_t *chunk;
+        for (j = i; j < end; j++) {
+            req += object_size(ptr_array_index(enc->ser->objects, j), enc->str_units[j], enc->ref_size);
+        }
+        chunk = byte_array_new(req);
+        for (; i < end; i++) {
+            enc->offsets[i] = chunk->len;
+            write_object(chunk, ptr_array_index(enc->ser->objects, i), enc->ser->refs + enc->ser->refs_start[i], enc->str_units[i], enc->ref_size);
+        }
+        enc->chunks[c] = chunk;
+    }
+}
+
+static void write_objects_parallel(bytearray_t *bplist_buff, const struct serialize_s *ser, const uint64_t *str_units, uint8_t ref_size, uint64_t *offsets, unsigned int nthreads)
+{
+    struct bplist_encoder enc;
+    uint64_t num_objects = ser->objects->len;
+    uint64_t base;
+    uint64_t c;
+    uint64_t i;
+
+    enc.ser = ser;
+    enc.str_units = str_units;
+    enc.ref_size = ref_size;
+    enc.offsets = offsets;
+    /* more chunks than threads, so that a thread that got a chunk of big
+     * objects doesn't hold up the others */
+    enc.num_chunks = (uint64_t)nthreads * 8;
+    enc.chunk_size = (num_objects + enc.num_chunks - 1) / enc.num_chunks;
+    enc.num_chunks = (num_objects + enc.chunk_size - 1) / enc.chunk_size;
+    enc.next = 0;
+    enc.chunks = (bytearray_t**)calloc(enc.num_chunks, sizeof(bytearray_t*));
+    assert(enc.chunks != NULL);
+
+    bplist_run_threads(nthreads, write_objects_chunked, &enc, 0);
+
+    for (c = 0; c < enc.num_chunks; c++) {
+        bytearray_t *chunk = enc.chunks[c];
+        uint64_t end = (num_objects - c * enc.chunk_size < enc.chunk_size) ? num_objects : (c + 1) * enc.chunk_size;
+        base = bplist_buff->flushed + bplist_buff->len;
+        for (i = c * enc.chunk_size; i < end; i++) {
+            offsets[i] += base;
+        }
+        if (chunk->error) {
+            bplist_buff->error = 1;
+        }
+        byte_array_append(bplist_buff, chunk->data, chunk->len);
+        byte_array_free(chunk);
+    }
+    free(enc.chunks);
+}
+
+/* write header, objects, offset table and trailer of the serialized
+ * objects to bplist_buff; offsets are counted from the start of the
+ * output, including whatever has been flushed to a sink already */
+static void write_bplist(bytearray_t *bplist_buff, const struct serialize_s *ser, const uint64_t *str_units, plist_write_options_t options)
+{
+    uint8_t offset_size = 0;
+    uint8_t ref_size = 0;
+    uint64_t num_objects = ser->objects->len;
+    uint64_t offset_table_index = 0;
+    uint64_t i = 0;
+    uint64_t *offsets = NULL;
+    bplist_trailer_t trailer;
+    uint64_t buff_len = 0;
+    unsigned int nthreads = 0;
+
+    ref_size = get_needed_bytes(num_objects);
+
+    //set magic number and version
+    byte_array_append(bplist_buff, BPLIST_MAGIC, BPLIST_MAGIC_SIZE);
+    byte_array_append(bplist_buff, BPLIST_VERSION, BPLIST_VERSION_SIZE);
+
+    //write objects and table
+    offsets = (uint64_t *) malloc(num_objects * sizeof(uint64_t));
+    assert(offsets != NULL);
+    if (options & PLIST_WRITE_PARALLEL) {
+        nthreads = bplist_parallel_threads(num_objects, BPLIST_PARALLEL_MIN_OBJECTS);
+    }
+    if (nthreads > 1) {
+        write_objects_parallel(bplist_buff, ser, str_units, ref_size, offsets, nthreads);
+    } else {
+        for (i = 0; i < num_objects; i++) {
+            offsets[i] = bplist_buff->flushed + bplist_buff->len;
+            write_object(bplist_buff, ptr_array_index(ser->objects, i), ser->refs + ser->refs_start[i], str_units[i], ref_size);
+        }
+    }
+
+    //write offsets
+    buff_len = bplist_buff->flushed + bplist_buff->len;
+    offset_size = get_needed_bytes(buff_len);
+    offset_table_index = buff_len;
+    for (i = 0; i < num_objects; i++) {
+        uint64_t offset = be64toh(offsets[i]);
+        byte_array_append(bplist_buff, (uint8_t*)&offset + (sizeof(uint64_t) - offset_size), offset_size);
+    }
+    free(offsets);
+
+    //setup trailer
+    memset(trailer.unused, '\0', sizeof(trailer.unused));
+    trailer.offset_size = offset_size;
+    trailer.ref_size = ref_size;
+    trailer.num_objects = be64toh(num_objects);
+    trailer.root_object_index = be64toh(ser->root_index);
+    trailer.offset_table_offset = be64toh(offset_table_index);
+
+    byte_array_append(bplist_buff, &trailer, sizeof(bplist_trailer_t));
+}
+
+PLIST_API void plist_to_bin_with_options(plist_t plist, char **plist_bin, uint64_t * length, plist_write_options_t options)
+{
+    ptrarray_t* objects = NULL;
+    struct serialize_s ser_s;
+    uint8_t ref_size = 0;
+    uint64_t num_objects = 0;
+    bytearray_t *bplist_buff = NULL;
+    uint64_t *str_units = NULL;
+    uint64_t i = 0;
+
+    //check for valid input
+    if (!plist || !plist_bin || *plist_bin || !length)
+        return;
+
+    //serialize plist
+    bplist_serialize(plist, &ser_s, options);
+    objects = ser_s.objects;
+
+    num_objects = objects->len;
+    ref_size = get_needed_bytes(num_objects);
+
+    str_units = classify_strings(objects);
+    if (!str_units) {
+        bplist_serialize_free(&ser_s);
+        return;
+    }
+
+    //figure out the storage size required
+    uint64_t req = 0;
+    for (i = 0; i < num_objects; i++) {
+        req += object_size(ptr_array_index(objects, i), str_units[i], ref_size);
+    }
+    // add size of magic
+    req += BPLIST_MAGIC_SIZE;
+    req += BPLIST_VERSION_SIZE;
+    // add size of offset table
+    req += get_needed_bytes(req) * num_objects;
+    // add size of trailer
+    req += sizeof(bplist_trailer_t);
+
+    //setup a dynamic bytes array to store bplist in
+    bplist_buff = byte_array_new(req);
+
+    write_bplist(bplist_buff, &ser_s, str_units, options);
+
+    //free intermediate objects
+    bplist_serialize_free(&ser_s);
+    free(str_units);
+
+    //set output buffer and size
+    *plist_bin = bplist_buff->data;
+    *length = bplist_buff->len;
+
+    bplist_buff->data = NULL; // make sure we don't free the output buffer
+    byte_array_free(bplist_buff);
+}
+
+PLIST_API void plist_to_bin64(plist_t plist, char **plist_bin, uint64_t * length)
+{
+    plist_to_bin_with_options(plist, plist_bin, length, PLIST_WRITE_DEFAULT);
+}
+
+PLIST_API void plist_to_bin(plist_t plist, char **plist_bin, uint32_t * length)
+{
+    uint64_t len = 0;
+    if (!plist_bin || *plist_bin || !length)
+        return;
+    plist_to_bin64(plist, plist_bin, &len);
+    if (*plist_bin && len > UINT32_MAX) {
+        /* the length can not be represented, don't hand out a truncated one */
+        free(*plist_bin);
+        *plist_bin = NULL;
+        len = 0;
+    }
+    *length = (uint32_t)len;
+}
+
+PLIST_API int plist_to_bin_stream_with_options(plist_t plist, plist_write_func_t write_func, void *user_data, plist_write_options_t options)
+{
+    ptrarray_t* objects = NULL;
+    struct serialize_s ser_s;
+    bytearray_t *bplist_buff = NULL;
+    uint64_t *str_units = NULL;
+    int res;
+
+    if (!plist || !write_func)
+        return -1;
+
+    bplist_serialize(plist, &ser_s, options);
+    objects = ser_s.objects;
+
+    str_units = classify_strings(objects);
+    if (!str_units) {
+        bplist_serialize_free(&ser_s);
+        return -1;
+    }
+
+    //only a small window of the output is kept in memory
+    bplist_buff = byte_array_new_sink(BPLIST_STREAM_BUFSIZE, write_func, user_data);
+    write_bplist(bplist_buff, &ser_s, str_units, options);
+    res = byte_array_flush(bplist_buff);
+
+    bplist_serialize_free(&ser_s);
+    byte_array_free(bplist_buff);
+    free(str_units);
+
+    return res;
+}
+
+PLIST_API int plist_to_bin_stream(plist_t plist, plist_write_func_t write_func, void *user_data)
+{
+    return plist_to_bin_stream_with_options(plist, write_func, user_data, PLIST_WRITE_DEFAULT);
+}
+
+int bplist_write_fd(const void *buf, size_t len, void *user_data)
+{
+    int fd = *(int*)user_data;
+    const char *p = (const char*)buf;
+    while (len > 0) {
+#ifdef WIN32
+        int written = _write(fd, p, (len > INT_MAX) ? INT_MAX : (unsigned int)len);
+#else
+        ssize_t written = write(fd, p, len);
+#endif
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+PLIST_API int plist_to_bin_fd(plist_t plist, int fd)
+{
+    if (fd < 0)
+        return -1;
+    return plist_to_bin_stream(plist, bplist_write_fd, &fd);
+}
+
+static int bplist_write_file(const void *buf, size_t len, void *user_data)
+{
+    return (fwrite(buf, 1, len, (FILE*)user_data) == len) ? 0 : -1;
+}
+
+PLIST_API int plist_to_bin_file(plist_t plist, FILE *file)
+{
+    if (!file)
+        return -1;
+    if (plist_to_bin_stream(plist, bplist_write_file, file) != 0)
+        return -1;
+    return (fflush(file) == 0) ? 0 : -1;
+}
+
+PLIST_API void plist_to_bin_free(char *plist_bin)
+{
+    free(plist_bin);
+}
+
+/* An array or dictionary of the original document that plist_bin_update()
+ * writes anew, under its original index. Dictionary refs are key/value
+ * pairs like serialize_plist() produces them. */
+struct bplist_update_container {
+    uint64_t index;
+    int is_dict;
+    uint64_t *refs;
+    uint64_t num_refs;
+    uint64_t capacity;
+    uint64_t offset;
+    uint64_t size;
+};
+
+/* an object appended by plist_bin_update() */
+struct bplist_update_obj {
+    node_t *node;
+    const uint64_t *refs;
+    uint64_t num_refs;
+    uint64_t offset;
+    uint64_t size;
+};
+
+/* a value of a change, serialized with indices following the objects of
+ * the original document */
+struct bplist_update_value {
+    struct serialize_s ser;
+    uint64_t *str_units;
+    uint64_t base;
+    plist_t owned;
+};
+
+struct bplist_update {
+    plist_bin_view_t view;
+    uint64_t num_objects;
+    uint64_t root;
+    ptrarray_t *values;
+    struct bplist_update_container *containers;
+    uint64_t num_containers;
+    struct bplist_update_obj *objs;
+    uint64_t objs_capacity;
+    uint8_t *on_path;
+};
+
+/* serialize value and return the index of its root object; owned values
+ * are freed with the update */
+static uint64_t bplist_update_add_value(struct bplist_update *upd, plist_t value, int owned)
 {
-    node_t* cur = NULL;
-    uint64_t i = 0;
+    uint64_t first = upd->view->bplist.num_objects;
+    struct bplist_update_value *val;
+    uint64_t i;
 
-    uint64_t size = node_n_children(node) / 2;
-    uint8_t marker = BPLIST_DICT | (size < 15 ? size : 0xf);
-    byte_array_append(bplist, &marker, sizeof(uint8_t));
-    if (size >= 15) {
-        write_int(bplist, size);
+    if (!value) {
+        return PLIST_BIN_REF_INVALID;
     }
-
-    for (i = 0, cur = node_first_child(node); cur && i < size; cur = node_next_sibling(node_next_sibling(cur)), i++) {
-        uint64_t idx1 = *(uint64_t *) (hash_table_lookup(ref_table, cur));
-        idx1 = be64toh(idx1);
-        byte_array_append(bplist, (uint8_t*)&idx1 + (sizeof(uint64_t) - ref_size), ref_size);
+    val = (struct bplist_update_value*)malloc(sizeof(struct bplist_update_value));
+    if (!val) {
+        if (owned) plist_free(value);
+        return PLIST_BIN_REF_INVALID;
+    }
+    bplist_serialize(value, &val->ser, PLIST_WRITE_DEFAULT);
+    val->str_units = classify_strings(val->ser.objects);
+    val->base = upd->num_objects;
+    val->owned = (owned) ? value : NULL;
+    ptr_array_add(upd->values, val);
+    if (!val->str_units) {
+        return PLIST_BIN_REF_INVALID;
     }
 
-    for (i = 0, cur = node_first_child(node); cur && i < size; cur = node_next_sibling(node_next_sibling(cur)), i++) {
-        uint64_t idx2 = *(uint64_t *) (hash_table_lookup(ref_table, cur->next));
-        idx2 = be64toh(idx2);
-        byte_array_append(bplist, (uint8_t*)&idx2 + (sizeof(uint64_t) - ref_size), ref_size);
+    if (upd->num_objects - first + val->ser.objects->len > upd->objs_capacity) {
+        uint64_t capacity = upd->objs_capacity * 2 + val->ser.objects->len;
+        struct bplist_update_obj *objs = (struct bplist_update_obj*)realloc(upd->objs, capacity * sizeof(struct bplist_update_obj));
+        if (!objs) {
+            return PLIST_BIN_REF_INVALID;
+        }
+        upd->objs = objs;
+        upd->objs_capacity = capacity;
+    }
+    for (i = 0; i < (uint64_t)val->ser.objects->len; i++) {
+        node_t *node = (node_t*)ptr_array_index(val->ser.objects, i);
+        struct bplist_update_obj *obj = &upd->objs[val->base + i - first];
+        uint64_t *refs = val->ser.refs + val->ser.refs_start[i];
+        uint64_t k;
+        obj->node = node;
+        obj->refs = refs;
+        obj->num_refs = (node->first) ? node->count : 0;
+        /* the refs are relative to the value */
+        for (k = 0; k < obj->num_refs; k++) {
+            refs[k] += val->base;
+        }
     }
+    upd->num_objects += val->ser.objects->len;
+    return val->base + val->ser.root_index;
 }
 
-static void write_uid(bytearray_t * bplist, uint64_t val)
+static int bplist_update_reserve(struct bplist_update_container *c, uint64_t num_refs)
 {
-    val = (uint32_t)val;
-    int size = get_needed_bytes(val);
-    uint8_t sz;
-    //do not write 3bytes int node
-    if (size == 3)
-        size++;
-    sz = BPLIST_UID | (size-1); // yes, this is what Apple does...
-
-    val = be64toh(val);
-    byte_array_append(bplist, &sz, 1);
-    byte_array_append(bplist, (uint8_t*)&val + (8-size), size);
+    if (num_refs > c->capacity) {
+        uint64_t capacity = (c->capacity * 2 > num_refs) ? c->capacity * 2 : num_refs;
+        uint64_t *refs = (uint64_t*)realloc(c->refs, capacity * sizeof(uint64_t));
+        if (!refs) {
+            return 0;
+        }
+        c->refs = refs;
+        c->capacity = capacity;
+    }
+    return 1;
 }
 
-static int is_ascii_string(char* s, int len)
+/* read the refs of an original array or dictionary into c */
+static int bplist_update_load(struct bplist_update *upd, struct bplist_update_container *c)
 {
-  int ret = 1, i = 0;
-  for(i = 0; i < len; i++)
-  {
-      if ( !isascii( s[i] ) )
-      {
-          ret = 0;
-          break;
-      }
-  }
-  return ret;
+    struct bplist_data *bplist = &upd->view->bplist;
+    uint16_t type = 0;
+    uint64_t size = 0;
+    uint64_t i;
+    const char *refs = bplist_view_object(upd->view, c->index, &type, &size);
+
+    if (!refs || (type != BPLIST_ARRAY && type != BPLIST_DICT)) {
+        PLIST_BIN_ERR("%s: object %" PRIu64 " is not an array or dictionary\n", __func__, c->index);
+        return 0;
+    }
+    c->is_dict = (type == BPLIST_DICT);
+    c->num_refs = (c->is_dict) ? size * 2 : size;
+    if (!bplist_update_reserve(c, c->num_refs)) {
+        return 0;
+    }
+    for (i = 0; i < c->num_refs; i++) {
+        uint64_t index = 0;
+        if (!bplist_read_ref(bplist, refs, i, &index)) {
+            return 0;
+        }
+        /* keys first, then values */
+        if (c->is_dict) {
+            c->refs[(i < size) ? i * 2 : (i - size) * 2 + 1] = index;
+        } else {
+            c->refs[i] = index;
+        }
+    }
+    return 1;
 }
 
-PLIST_API void plist_to_bin(plist_t plist, char **plist_bin, uint32_t * length)
+/* apply changes, which all refer to container c, in order */
+static int bplist_update_apply(struct bplist_update *upd, struct bplist_update_container *c, const plist_bin_change_t **changes, uint64_t count)
 {
-    ptrarray_t* objects = NULL;
-    hashtable_t* ref_table = NULL;
-    struct serialize_s ser_s;
-    uint8_t offset_size = 0;
-    uint8_t ref_size = 0;
-    uint64_t num_objects = 0;
-    uint64_t root_object = 0;
-    uint64_t offset_table_index = 0;
-    bytearray_t *bplist_buff = NULL;
-    uint64_t i = 0;
-    uint8_t *buff = NULL;
-    uint64_t *offsets = NULL;
-    bplist_trailer_t trailer;
-    uint64_t objects_len = 0;
-    uint64_t buff_len = 0;
-
-    //check for valid input
-    if (!plist || !plist_bin || *plist_bin || !length)
-        return;
+    /* the keys of entries added by the update, which aren't in the view */
+    const char **keys = NULL;
+    uint64_t n;
+    int res = 0;
 
-    //list of objects
-    objects = ptr_array_new(4096);
-    //hashtable to write only once same nodes
-    ref_table = hash_table_new(plist_data_hash, plist_data_compare, free);
-
-    //serialize plist
-    ser_s.objects = objects;
-    ser_s.ref_table = ref_table;
-    serialize_plist(plist, &ser_s);
-
-    //now stream to output buffer
-    offset_size = 0;			//unknown yet
-    objects_len = objects->len;
-    ref_size = get_needed_bytes(objects_len);
-    num_objects = objects->len;
-    root_object = 0;			//root is first in list
-    offset_table_index = 0;		//unknown yet
+    if (!bplist_update_load(upd, c)) {
+        return 0;
+    }
+    if (c->is_dict) {
+        keys = (const char**)calloc(c->num_refs / 2 + count, sizeof(const char*));
+        if (!keys) {
+            return 0;
+        }
+    }
 
-    //figure out the storage size required
-    uint64_t req = 0;
-    for (i = 0; i < num_objects; i++)
-    {
-        node_t* node = ptr_array_index(objects, i);
-        plist_data_t data = plist_get_data(node);
-        uint64_t size;
-        uint8_t bsize;
-        switch (data->type)
-        {
-        case PLIST_BOOLEAN:
-            req += 1;
-            break;
-        case PLIST_KEY:
-        case PLIST_STRING:
-            req += 1;
-            if (data->length >= 15) {
-                bsize = get_needed_bytes(data->length);
-                if (bsize == 3) bsize = 4;
-                req += 1;
-                req += bsize;
+    for (n = 0; n < count; n++) {
+        const plist_bin_change_t *change = changes[n];
+        uint64_t value = PLIST_BIN_REF_INVALID;
+        uint64_t entries = (c->is_dict) ? c->num_refs / 2 : c->num_refs;
+        uint64_t i;
+        if (change->value) {
+            value = bplist_update_add_value(upd, change->value, 0);
+            if (value == PLIST_BIN_REF_INVALID) {
+                goto leave;
             }
-            if ( is_ascii_string(data->strval, data->length) )
-            {
-                req += data->length;
+        }
+        if (c->is_dict) {
+            size_t key_len;
+            if (!change->key) {
+                goto leave;
             }
-            else
-            {
-                req += data->length * 2;
+            key_len = strlen(change->key);
+            for (i = 0; i < entries; i++) {
+                if (keys[i] ? strcmp(keys[i], change->key) == 0 : bplist_view_key_equals(upd->view, c->refs[i * 2], change->key, key_len)) {
+                    break;
+                }
             }
-            break;
-        case PLIST_REAL:
-            size = get_real_bytes(data->realval);
-            req += 1;
-            req += size;
-            break;
-        case PLIST_DATE:
-            req += 9;
-            break;
-        case PLIST_ARRAY:
-            size = node_n_children(node);
-            req += 1;
-            if (size >= 15) {
-                bsize = get_needed_bytes(size);
-                if (bsize == 3) bsize = 4;
-                req += 1;
-                req += bsize;
+            if (!change->value) {
+                if (i < entries) {
+                    memmove(c->refs + i * 2, c->refs + i * 2 + 2, (entries - i - 1) * 2 * sizeof(uint64_t));
+                    memmove(keys + i, keys + i + 1, (entries - i - 1) * sizeof(const char*));
+                    c->num_refs -= 2;
+                }
+            } else if (i < entries) {
+                c->refs[i * 2 + 1] = value;
+            } else {
+                uint64_t key = bplist_update_add_value(upd, plist_new_string(change->key), 1);
+                if (key == PLIST_BIN_REF_INVALID || !bplist_update_reserve(c, c->num_refs + 2)) {
+                    goto leave;
+                }
+                c->refs[c->num_refs++] = key;
+                c->refs[c->num_refs++] = value;
+                keys[entries] = change->key;
             }
-            req += size * ref_size;
-            break;
-        case PLIST_DICT:
-            size = node_n_children(node) / 2;
-            req += 1;
-            if (size >= 15) {
-                bsize = get_needed_bytes(size);
-                if (bsize == 3) bsize = 4;
-                req += 1;
-                req += bsize;
+        } else {
+            i = change->index;
+            if (i > entries || (i == entries && !change->value)) {
+                PLIST_BIN_ERR("%s: index %" PRIu64 " is out of range for array %" PRIu64 "\n", __func__, i, c->index);
+                goto leave;
             }
-            req += size * 2 * ref_size;
-            break;
-        default:
-            size = data->length;
-            req += 1;
-            if (size >= 15) {
-                bsize = get_needed_bytes(size);
-                if (bsize == 3) bsize = 4;
-                req += 1;
-                req += bsize;
+            if (!change->value) {
+                memmove(c->refs + i, c->refs + i + 1, (entries - i - 1) * sizeof(uint64_t));
+                c->num_refs--;
+            } else if (i < entries) {
+                c->refs[i] = value;
+            } else {
+                if (!bplist_update_reserve(c, c->num_refs + 1)) {
+                    goto leave;
+                }
+                c->refs[c->num_refs++] = value;
             }
-            req += data->length;
-            break;
         }
     }
-    // add size of magic
-    req += BPLIST_MAGIC_SIZE;
-    req += BPLIST_VERSION_SIZE;
-    // add size of offset table
-    req += get_needed_bytes(req) * num_objects;
-    // add size of trailer
-    req += sizeof(bplist_trailer_t);
+    res = 1;
 
-    //setup a dynamic bytes array to store bplist in
-    bplist_buff = byte_array_new(req);
+leave:
+    free(keys);
+    return res;
+}
 
-    //set magic number and version
-    byte_array_append(bplist_buff, BPLIST_MAGIC, BPLIST_MAGIC_SIZE);
-    byte_array_append(bplist_buff, BPLIST_VERSION, BPLIST_VERSION_SIZE);
+static int bplist_update_compare_changes(const void *a, const void *b)
+{
+    const plist_bin_change_t *ca = *(const plist_bin_change_t* const*)a;
+    const plist_bin_change_t *cb = *(const plist_bin_change_t* const*)b;
+    if (ca->container != cb->container) {
+        return (ca->container < cb->container) ? -1 : 1;
+    }
+    /* keep the order of changes to the same container */
+    return (ca < cb) ? -1 : (ca > cb);
+}
 
-    //write objects and table
-    offsets = (uint64_t *) malloc(num_objects * sizeof(uint64_t));
-    assert(offsets != NULL);
-    for (i = 0; i < num_objects; i++)
-    {
+static int bplist_update_compare_container(const void *key, const void *elem)
+{
+    uint64_t index = *(const uint64_t*)key;
+    const struct bplist_update_container *c = (const struct bplist_update_container*)elem;
+    return (index < c->index) ? -1 : (index > c->index);
+}
 
-        plist_data_t data = plist_get_data(ptr_array_index(objects, i));
-        offsets[i] = bplist_buff->len;
+static struct bplist_update_container *bplist_update_find(struct bplist_update *upd, uint64_t index)
+{
+    if (upd->num_containers == 0) {
+        return NULL;
+    }
+    return (struct bplist_update_container*)bsearch(&index, upd->containers, upd->num_containers, sizeof(struct bplist_update_container), bplist_update_compare_container);
+}
 
-        switch (data->type)
-        {
-        case PLIST_BOOLEAN:
-            buff = (uint8_t *) malloc(sizeof(uint8_t));
-            buff[0] = data->boolval ? BPLIST_TRUE : BPLIST_FALSE;
-            byte_array_append(bplist_buff, buff, sizeof(uint8_t));
-            free(buff);
-            break;
+/* read the header of an object of the original document; returns its
+ * payload, which holds *count refs for arrays and dictionaries, and sets
+ * *size to the number of bytes the object occupies */
+static const char *bplist_update_original(struct bplist_update *upd, uint64_t index, uint16_t *type, uint64_t *count, uint64_t *size)
+{
+    struct bplist_data *bplist = &upd->view->bplist;
+    const char *start = bplist_object_at(bplist, index);
+    const char *payload = start;
+    uint64_t len = 0;
+
+    *count = 0;
+    if (!start || !bplist_check_object(bplist, &payload, type, &len)) {
+        return NULL;
+    }
+    switch (*type) {
+    case BPLIST_NULL:
+        len = 0;
+        break;
+    case BPLIST_UINT:
+    case BPLIST_REAL:
+    case BPLIST_DATE:
+        len = 1ULL << len;
+        break;
+    case BPLIST_UNICODE:
+        len *= 2;
+        break;
+    case BPLIST_UID:
+        len += 1;
+        break;
+    case BPLIST_SET:
+    case BPLIST_ARRAY:
+        *count = len;
+        len *= bplist->ref_size;
+        break;
+    case BPLIST_DICT:
+        *count = len * 2;
+        len *= 2 * bplist->ref_size;
+        break;
+    default:
+        break;
+    }
+    if (*count > 0 && !bplist_check_refs(bplist, payload, *count)) {
+        return NULL;
+    }
+    *size = (uint64_t)(payload - start) + len;
+    return payload;
+}
 
-        case PLIST_UINT:
-            if (data->length == 16) {
-                write_uint(bplist_buff, data->intval);
+/* number of bytes of the objects reachable from the root of the updated
+ * document, or UINT64_MAX if an object can not be read */
+static uint64_t bplist_update_live_size(struct bplist_update *upd)
+{
+    struct bplist_data *bplist = &upd->view->bplist;
+    uint8_t *seen = (uint8_t*)calloc(1, BPLIST_ON_PATH_SIZE(upd->num_objects));
+    uint64_t *stack = NULL;
+    uint64_t stack_len = 0;
+    uint64_t stack_capacity = 0;
+    uint64_t live = 0;
+
+    if (!seen) {
+        return UINT64_MAX;
+    }
+    stack_capacity = 4096;
+    stack = (uint64_t*)malloc(stack_capacity * sizeof(uint64_t));
+    if (!stack) {
+        free(seen);
+        return UINT64_MAX;
+    }
+    stack[stack_len++] = upd->root;
+    while (stack_len > 0) {
+        uint64_t index = stack[--stack_len];
+        const uint64_t *refs = NULL;
+        const char *orefs = NULL;
+        uint64_t count = 0;
+        uint64_t size = 0;
+        uint64_t k;
+
+        if (seen[index >> 3] & (1 << (index & 7))) {
+            continue;
+        }
+        seen[index >> 3] |= (uint8_t)(1 << (index & 7));
+
+        if (index >= bplist->num_objects) {
+            struct bplist_update_obj *obj = &upd->objs[index - bplist->num_objects];
+            refs = obj->refs;
+            count = obj->num_refs;
+            size = obj->size;
+        } else {
+            struct bplist_update_container *c = bplist_update_find(upd, index);
+            if (c) {
+                refs = c->refs;
+                count = c->num_refs;
+                size = c->size;
             } else {
-                write_int(bplist_buff, data->intval);
+                uint16_t type = 0;
+                orefs = bplist_update_original(upd, index, &type, &count, &size);
+                if (!orefs) {
+                    live = UINT64_MAX;
+                    break;
+                }
             }
-            break;
-
-        case PLIST_REAL:
-            write_real(bplist_buff, data->realval);
-            break;
-
-        case PLIST_KEY:
-        case PLIST_STRING:
-            if ( is_ascii_string(data->strval, data->length) )
-            {
-                write_string(bplist_buff, data->strval, data->length);
+        }
+        live += size;
+
+        if (stack_len + count > stack_capacity) {
+            uint64_t capacity = stack_capacity * 2 + count;
+            uint64_t *grown = (uint64_t*)realloc(stack, capacity * sizeof(uint64_t));
+            if (!grown) {
+                live = UINT64_MAX;
+                break;
             }
-            else
-            {
-                write_unicode(bplist_buff, data->strval, data->length);
+            stack = grown;
+            stack_capacity = capacity;
+        }
+        for (k = 0; k < count; k++) {
+            uint64_t ref = 0;
+            if (refs) {
+                ref = refs[k];
+            } else if (!bplist_read_ref(bplist, orefs, k, &ref)) {
+                live = UINT64_MAX;
+                break;
             }
+            stack[stack_len++] = ref;
+        }
+        if (live == UINT64_MAX) {
             break;
-        case PLIST_DATA:
-            write_data(bplist_buff, data->buff, data->length);
-            break;
-        case PLIST_ARRAY:
-            write_array(bplist_buff, ptr_array_index(objects, i), ref_table, ref_size);
-            break;
-        case PLIST_DICT:
-            write_dict(bplist_buff, ptr_array_index(objects, i), ref_table, ref_size);
-            break;
-        case PLIST_DATE:
-            write_date(bplist_buff, data->realval);
-            break;
-        case PLIST_UID:
-            write_uid(bplist_buff, data->intval);
+        }
+    }
+    free(stack);
+    free(seen);
+    return live;
+}
+
+/* decode the updated document into a tree */
+static plist_t bplist_update_build(struct bplist_update *upd, uint64_t index)
+{
+    struct bplist_data *bplist = &upd->view->bplist;
+    struct bplist_update_container *c = NULL;
+    const char *orefs = NULL;
+    const uint64_t *refs = NULL;
+    uint64_t count = 0;
+    int is_dict = 0;
+    plist_t node = NULL;
+    uint64_t k;
+
+    if (index >= bplist->num_objects) {
+        return plist_copy(upd->objs[index - bplist->num_objects].node);
+    }
+
+    c = bplist_update_find(upd, index);
+    if (c) {
+        refs = c->refs;
+        count = c->num_refs;
+        is_dict = c->is_dict;
+    } else {
+        uint16_t type = 0;
+        uint64_t size = 0;
+        orefs = bplist_update_original(upd, index, &type, &count, &size);
+        if (!orefs) {
+            return NULL;
+        }
+        if (type != BPLIST_ARRAY && type != BPLIST_SET && type != BPLIST_DICT) {
+            node = parse_bin_node_at_index(bplist, index);
+            bplist_release_keys(bplist);
+            return node;
+        }
+        is_dict = (type == BPLIST_DICT);
+    }
+
+    if (BPLIST_ON_PATH(upd, index)) {
+        PLIST_BIN_ERR("recursion detected in binary plist\n");
+        return NULL;
+    }
+    if (!bplist_charge_node(bplist)) {
+        return NULL;
+    }
+    BPLIST_SET_ON_PATH(upd, index);
+
+    node = (is_dict) ? plist_new_dict() : plist_new_array();
+    for (k = 0; k < ((is_dict) ? count / 2 : count); k++) {
+        uint64_t item_index = 0;
+        uint64_t key_index = 0;
+        plist_t item = NULL;
+        if (refs) {
+            key_index = (is_dict) ? refs[k * 2] : 0;
+            item_index = (is_dict) ? refs[k * 2 + 1] : refs[k];
+        } else if ((is_dict && !bplist_read_ref(bplist, orefs, k, &key_index))
+                || !bplist_read_ref(bplist, orefs, (is_dict) ? count / 2 + k : k, &item_index)) {
             break;
-        default:
+        }
+        item = bplist_update_build(upd, item_index);
+        if (!item) {
             break;
         }
+        if (is_dict) {
+            plist_t key = bplist_update_build(upd, key_index);
+            if (!PLIST_IS_STRING(key)) {
+                plist_free(key);
+                plist_free(item);
+                break;
+            }
+            plist_dict_set_item(node, plist_get_string_ptr(key, NULL), item);
+            plist_free(key);
+        } else {
+            plist_array_append_item(node, item);
+        }
     }
+    BPLIST_CLEAR_ON_PATH(upd, index);
 
-    //free intermediate objects
-    ptr_array_free(objects);
-    hash_table_destroy(ref_table);
+    if (k < ((is_dict) ? count / 2 : count)) {
+        plist_free(node);
+        return NULL;
+    }
+    return node;
+}
 
-    //write offsets
-    buff_len = bplist_buff->len;
-    offset_size = get_needed_bytes(buff_len);
-    offset_table_index = bplist_buff->len;
-    for (i = 0; i < num_objects; i++) {
-        uint64_t offset = be64toh(offsets[i]);
-        byte_array_append(bplist_buff, (uint8_t*)&offset + (sizeof(uint64_t) - offset_size), offset_size);
+/* write the offset table and trailer of the updated document */
+static void bplist_update_write_tail(bytearray_t *out, struct bplist_update *upd, uint64_t offset_table_index)
+{
+    struct bplist_data *bplist = &upd->view->bplist;
+    uint8_t offset_size = get_needed_bytes(offset_table_index);
+    bplist_trailer_t trailer;
+    uint64_t c = 0;
+    uint64_t i;
+
+    for (i = 0; i < upd->num_objects; i++) {
+        uint64_t offset;
+        if (i >= bplist->num_objects) {
+            offset = upd->objs[i - bplist->num_objects].offset;
+        } else if (c < upd->num_containers && upd->containers[c].index == i) {
+            offset = upd->containers[c++].offset;
+        } else {
+            offset = UINT_TO_HOST(bplist->offset_table + i * bplist->offset_size, bplist->offset_size);
+        }
+        offset = be64toh(offset);
+        byte_array_append(out, (uint8_t*)&offset + (sizeof(uint64_t) - offset_size), offset_size);
     }
-    free(offsets);
 
-    //setup trailer
     memset(trailer.unused, '\0', sizeof(trailer.unused));
     trailer.offset_size = offset_size;
-    trailer.ref_size = ref_size;
-    trailer.num_objects = be64toh(num_objects);
-    trailer.root_object_index = be64toh(root_object);
+    trailer.ref_size = bplist->ref_size;
+    trailer.num_objects = be64toh(upd->num_objects);
+    trailer.root_object_index = be64toh(upd->root);
     trailer.offset_table_offset = be64toh(offset_table_index);
+    byte_array_append(out, &trailer, sizeof(bplist_trailer_t));
+}
 
-    byte_array_append(bplist_buff, &trailer, sizeof(bplist_trailer_t));
-
-    //set output buffer and size
-    *plist_bin = bplist_buff->data;
-    *length = bplist_buff->len;
-
-    bplist_buff->data = NULL; // make sure we don't free the output buffer
-    byte_array_free(bplist_buff);
+static void bplist_update_free(struct bplist_update *upd)
+{
+    uint64_t i;
+    if (upd->values) {
+        for (i = 0; i < (uint64_t)upd->values->len; i++) {
+            struct bplist_update_value *val = (struct bplist_update_value*)ptr_array_index(upd->values, i);
+            bplist_serialize_free(&val->ser);
+            free(val->str_units);
+            plist_free(val->owned);
+            free(val);
+        }
+        ptr_array_free(upd->values);
+    }
+    for (i = 0; i < upd->num_containers; i++) {
+        free(upd->containers[i].refs);
+    }
+    free(upd->containers);
+    free(upd->objs);
+    free(upd->on_path);
+    plist_bin_view_close(upd->view);
 }
 
-PLIST_API void plist_to_bin_free(char *plist_bin)
+PLIST_API int plist_bin_update(const char *plist_bin, uint64_t length, const plist_bin_change_t *changes, uint64_t num_changes, uint64_t compact_threshold, plist_write_func_t write_func, void *user_data)
 {
-    free(plist_bin);
+    struct bplist_update upd;
+    const plist_bin_change_t **sorted = NULL;
+    bytearray_t *delta = NULL;
+    bytearray_t *out = NULL;
+    uint64_t original_objects;
+    uint64_t i;
+    int compact = 0;
+    int res = -1;
+
+    if (!plist_bin || (!changes && num_changes > 0) || !write_func) {
+        return -1;
+    }
+
+    memset(&upd, 0, sizeof(upd));
+    upd.view = plist_bin_view_open(plist_bin, length);
+    if (!upd.view) {
+        return -1;
+    }
+    original_objects = upd.view->bplist.num_objects;
+    upd.num_objects = original_objects;
+    upd.root = upd.view->root_object;
+    upd.values = ptr_array_new(16);
+    upd.containers = (struct bplist_update_container*)calloc((num_changes > 0) ? num_changes : 1, sizeof(struct bplist_update_container));
+    sorted = (const plist_bin_change_t**)malloc(((num_changes > 0) ? num_changes : 1) * sizeof(plist_bin_change_t*));
+    if (!upd.values || !upd.containers || !sorted) {
+        goto leave;
+    }
+
+    /* group the changes by container */
+    for (i = 0; i < num_changes; i++) {
+        sorted[i] = &changes[i];
+    }
+    qsort(sorted, num_changes, sizeof(plist_bin_change_t*), bplist_update_compare_changes);
+    for (i = 0; i < num_changes; ) {
+        uint64_t end = i + 1;
+        while (end < num_changes && sorted[end]->container == sorted[i]->container) {
+            end++;
+        }
+        if (sorted[i]->container == PLIST_BIN_REF_INVALID) {
+            for (; i < end; i++) {
+                if (!sorted[i]->value) {
+                    goto leave;
+                }
+                upd.root = bplist_update_add_value(&upd, sorted[i]->value, 0);
+                if (upd.root == PLIST_BIN_REF_INVALID) {
+                    goto leave;
+                }
+            }
+            continue;
+        }
+        if (sorted[i]->container >= original_objects) {
+            goto leave;
+        }
+        upd.containers[upd.num_containers].index = sorted[i]->container;
+        if (!bplist_update_apply(&upd, &upd.containers[upd.num_containers++], sorted + i, end - i)) {
+            goto leave;
+        }
+        i = end;
+    }
+
+    /* existing objects keep their refs, new ones must fit in */
+    if (get_needed_bytes(upd.num_objects) > upd.view->bplist.ref_size) {
+        compact = 1;
+    } else {
+        delta = byte_array_new(4096);
+        for (i = 0; i < (uint64_t)upd.values->len; i++) {
+            struct bplist_update_value *val = (struct bplist_update_value*)ptr_array_index(upd.values, i);
+            uint64_t j;
+            for (j = 0; j < (uint64_t)val->ser.objects->len; j++) {
+                struct bplist_update_obj *obj = &upd.objs[val->base + j - original_objects];
+                obj->offset = length + delta->len;
+                write_object(delta, obj->node, obj->refs, val->str_units[j], upd.view->bplist.ref_size);
+                obj->size = length + delta->len - obj->offset;
+            }
+        }
+        for (i = 0; i < upd.num_containers; i++) {
+            struct bplist_update_container *c = &upd.containers[i];
+            c->offset = length + delta->len;
+            if (c->is_dict) {
+                write_dict_refs(delta, c->num_refs / 2, c->refs, upd.view->bplist.ref_size);
+            } else {
+                write_array_refs(delta, c->num_refs, c->refs, upd.view->bplist.ref_size);
+            }
+            c->size = length + delta->len - c->offset;
+        }
+        if (delta->error) {
+            goto leave;
+        }
+
+        /* the new offset table and trailer don't count, the old ones do */
+        if (compact_threshold > 0) {
+            uint64_t live = bplist_update_live_size(&upd);
+            if (live == UINT64_MAX) {
+                goto leave;
+            }
+            live += BPLIST_MAGIC_SIZE + BPLIST_VERSION_SIZE;
+            compact = (live < length + delta->len && length + delta->len - live > compact_threshold);
+        }
+    }
+
+    if (compact) {
+        plist_t plist = NULL;
+        upd.on_path = (uint8_t*)calloc(1, BPLIST_ON_PATH_SIZE(upd.num_objects));
+        if (!upd.on_path) {
+            goto leave;
+        }
+        upd.view->bplist.budget = bplist_node_budget(length);
+        plist = bplist_update_build(&upd, upd.root);
+        if (!plist) {
+            goto leave;
+        }
+        res = (plist_to_bin_stream(plist, write_func, user_data) == 0) ? 1 : -1;
+        plist_free(plist);
+        goto leave;
+    }
+
+    out = byte_array_new_sink(BPLIST_STREAM_BUFSIZE, write_func, user_data);
+    byte_array_append(out, delta->data, delta->len);
+    bplist_update_write_tail(out, &upd, length + delta->len);
+    res = (byte_array_flush(out) == 0) ? 0 : -1;
+
+leave:
+    if (out) {
+        byte_array_free(out);
+    }
+    if (delta) {
+        byte_array_free(delta);
+    }
+    free(sorted);
+    bplist_update_free(&upd);
+    return res;
 }
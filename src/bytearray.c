@@ -29,9 +29,37 @@ bytearray_t *byte_array_new(size_t initial)
 	a->capacity = (initial > PAGE_SIZE) ? (initial+(PAGE_SIZE-1)) & (~(PAGE_SIZE-1)) : PAGE_SIZE;
 	a->data = malloc(a->capacity);
 	a->len = 0;
+	a->sink = NULL;
+	a->sink_data = NULL;
+	a->flushed = 0;
+	a->error = 0;
 	return a;
 }
 
+/* a fixed size buffer that is handed to sink whenever it fills up;
+ * flushed counts the bytes already written out */
+bytearray_t *byte_array_new_sink(size_t bufsize, bytearray_sink_t sink, void *user_data)
+{
+	bytearray_t *a = byte_array_new(bufsize);
+	if (!a) return NULL;
+	a->sink = sink;
+	a->sink_data = user_data;
+	return a;
+}
+
+int byte_array_flush(bytearray_t *ba)
+{
+	if (!ba || !ba->sink) return -1;
+	if (!ba->error && ba->len > 0) {
+		if (ba->sink(ba->data, ba->len, ba->sink_data) != 0) {
+			ba->error = 1;
+		}
+	}
+	ba->flushed += ba->len;
+	ba->len = 0;
+	return (ba->error) ? -1 : 0;
+}
+
 void byte_array_free(bytearray_t *ba)
 {
 	if (!ba) return;
@@ -52,6 +80,18 @@ void byte_array_append(bytearray_t *ba, void *buf, size_t len)
 {
 	if (!ba || !ba->data || (len <= 0)) return;
 	size_t remaining = ba->capacity-ba->len;
+	if (ba->sink && len > remaining) {
+		byte_array_flush(ba);
+		if (len >= ba->capacity) {
+			/* too large to be worth buffering */
+			if (!ba->error && ba->sink(buf, len, ba->sink_data) != 0) {
+				ba->error = 1;
+			}
+			ba->flushed += len;
+			return;
+		}
+		remaining = ba->capacity;
+	}
 	if (len > remaining) {
 		size_t needed = len - remaining;
 		byte_array_grow(ba, needed);
@@ -59,3 +99,21 @@ void byte_array_append(bytearray_t *ba, void *buf, size_t len)
 	memcpy(((char*)ba->data) + ba->len, buf, len);
 	ba->len += len;
 }
+
+/* make room for len bytes at the end and return where they go; the caller
+ * fills them in and adds len to ba->len. Returns NULL if the window of a
+ * sink array is too small, in which case byte_array_append() must be used */
+void *byte_array_reserve(bytearray_t *ba, size_t len)
+{
+	if (!ba || !ba->data) return NULL;
+	size_t remaining = ba->capacity-ba->len;
+	if (len > remaining) {
+		if (ba->sink) {
+			if (len > ba->capacity) return NULL;
+			byte_array_flush(ba);
+		} else {
+			byte_array_grow(ba, len - remaining);
+		}
+	}
+	return ((char*)ba->data) + ba->len;
+}
@@ -21,16 +21,26 @@
 #ifndef BYTEARRAY_H
 #define BYTEARRAY_H
 #include <stdlib.h>
+#include <stdint.h>
+
+typedef int (*bytearray_sink_t)(const void *buf, size_t len, void *user_data);
 
 typedef struct bytearray_t {
 	void *data;
 	size_t len;
 	size_t capacity;
+	bytearray_sink_t sink;
+	void *sink_data;
+	uint64_t flushed;
+	int error;
 } bytearray_t;
 
 bytearray_t *byte_array_new(size_t initial);
+bytearray_t *byte_array_new_sink(size_t bufsize, bytearray_sink_t sink, void *user_data);
+int byte_array_flush(bytearray_t *ba);
 void byte_array_free(bytearray_t *ba);
 void byte_array_grow(bytearray_t *ba, size_t amount);
 void byte_array_append(bytearray_t *ba, void *buf, size_t len);
+void *byte_array_reserve(bytearray_t *ba, size_t len);
 
 #endif
@@ -1,6 +1,6 @@
 /*
  * hashtable.c
- * really simple hash table implementation
+ * simple open addressing hash table implementation
  *
  * Copyright (c) 2011-2016 Nikias Bassen, All Rights Reserved.
  *
@@ -18,14 +18,46 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
+#include <string.h>
 #include "hashtable.h"
 
+/* Robin Hood hashing with linear probing: entries that are further away
+ * from their home slot take precedence over closer ones, which keeps the
+ * probe sequences short even at high load. The hash of every key is
+ * stored in its entry so that growing the table and skipping mismatches
+ * never requires calling hash_func or compare_func again. */
+
+#define HASH_TABLE_MIN_CAPACITY 16
+
+/* the slot is taken from the low bits, so spread the bits of weaker hash
+ * functions (murmur3 finalizer) */
+static unsigned int hash_table_hash(hashtable_t* ht, const void *key)
+{
+	unsigned int h = ht->hash_func(key);
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+static int hash_table_alloc(hashtable_t* ht, size_t capacity)
+{
+	hashentry_t *entries = (hashentry_t*)calloc(capacity, sizeof(hashentry_t));
+	if (!entries) return 0;
+	ht->entries = entries;
+	ht->capacity = capacity;
+	return 1;
+}
+
 hashtable_t* hash_table_new(hash_func_t hash_func, compare_func_t compare_func, free_func_t free_func)
 {
 	hashtable_t* ht = (hashtable_t*)malloc(sizeof(hashtable_t));
-	int i;
-	for (i = 0; i < 4096; i++) {
-		ht->entries[i] = NULL;
+	if (!ht) return NULL;
+	if (!hash_table_alloc(ht, HASH_TABLE_MIN_CAPACITY)) {
+		free(ht);
+		return NULL;
 	}
 	ht->count = 0;
 	ht->hash_func = hash_func;
@@ -38,103 +70,125 @@ void hash_table_destroy(hashtable_t *ht)
 {
 	if (!ht) return;
 
-	int i = 0;
-	for (i = 0; i < 4096; i++) {
-		if (ht->entries[i]) {
-			hashentry_t* e = ht->entries[i];
-			while (e) {
-				if (ht->free_func) {
-					ht->free_func(e->value);
-				}
-				hashentry_t* old = e;
-				e = e->next;
-				free(old);
+	if (ht->free_func) {
+		size_t i;
+		for (i = 0; i < ht->capacity; i++) {
+			if (ht->entries[i].dist) {
+				ht->free_func(ht->entries[i].value);
 			}
 		}
 	}
+	free(ht->entries);
 	free(ht);
 }
 
-void hash_table_insert(hashtable_t* ht, void *key, void *value)
+/* place an entry that is known not to be present yet */
+static void hash_table_place(hashtable_t* ht, hashentry_t entry)
 {
-	if (!ht || !key) return;
-
-	unsigned int hash = ht->hash_func(key);
+	size_t mask = ht->capacity - 1;
+	size_t idx = entry.hash & mask;
+	entry.dist = 1;
+	while (ht->entries[idx].dist) {
+		if (ht->entries[idx].dist < entry.dist) {
+			/* take the slot from the richer entry and move that one on */
+			hashentry_t tmp = ht->entries[idx];
+			ht->entries[idx] = entry;
+			entry = tmp;
+		}
+		idx = (idx + 1) & mask;
+		entry.dist++;
+	}
+	ht->entries[idx] = entry;
+}
 
-	int idx0 = hash & 0xFFF;
+static int hash_table_grow(hashtable_t* ht)
+{
+	hashentry_t *old_entries = ht->entries;
+	size_t old_capacity = ht->capacity;
+	size_t i;
+	if (!hash_table_alloc(ht, old_capacity << 1)) return 0;
+	for (i = 0; i < old_capacity; i++) {
+		if (old_entries[i].dist) {
+			hash_table_place(ht, old_entries[i]);
+		}
+	}
+	free(old_entries);
+	return 1;
+}
 
-	// get the idx0 list
-	hashentry_t* e = ht->entries[idx0];
-	while (e) {
-		if (ht->compare_func(e->key, key)) {
-			// element already present. replace value.
-			e->value = value;
-			return;
+static hashentry_t* hash_table_find(hashtable_t* ht, void *key, unsigned int hash)
+{
+	size_t mask = ht->capacity - 1;
+	size_t idx = hash & mask;
+	unsigned int dist = 1;
+	while (ht->entries[idx].dist >= dist) {
+		if (ht->entries[idx].hash == hash && ht->compare_func(ht->entries[idx].key, key)) {
+			return &ht->entries[idx];
 		}
-		e = e->next;
+		idx = (idx + 1) & mask;
+		dist++;
 	}
+	/* an entry closer to its home slot (or an empty slot) ends the search */
+	return NULL;
+}
+
+int hash_table_insert(hashtable_t* ht, void *key, void *value)
+{
+	if (!ht || !key) return -1;
+
+	unsigned int hash = hash_table_hash(ht, key);
 
-	// if we get here, the element is not yet in the list.
-
-	// make a new entry.
-	hashentry_t* entry = (hashentry_t*)malloc(sizeof(hashentry_t));
-	entry->key = key;
-	entry->value = value;
-	if (!ht->entries[idx0]) {
-		// first entry
-		entry->next = NULL;
-	} else {
-		// add to list
-		entry->next = ht->entries[idx0];
+	hashentry_t* e = hash_table_find(ht, key, hash);
+	if (e) {
+		// element already present. replace value.
+		e->value = value;
+		return 0;
 	}
-	ht->entries[idx0] = entry;
+
+	// keep the load factor below 80%
+	if ((ht->count + 1) * 5 > ht->capacity * 4) {
+		if (!hash_table_grow(ht)) return -1;
+	}
+
+	hashentry_t entry;
+	entry.key = key;
+	entry.value = value;
+	entry.hash = hash;
+	entry.dist = 0;
+	hash_table_place(ht, entry);
 	ht->count++;
+	return 0;
 }
 
 void* hash_table_lookup(hashtable_t* ht, void *key)
 {
 	if (!ht || !key) return NULL;
-	unsigned int hash = ht->hash_func(key);
-
-	int idx0 = hash & 0xFFF;
 
-	hashentry_t* e = ht->entries[idx0];
-	while (e) {
-		if (ht->compare_func(e->key, key)) {
-			return e->value;
-		}
-		e = e->next;
-	}
-	return NULL;
+	hashentry_t* e = hash_table_find(ht, key, hash_table_hash(ht, key));
+	return (e) ? e->value : NULL;
 }
 
 void hash_table_remove(hashtable_t* ht, void *key)
 {
 	if (!ht || !key) return;
 
-	unsigned int hash = ht->hash_func(key);
-
-	int idx0 = hash & 0xFFF;
-
-	// get the idx0 list
-	hashentry_t* e = ht->entries[idx0];
-	hashentry_t* last = e;
-	while (e) {
-		if (ht->compare_func(e->key, key)) {
-			// found element, remove it from the list
-			hashentry_t* old = e;
-			if (e == ht->entries[idx0]) {
-				ht->entries[idx0] = e->next;
-			} else {
-				last->next = e->next;
-			}
-			if (ht->free_func) {
-				ht->free_func(old->value);
-			}
-			free(old);
-			return;
-		}
-		last = e;
-		e = e->next;
+	hashentry_t* e = hash_table_find(ht, key, hash_table_hash(ht, key));
+	if (!e) return;
+
+	if (ht->free_func) {
+		ht->free_func(e->value);
+	}
+
+	// shift the following entries back instead of leaving a tombstone
+	size_t mask = ht->capacity - 1;
+	size_t idx = (size_t)(e - ht->entries);
+	size_t next = (idx + 1) & mask;
+	while (ht->entries[next].dist > 1) {
+		ht->entries[idx] = ht->entries[next];
+		ht->entries[idx].dist--;
+		idx = next;
+		next = (next + 1) & mask;
 	}
+	memset(&ht->entries[idx], '\0', sizeof(hashentry_t));
+	ht->count--;
 }
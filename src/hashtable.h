@@ -1,6 +1,6 @@
 /*
  * hashtable.h
- * header file for really simple hash table implementation
+ * header file for a simple open addressing hash table implementation
  *
  * Copyright (c) 2011-2016 Nikias Bassen, All Rights Reserved.
  *
@@ -25,7 +25,9 @@
 typedef struct hashentry_t {
 	void *key;
 	void *value;
-	void *next;
+	unsigned int hash;
+	/* distance from the home slot plus one, 0 marks an empty slot */
+	unsigned int dist;
 } hashentry_t;
 
 typedef unsigned int(*hash_func_t)(const void* key);
@@ -33,7 +35,8 @@ typedef int (*compare_func_t)(const void *a, const void *b);
 typedef void (*free_func_t)(void *ptr);
 
 typedef struct hashtable_t {
-	hashentry_t *entries[4096];
+	hashentry_t *entries;
+	size_t capacity;
 	size_t count;
 	hash_func_t hash_func;
 	compare_func_t compare_func;
@@ -43,7 +46,7 @@ typedef struct hashtable_t {
 hashtable_t* hash_table_new(hash_func_t hash_func, compare_func_t compare_func, free_func_t free_func);
 void hash_table_destroy(hashtable_t *ht);
 
-void hash_table_insert(hashtable_t* ht, void *key, void *value);
+int hash_table_insert(hashtable_t* ht, void *key, void *value);
 void* hash_table_lookup(hashtable_t* ht, void *key);
 void hash_table_remove(hashtable_t* ht, void *key);
 
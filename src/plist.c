@@ -29,24 +29,42 @@
 #include <math.h>
 #include <assert.h>
 #include <limits.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #ifdef WIN32
+#include <io.h>
 #include <windows.h>
 #else
+#include <unistd.h>
+#include <sys/mman.h>
 #include <pthread.h>
 #endif
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 #include <node.h>
 #include <hashtable.h>
 #include <ptrarray.h>
+#include "atom.h"
+#include "refbuf.h"
+#include "utf.h"
 
 extern void plist_xml_init(void);
 extern void plist_xml_deinit(void);
 extern void plist_bin_init(void);
 extern void plist_bin_deinit(void);
+extern int bplist_write_fd(const void *buf, size_t len, void *user_data);
 
 static void internal_plist_init(void)
 {
+    atom_init();
+    utf_init();
     plist_bin_init();
     plist_xml_init();
 }
@@ -55,6 +73,7 @@ static void internal_plist_deinit(void)
 {
     plist_bin_deinit();
     plist_xml_deinit();
+    atom_deinit();
 }
 
 #ifdef WIN32
@@ -123,47 +142,394 @@ PLIST_API int plist_is_binary(const char *plist_data, uint32_t length)
 
 
 PLIST_API void plist_from_memory(const char *plist_data, uint32_t length, plist_t * plist)
+{
+    plist_from_memory_with_options(plist_data, length, plist, PLIST_PARSE_DEFAULT);
+}
+
+PLIST_API void plist_from_memory64(const char *plist_data, uint64_t length, plist_t * plist)
+{
+    plist_from_memory_with_options(plist_data, length, plist, PLIST_PARSE_DEFAULT);
+}
+
+PLIST_API void plist_from_memory_with_options(const char *plist_data, uint64_t length, plist_t * plist, plist_parse_options_t options)
 {
     if (length < 8) {
         *plist = NULL;
         return;
     }
 
-    if (plist_is_binary(plist_data, length)) {
-        plist_from_bin(plist_data, length, plist);
+    if (memcmp(plist_data, "bplist00", 8) == 0) {
+        plist_from_bin_with_options(plist_data, length, plist, options);
     } else {
-        plist_from_xml(plist_data, length, plist);
+        plist_from_xml_with_options(plist_data, length, plist, options);
     }
 }
 
-plist_t plist_new_node(plist_data_t data)
+/* The contents of a file being imported, either mapped or read into a
+ * buffer when the file can not be mapped. */
+struct plist_file_data_s {
+    char *data;
+    size_t length;
+    int mapped;
+#ifdef WIN32
+    HANDLE mapping;
+#endif
+};
+
+#ifdef WIN32
+static int plist_file_open(const char *filename, struct plist_file_data_s *file)
 {
-    return (plist_t) node_create(NULL, data);
+    LARGE_INTEGER size;
+    HANDLE h = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (!GetFileSizeEx(h, &size) || (uint64_t)size.QuadPart > SIZE_MAX) {
+        CloseHandle(h);
+        errno = EFBIG;
+        return -1;
+    }
+    file->length = (size_t)size.QuadPart;
+    if (file->length == 0) {
+        /* empty files can not be mapped */
+        CloseHandle(h);
+        return 0;
+    }
+    file->mapping = CreateFileMappingA(h, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(h);
+    if (!file->mapping) {
+        errno = EIO;
+        return -1;
+    }
+    file->data = (char*)MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!file->data) {
+        CloseHandle(file->mapping);
+        errno = EIO;
+        return -1;
+    }
+    file->mapped = 1;
+    return 0;
 }
 
-plist_data_t plist_get_data(const plist_t node)
+static void plist_file_close(struct plist_file_data_s *file)
 {
-    if (!node)
-        return NULL;
-    return ((node_t*)node)->data;
+    if (file->mapped) {
+        UnmapViewOfFile(file->data);
+        CloseHandle(file->mapping);
+    }
+}
+#else
+static int plist_file_read_all(int fd, size_t size_hint, struct plist_file_data_s *file)
+{
+    size_t capacity = (size_hint > 0) ? size_hint : 65536;
+    char *data = (char*)malloc(capacity);
+    size_t length = 0;
+    if (!data) {
+        return -1;
+    }
+    while (1) {
+        ssize_t n;
+        if (length == capacity) {
+            char *grown;
+            if (capacity > SIZE_MAX / 2) {
+                free(data);
+                errno = EFBIG;
+                return -1;
+            }
+            grown = (char*)realloc(data, capacity * 2);
+            if (!grown) {
+                free(data);
+                return -1;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+        n = read(fd, data + length, capacity - length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            free(data);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        length += (size_t)n;
+    }
+    file->data = data;
+    file->length = length;
+    return 0;
+}
+
+static int plist_file_open(const char *filename, struct plist_file_data_s *file)
+{
+    struct stat st;
+    size_t size_hint = 0;
+    int res;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data;
+        if ((uint64_t)st.st_size > SIZE_MAX) {
+            close(fd);
+            errno = EFBIG;
+            return -1;
+        }
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            /* both parsers walk the document mostly front to back */
+#ifdef MADV_SEQUENTIAL
+            madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+            madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+#endif
+            close(fd);
+            file->data = (char*)data;
+            file->length = (size_t)st.st_size;
+            file->mapped = 1;
+            return 0;
+        }
+        /* one byte more than expected so growing files are noticed */
+        size_hint = (size_t)st.st_size + 1;
+    }
+    /* pipes, devices and anything else that can not be mapped */
+    res = plist_file_read_all(fd, size_hint, file);
+    close(fd);
+    return res;
+}
+
+static void plist_file_close(struct plist_file_data_s *file)
+{
+    if (file->mapped) {
+        munmap(file->data, file->length);
+    } else {
+        free(file->data);
+    }
+}
+#endif
+
+PLIST_API int plist_read_from_file(const char *filename, plist_t *plist, plist_format_t *format)
+{
+    return plist_read_from_file_with_options(filename, plist, format, PLIST_PARSE_DEFAULT);
+}
+
+PLIST_API int plist_read_from_file_with_options(const char *filename, plist_t *plist, plist_format_t *format, plist_parse_options_t options)
+{
+    struct plist_file_data_s file;
+    plist_format_t fmt;
+
+    if (format) {
+        *format = PLIST_FORMAT_NONE;
+    }
+    if (!plist) {
+        errno = EINVAL;
+        return -1;
+    }
+    *plist = NULL;
+    if (!filename) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&file, 0, sizeof(file));
+    if (plist_file_open(filename, &file) != 0) {
+        return -1;
+    }
+    if (file.length < 8) {
+        plist_file_close(&file);
+        return -2;
+    }
+
+    /* nothing may point into the data once it is released */
+    options &= ~PLIST_PARSE_BORROW;
+    if (memcmp(file.data, "bplist00", 8) == 0) {
+        fmt = PLIST_FORMAT_BINARY;
+        plist_from_bin_with_options(file.data, file.length, plist, options);
+    } else {
+        fmt = PLIST_FORMAT_XML;
+        plist_from_xml_with_options(file.data, file.length, plist, options);
+    }
+    plist_file_close(&file);
+
+    if (!*plist) {
+        return -2;
+    }
+    if (format) {
+        *format = fmt;
+    }
+    return 0;
 }
 
-plist_data_t plist_new_plist_data(void)
+PLIST_API int plist_write_to_file(plist_t plist, const char *filename, plist_format_t format, plist_write_options_t options)
 {
-    plist_data_t data = (plist_data_t) calloc(sizeof(struct plist_data_s), 1);
-    return data;
+    char *xml = NULL;
+    uint64_t length = 0;
+    int fd;
+    int res;
+
+    if (!plist || !filename) {
+        return -1;
+    }
+    if (format == PLIST_FORMAT_XML) {
+        /* the XML writer only produces complete documents */
+        plist_to_xml64(plist, &xml, &length);
+        if (!xml) {
+            return -1;
+        }
+    } else if (format != PLIST_FORMAT_BINARY) {
+        return -1;
+    }
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        free(xml);
+        return -1;
+    }
+    if (xml) {
+        res = bplist_write_fd(xml, (size_t)length, &fd);
+        free(xml);
+    } else {
+        res = plist_to_bin_stream_with_options(plist, bplist_write_fd, &fd, options);
+    }
+    if (close(fd) != 0) {
+        res = -1;
+    }
+    if (res != 0) {
+        unlink(filename);
+    }
+    return res;
+}
+
+/* The root node of an arena document is prefixed with this header, so that
+ * freeing the root (or any node below it) can find its way back to the
+ * arena. */
+struct plist_arena_root_s {
+    arena_t *arena;
+    int complete;
+    int dirty;
+    struct plist_node_s node;
+};
+
+#define PLIST_ARENA_ROOT(x) ((struct plist_arena_root_s*)((char*)(x) - offsetof(struct plist_arena_root_s, node)))
+
+static struct plist_arena_root_s *plist_get_arena_root(node_t *node)
+{
+    while (node) {
+        plist_data_t data = plist_get_data(node);
+        if (!(data->flags & PLIST_FLAG_ARENA)) {
+            break;
+        }
+        if (data->flags & PLIST_FLAG_ARENA_ROOT) {
+            return PLIST_ARENA_ROOT(node);
+        }
+        node = node->parent;
+    }
+    return NULL;
+}
+
+void plist_arena_finish(arena_t *arena, plist_t root)
+{
+    if (!root) {
+        arena_free(arena);
+        return;
+    }
+    assert(plist_get_data(root)->flags & PLIST_FLAG_ARENA_ROOT);
+    assert(PLIST_ARENA_ROOT(root)->arena == arena);
+    PLIST_ARENA_ROOT(root)->complete = 1;
+}
+
+/* remember that heap allocated memory was attached below an arena container */
+static void plist_arena_check_attach(node_t *parent, node_t *item)
+{
+    if (!(plist_get_data(parent)->flags & PLIST_FLAG_ARENA)) {
+        return;
+    }
+    uint32_t flags = plist_get_data(item)->flags;
+    if ((flags & PLIST_FLAG_ARENA) && !(flags & PLIST_FLAG_ARENA_ROOT)) {
+        return;
+    }
+    struct plist_arena_root_s *root = plist_get_arena_root(parent);
+    if (root) {
+        root->dirty = 1;
+    }
+}
+
+void plist_arena_free_ptrarray(void *ptr)
+{
+    ptr_array_free((ptrarray_t*)ptr);
+}
+
+static void plist_arena_free_hashtable(void *ptr)
+{
+    hash_table_destroy((hashtable_t*)ptr);
+}
+
+/* Lookup indexes of arena containers are released together with the arena.
+ * Returns 0 if no index should be created for the given container. */
+static int plist_index_arena(node_t *node, arena_t **arena)
+{
+    *arena = NULL;
+    if (plist_get_data(node)->flags & PLIST_FLAG_ARENA) {
+        struct plist_arena_root_s *root = plist_get_arena_root(node);
+        if (!root) {
+            return 0;
+        }
+        *arena = root->arena;
+    }
+    return 1;
+}
+
+/* Drop the hash table index of a dict when it could not be updated, so
+ * lookups scan the entries instead of using an index that misses some. */
+static void _plist_dict_drop_index(plist_t node, hashtable_t *ht)
+{
+    plist_get_data(node)->hashtable = NULL;
+    if (!(plist_get_data(node)->flags & PLIST_FLAG_ARENA)) {
+        /* arena indexes are released with the arena */
+        hash_table_destroy(ht);
+    }
+}
+
+plist_t plist_new_node(void)
+{
+    return (plist_t) calloc(1, sizeof(struct plist_node_s));
+}
+
+plist_t plist_new_node_in(arena_t *arena, int is_root)
+{
+    struct plist_node_s *node = NULL;
+    if (!arena) {
+        return plist_new_node();
+    }
+    if (is_root) {
+        struct plist_arena_root_s *root = (struct plist_arena_root_s*)arena_calloc(arena, sizeof(struct plist_arena_root_s));
+        if (!root) {
+            return NULL;
+        }
+        root->arena = arena;
+        node = &root->node;
+        node->data.flags = PLIST_FLAG_ARENA_ROOT;
+    } else {
+        node = (struct plist_node_s*)arena_calloc(arena, sizeof(struct plist_node_s));
+        if (!node) {
+            return NULL;
+        }
+    }
+    /* values are allocated from the arena as well */
+    node->data.flags |= PLIST_FLAG_ARENA | PLIST_FLAG_BORROWED;
+    return (plist_t)node;
 }
 
 static unsigned int dict_key_hash(const void *data)
 {
     plist_data_t keydata = (plist_data_t)data;
-    unsigned int hash = 5381;
-    size_t i;
-    char *str = keydata->strval;
-    for (i = 0; i < keydata->length; str++, i++) {
-        hash = ((hash << 5) + hash) + *str;
+    if (keydata->flags & PLIST_FLAG_ATOM) {
+        return atom_hash(keydata->strval);
     }
-    return hash;
+    return atom_hash_str(keydata->strval, keydata->length);
 }
 
 static int dict_key_compare(const void* a, const void* b)
@@ -173,12 +539,55 @@ static int dict_key_compare(const void* a, const void* b)
     if (data_a->strval == NULL || data_b->strval == NULL) {
         return FALSE;
     }
+    if (data_a->strval == data_b->strval) {
+        return TRUE;
+    }
+    if ((data_a->flags & data_b->flags & PLIST_FLAG_ATOM)) {
+        /* two different atoms never have the same content */
+        return FALSE;
+    }
     if (data_a->length != data_b->length) {
         return FALSE;
     }
     return (strcmp(data_a->strval, data_b->strval) == 0) ? TRUE : FALSE;
 }
 
+/* release the string value of a key or string node */
+static void plist_free_strval(plist_data_t data)
+{
+    if (data->flags & PLIST_FLAG_ATOM) {
+        atom_release(data->strval);
+        data->flags &= ~PLIST_FLAG_ATOM;
+    } else if (data->flags & PLIST_FLAG_REFBUF) {
+        refbuf_release(data->strval);
+        data->flags &= ~PLIST_FLAG_REFBUF;
+    } else if (!(data->flags & PLIST_FLAG_BORROWED)) {
+        free(data->strval);
+    }
+}
+
+/* release the buffer of a data node */
+static void plist_free_buff(plist_data_t data)
+{
+    if (data->flags & PLIST_FLAG_REFBUF) {
+        refbuf_release(data->buff);
+        data->flags &= ~PLIST_FLAG_REFBUF;
+    } else if (!(data->flags & PLIST_FLAG_BORROWED)) {
+        free(data->buff);
+    }
+}
+
+/* make node a key node sharing the interned copy of val */
+static void plist_set_key_atom(plist_data_t data, const char *val, size_t length)
+{
+    data->type = PLIST_KEY;
+    data->length = length;
+    data->strval = atom_intern(val, length);
+    if (data->strval) {
+        data->flags = (data->flags & ~PLIST_FLAG_BORROWED) | PLIST_FLAG_ATOM;
+    }
+}
+
 void plist_free_data(plist_data_t data)
 {
     if (data)
@@ -187,130 +596,198 @@ void plist_free_data(plist_data_t data)
         {
         case PLIST_KEY:
         case PLIST_STRING:
-            free(data->strval);
+            plist_free_strval(data);
             break;
         case PLIST_DATA:
-            free(data->buff);
+            plist_free_buff(data);
             break;
         case PLIST_ARRAY:
-            ptr_array_free(data->hashtable);
+            if (!(data->flags & PLIST_FLAG_ARENA))
+                ptr_array_free(data->hashtable);
             break;
         case PLIST_DICT:
-            hash_table_destroy(data->hashtable);
+            if (!(data->flags & PLIST_FLAG_ARENA))
+                hash_table_destroy(data->hashtable);
             break;
         default:
             break;
         }
-        free(data);
     }
 }
 
-static int plist_free_node(node_t* node)
+/* release what a single node owns; arena nodes only give back heap memory
+ * attached to them, and an arena root releases its arena */
+static void plist_release_node(node_t* node)
 {
-    plist_data_t data = NULL;
-    int node_index = node_detach(node->parent, node);
-    data = plist_get_data(node);
+    plist_data_t data = plist_get_data(node);
     plist_free_data(data);
-    node->data = NULL;
+    if (!(data->flags & PLIST_FLAG_ARENA)) {
+        free(node);
+    } else if (data->flags & PLIST_FLAG_ARENA_ROOT) {
+        struct plist_arena_root_s *root = PLIST_ARENA_ROOT(node);
+        if (root->complete) {
+            arena_free(root->arena);
+        }
+    }
+}
 
-    node_t *ch;
-    for (ch = node_first_child(node); ch; ) {
-        node_t *next = node_next_sibling(ch);
-        plist_free_node(ch);
-        ch = next;
+/* release node and everything below it in a single walk; the children are
+ * not detached one by one since their parent goes away anyway */
+static void plist_free_subtree(node_t* top)
+{
+    node_t *node = top;
+    int leaving = 0;
+    while (node) {
+        uint32_t flags = plist_get_data(node)->flags;
+        if (!leaving && (flags & PLIST_FLAG_ARENA_ROOT) && !PLIST_ARENA_ROOT(node)->dirty) {
+            /* unless heap memory got attached somewhere in the document
+             * there is nothing to walk; the arena owns all nodes and values */
+            leaving = 1;
+        }
+        if (leaving || !node->first) {
+            node_t *next = node_walk_next(top, node, &leaving);
+            plist_release_node(node);
+            node = next;
+        } else {
+            node = node_walk_next(top, node, &leaving);
+        }
     }
+}
 
-    node_destroy(node);
+/* release a node that was taken out of its parent already; root is the
+ * arena document the node was part of, if any */
+static void plist_free_detached(node_t* node, struct plist_arena_root_s *root)
+{
+    uint32_t flags = plist_get_data(node)->flags;
+    if ((flags & PLIST_FLAG_ARENA) && !(flags & PLIST_FLAG_ARENA_ROOT) && root && !root->dirty) {
+        return;
+    }
+    plist_free_subtree(node);
+}
 
+/* take node out of its parent, keeping the parent's lookup vector in sync */
+static int plist_detach_node(node_t* node)
+{
+    node_t *parent = node->parent;
+    if (!parent) {
+        return -1;
+    }
+    plist_data_t pdata = plist_get_data(parent);
+    if (pdata->type == PLIST_ARRAY && pdata->hashtable) {
+        ptr_array_remove((ptrarray_t*)pdata->hashtable, node->index);
+    }
+    return node_detach(parent, node);
+}
+
+static int plist_free_node(node_t* node)
+{
+    struct plist_arena_root_s *root = plist_get_arena_root(node);
+    int node_index = plist_detach_node(node);
+    plist_free_detached(node, root);
     return node_index;
 }
 
 PLIST_API plist_t plist_new_dict(void)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = plist_new_node();
+    plist_data_t data = plist_get_data(node);
     data->type = PLIST_DICT;
-    return plist_new_node(data);
+    return node;
 }
 
 PLIST_API plist_t plist_new_array(void)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = plist_new_node();
+    plist_data_t data = plist_get_data(node);
     data->type = PLIST_ARRAY;
-    return plist_new_node(data);
+    return node;
 }
 
 //These nodes should not be handled by users
-static plist_t plist_new_key(const char *val)
+static plist_t plist_new_key_in(arena_t *arena, const char *val)
 {
-    plist_data_t data = plist_new_plist_data();
-    data->type = PLIST_KEY;
-    data->strval = strdup(val);
-    data->length = strlen(val);
-    return plist_new_node(data);
+    plist_t node = plist_new_node_in(arena, 0);
+    plist_data_t data = plist_get_data(node);
+    if (arena) {
+        data->type = PLIST_KEY;
+        data->length = strlen(val);
+        data->strval = arena_strndup(arena, val, data->length);
+    } else {
+        plist_set_key_atom(data, val, strlen(val));
+    }
+    return node;
 }
 
 PLIST_API plist_t plist_new_string(const char *val)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = plist_new_node();
+    plist_data_t data = plist_get_data(node);
     data->type = PLIST_STRING;
-    data->strval = strdup(val);
     data->length = strlen(val);
-    return plist_new_node(data);
+    data->strval = refbuf_strndup(val, data->length);
+    data->flags |= PLIST_FLAG_REFBUF;
+    return node;
 }
 
 PLIST_API plist_t plist_new_bool(uint8_t val)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = plist_new_node();
+    plist_data_t data = plist_get_data(node);
     data->type = PLIST_BOOLEAN;
     data->boolval = val;
     data->length = sizeof(uint8_t);
-    return plist_new_node(data);
+    return node;
 }
 
 PLIST_API plist_t plist_new_uint(uint64_t val)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = plist_new_node();
+    plist_data_t data = plist_get_data(node);
     data->type = PLIST_UINT;
     data->intval = val;
     data->length = sizeof(uint64_t);
-    return plist_new_node(data);
+    return node;
 }
 
 PLIST_API plist_t plist_new_uid(uint64_t val)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = plist_new_node();
+    plist_data_t data = plist_get_data(node);
     data->type = PLIST_UID;
     data->intval = val;
     data->length = sizeof(uint64_t);
-    return plist_new_node(data);
+    return node;
 }
 
 PLIST_API plist_t plist_new_real(double val)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = plist_new_node();
+    plist_data_t data = plist_get_data(node);
     data->type = PLIST_REAL;
     data->realval = val;
     data->length = sizeof(double);
-    return plist_new_node(data);
+    return node;
 }
 
 PLIST_API plist_t plist_new_data(const char *val, uint64_t length)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = plist_new_node();
+    plist_data_t data = plist_get_data(node);
     data->type = PLIST_DATA;
-    data->buff = (uint8_t *) malloc(length);
-    memcpy(data->buff, val, length);
+    data->buff = (uint8_t *) refbuf_dup(val, length);
+    data->flags |= PLIST_FLAG_REFBUF;
     data->length = length;
-    return plist_new_node(data);
+    return node;
 }
 
 PLIST_API plist_t plist_new_date(int32_t sec, int32_t usec)
 {
-    plist_data_t data = plist_new_plist_data();
+    plist_t node = plist_new_node();
+    plist_data_t data = plist_get_data(node);
     data->type = PLIST_DATE;
     data->realval = (double)sec + (double)usec / 1000000;
     data->length = sizeof(double);
-    return plist_new_node(data);
+    return node;
 }
 
 PLIST_API void plist_free(plist_t plist)
@@ -321,31 +798,50 @@ PLIST_API void plist_free(plist_t plist)
     }
 }
 
-static plist_t plist_copy_node(node_t *node)
+static plist_t plist_copy_node_data(node_t *node)
 {
     plist_type node_type = PLIST_NONE;
     plist_t newnode = NULL;
     plist_data_t data = plist_get_data(node);
-    plist_data_t newdata = plist_new_plist_data();
+    plist_data_t newdata = NULL;
 
-    assert(data);				// plist should always have data
-    assert(newdata);
+    newnode = plist_new_node();
+    assert(newnode);
+    newdata = plist_get_data(newnode);
 
     memcpy(newdata, data, sizeof(struct plist_data_s));
+    newdata->flags = 0;
 
     node_type = plist_get_node_type(node);
     switch (node_type) {
         case PLIST_DATA:
-            newdata->buff = (uint8_t *) malloc(data->length);
-            memcpy(newdata->buff, data->buff, data->length);
+            if (data->flags & PLIST_FLAG_REFBUF) {
+                refbuf_retain(data->buff);
+            } else {
+                newdata->buff = (uint8_t *) refbuf_dup(data->buff, data->length);
+            }
+            newdata->flags = PLIST_FLAG_REFBUF;
             break;
         case PLIST_KEY:
+            if (data->flags & PLIST_FLAG_ATOM) {
+                atom_retain(data->strval);
+                newdata->flags = PLIST_FLAG_ATOM;
+            } else {
+                plist_set_key_atom(newdata, data->strval, data->length);
+            }
+            break;
         case PLIST_STRING:
-            newdata->strval = strdup((char *) data->strval);
+            if (data->flags & PLIST_FLAG_REFBUF) {
+                refbuf_retain(data->strval);
+            } else {
+                newdata->strval = refbuf_strndup(data->strval, data->length);
+            }
+            newdata->flags = PLIST_FLAG_REFBUF;
             break;
         case PLIST_ARRAY:
-            if (data->hashtable) {
-                ptrarray_t* pa = ptr_array_new(((ptrarray_t*)data->hashtable)->capacity);
+            newdata->hashtable = NULL;
+            if (node->count > 0) {
+                ptrarray_t* pa = ptr_array_new(node->count);
                 assert(pa);
                 newdata->hashtable = pa;
             }
@@ -360,33 +856,42 @@ static plist_t plist_copy_node(node_t *node)
         default:
             break;
     }
-    newnode = plist_new_node(newdata);
-
-    node_t *ch;
-    unsigned int node_index = 0;
-    for (ch = node_first_child(node); ch; ch = node_next_sibling(ch)) {
-        /* copy child node */
-        plist_t newch = plist_copy_node(ch);
-        /* attach to new parent node */
-        node_attach(newnode, newch);
-        /* if needed, add child node to lookup table of parent node */
-        switch (node_type) {
-            case PLIST_ARRAY:
-                if (newdata->hashtable) {
-                    ptr_array_add((ptrarray_t*)newdata->hashtable, newch);
-                }
-                break;
-            case PLIST_DICT:
-                if (newdata->hashtable && (node_index % 2 != 0)) {
-                    hash_table_insert((hashtable_t*)newdata->hashtable, (node_prev_sibling((node_t*)newch))->data, newch);
+    return newnode;
+}
+
+static plist_t plist_copy_node(node_t *top)
+{
+    plist_t copy = NULL;
+    node_t *newparent = NULL;
+    node_t *node = top;
+    int leaving = 0;
+    while (node) {
+        if (leaving) {
+            newparent = newparent->parent;
+        } else {
+            node_t *newnode = (node_t*)plist_copy_node_data(node);
+            if (newparent) {
+                plist_data_t pdata = plist_get_data(newparent);
+                /* attach to new parent node */
+                node_attach(newparent, newnode);
+                /* if needed, add node to lookup table of parent node */
+                if (pdata->type == PLIST_ARRAY && pdata->hashtable) {
+                    ptr_array_add((ptrarray_t*)pdata->hashtable, newnode);
+                } else if (pdata->type == PLIST_DICT && pdata->hashtable && (newnode->index % 2 != 0)) {
+                    if (hash_table_insert((hashtable_t*)pdata->hashtable, plist_get_data(node_prev_sibling(newnode)), newnode) < 0) {
+                        _plist_dict_drop_index(newparent, (hashtable_t*)pdata->hashtable);
+                    }
                 }
-                break;
-            default:
-                break;
+            } else {
+                copy = newnode;
+            }
+            if (node->first) {
+                newparent = newnode;
+            }
         }
-        node_index++;
+        node = node_walk_next(top, node, &leaving);
     }
-    return newnode;
+    return copy;
 }
 
 PLIST_API plist_t plist_copy(plist_t node)
@@ -409,7 +914,7 @@ PLIST_API plist_t plist_array_get_item(plist_t node, uint32_t n)
     plist_t ret = NULL;
     if (node && PLIST_ARRAY == plist_get_node_type(node) && n < INT_MAX)
     {
-        ptrarray_t *pa = ((plist_data_t)((node_t*)node)->data)->hashtable;
+        ptrarray_t *pa = plist_get_data(node)->hashtable;
         if (pa) {
             ret = (plist_t)ptr_array_index(pa, n);
         } else {
@@ -429,24 +934,48 @@ PLIST_API uint32_t plist_array_get_item_index(plist_t node)
     return UINT_MAX;
 }
 
+/* Drop the lookup array of node when it could not be updated, so lookups
+ * walk the child list instead of using an index that does not match it. */
+static void _plist_array_drop_index(plist_t node, ptrarray_t *pa)
+{
+    plist_get_data(node)->hashtable = NULL;
+    if (!(plist_get_data(node)->flags & PLIST_FLAG_ARENA)) {
+        /* arena lookup arrays are released with the arena */
+        ptr_array_free(pa);
+    }
+}
+
 static void _plist_array_post_insert(plist_t node, plist_t item, long n)
 {
-    ptrarray_t *pa = ((plist_data_t)((node_t*)node)->data)->hashtable;
+    ptrarray_t *pa = plist_get_data(node)->hashtable;
     if (pa) {
         /* store pointer to item in array */
-        ptr_array_insert(pa, item, n);
+        if (ptr_array_insert(pa, item, n) < 0) {
+            _plist_array_drop_index(node, pa);
+        }
     } else {
-        if (((node_t*)node)->count > 100) {
+        arena_t *arena = NULL;
+        if (plist_index_arena(node, &arena)) {
             /* make new lookup array */
-            pa = ptr_array_new(128);
+            pa = ptr_array_new(((node_t*)node)->count);
+            if (!pa) {
+                return;
+            }
+            if (arena && arena_add_cleanup(arena, plist_arena_free_ptrarray, pa) < 0) {
+                ptr_array_free(pa);
+                return;
+            }
+            plist_get_data(node)->hashtable = pa;
             plist_t current = NULL;
             for (current = (plist_t)node_first_child(node);
-                 pa && current;
+                 current;
                  current = (plist_t)node_next_sibling(current))
             {
-                ptr_array_add(pa, current);
+                if (ptr_array_add(pa, current) < 0) {
+                    _plist_array_drop_index(node, pa);
+                    break;
+                }
             }
-            ((plist_data_t)((node_t*)node)->data)->hashtable = pa;
         }
     }
 }
@@ -458,17 +987,18 @@ PLIST_API void plist_array_set_item(plist_t node, plist_t item, uint32_t n)
         plist_t old_item = plist_array_get_item(node, n);
         if (old_item)
         {
-            int idx = plist_free_node(old_item);
+            struct plist_arena_root_s *root = plist_get_arena_root(old_item);
+            int idx = node_replace(node, old_item, item);
             assert(idx >= 0);
             if (idx < 0) {
                 return;
-            } else {
-                node_insert(node, idx, item);
-                ptrarray_t* pa = ((plist_data_t)((node_t*)node)->data)->hashtable;
-                if (pa) {
-                    ptr_array_set(pa, item, idx);
-                }
             }
+            ptrarray_t* pa = plist_get_data(node)->hashtable;
+            if (pa) {
+                ptr_array_set(pa, item, idx);
+            }
+            plist_arena_check_attach(node, item);
+            plist_free_detached(old_item, root);
         }
     }
     return;
@@ -479,6 +1009,7 @@ PLIST_API void plist_array_append_item(plist_t node, plist_t item)
     if (node && PLIST_ARRAY == plist_get_node_type(node))
     {
         node_attach(node, item);
+        plist_arena_check_attach(node, item);
         _plist_array_post_insert(node, item, -1);
     }
     return;
@@ -489,6 +1020,7 @@ PLIST_API void plist_array_insert_item(plist_t node, plist_t item, uint32_t n)
     if (node && PLIST_ARRAY == plist_get_node_type(node) && n < INT_MAX)
     {
         node_insert(node, n, item);
+        plist_arena_check_attach(node, item);
         _plist_array_post_insert(node, item, (long)n);
     }
     return;
@@ -501,10 +1033,7 @@ PLIST_API void plist_array_remove_item(plist_t node, uint32_t n)
         plist_t old_item = plist_array_get_item(node, n);
         if (old_item)
         {
-            ptrarray_t* pa = ((plist_data_t)((node_t*)node)->data)->hashtable;
-            if (pa) {
-                ptr_array_remove(pa, n);
-            }
+            /* plist_free() takes care of the lookup array */
             plist_free(old_item);
         }
     }
@@ -516,12 +1045,6 @@ PLIST_API void plist_array_item_remove(plist_t node)
     plist_t father = plist_get_parent(node);
     if (PLIST_ARRAY == plist_get_node_type(father))
     {
-        int n = node_child_position(father, node);
-        if (n < 0) return;
-        ptrarray_t* pa = ((plist_data_t)((node_t*)father)->data)->hashtable;
-        if (pa) {
-            ptr_array_remove(pa, n);
-        }
         plist_free(node);
     }
 }
@@ -625,6 +1148,44 @@ PLIST_API plist_t plist_dict_item_get_key(plist_t node)
     return ret;
 }
 
+/* dicts with more entries than this get a hash table index */
+#define PLIST_DICT_INDEX_THRESHOLD 16
+
+static hashtable_t* plist_dict_build_index(plist_t node, arena_t *arena)
+{
+    if (!arena && !plist_index_arena(node, &arena)) {
+        return NULL;
+    }
+    hashtable_t *ht = hash_table_new(dict_key_hash, dict_key_compare, NULL);
+    if (!ht) {
+        return NULL;
+    }
+    /* calculate the hashes for all entries we have so far */
+    plist_t current = NULL;
+    for (current = (plist_t)node_first_child(node);
+         current;
+         current = (plist_t)node_next_sibling(node_next_sibling(current)))
+    {
+        if (hash_table_insert(ht, plist_get_data(current), node_next_sibling(current)) < 0) {
+            hash_table_destroy(ht);
+            return NULL;
+        }
+    }
+    if (arena && arena_add_cleanup(arena, plist_arena_free_hashtable, ht) < 0) {
+        hash_table_destroy(ht);
+        return NULL;
+    }
+    plist_get_data(node)->hashtable = ht;
+    return ht;
+}
+
+void plist_dict_index_in(arena_t *arena, plist_t node)
+{
+    if (!plist_get_data(node)->hashtable && ((node_t*)node)->count > PLIST_DICT_INDEX_THRESHOLD*2) {
+        plist_dict_build_index(node, arena);
+    }
+}
+
 PLIST_API plist_t plist_dict_get_item(plist_t node, const char* key)
 {
     plist_t ret = NULL;
@@ -637,6 +1198,7 @@ PLIST_API plist_t plist_dict_get_item(plist_t node, const char* key)
             struct plist_data_s sdata;
             sdata.strval = (char*)key;
             sdata.length = strlen(key);
+            sdata.flags = 0;
             ret = (plist_t)hash_table_lookup(ht, &sdata);
         } else {
             plist_t current = NULL;
@@ -658,49 +1220,51 @@ PLIST_API plist_t plist_dict_get_item(plist_t node, const char* key)
     return ret;
 }
 
-PLIST_API void plist_dict_set_item(plist_t node, const char* key, plist_t item)
+static void _plist_dict_set_item(arena_t *arena, plist_t node, const char* key, plist_t item)
 {
     if (node && PLIST_DICT == plist_get_node_type(node)) {
         node_t* old_item = plist_dict_get_item(node, key);
         plist_t key_node = NULL;
         if (old_item) {
-            int idx = plist_free_node(old_item);
+            struct plist_arena_root_s *root = plist_get_arena_root(old_item);
+            int idx = node_replace(node, old_item, item);
             assert(idx >= 0);
             if (idx < 0) {
                 return;
-            } else {
-                node_insert(node, idx, item);
             }
+            plist_free_detached(old_item, root);
             key_node = node_prev_sibling(item);
         } else {
-            key_node = plist_new_key(key);
+            key_node = plist_new_key_in(arena, key);
             node_attach(node, key_node);
             node_attach(node, item);
+            plist_arena_check_attach(node, key_node);
         }
+        plist_arena_check_attach(node, item);
 
-        hashtable_t *ht = ((plist_data_t)((node_t*)node)->data)->hashtable;
+        hashtable_t *ht = plist_get_data(node)->hashtable;
         if (ht) {
             /* store pointer to item in hash table */
-            hash_table_insert(ht, (plist_data_t)((node_t*)key_node)->data, item);
-        } else {
-            if (((node_t*)node)->count > 500) {
-                /* make new hash table */
-                ht = hash_table_new(dict_key_hash, dict_key_compare, NULL);
-                /* calculate the hashes for all entries we have so far */
-                plist_t current = NULL;
-                for (current = (plist_t)node_first_child(node);
-                     ht && current;
-                     current = (plist_t)node_next_sibling(node_next_sibling(current)))
-                {
-                    hash_table_insert(ht, ((node_t*)current)->data, node_next_sibling(current));
-                }
-                ((plist_data_t)((node_t*)node)->data)->hashtable = ht;
+            if (hash_table_insert(ht, plist_get_data(key_node), item) < 0) {
+                _plist_dict_drop_index(node, ht);
             }
+        } else {
+            plist_dict_index_in(arena, node);
         }
     }
     return;
 }
 
+PLIST_API void plist_dict_set_item(plist_t node, const char* key, plist_t item)
+{
+    _plist_dict_set_item(NULL, node, key, item);
+}
+
+void plist_dict_set_item_in(arena_t *arena, plist_t node, const char* key, plist_t item)
+{
+    _plist_dict_set_item(arena, node, key, item);
+}
+
 PLIST_API void plist_dict_insert_item(plist_t node, const char* key, plist_t item)
 {
     plist_dict_set_item(node, key, item);
@@ -714,9 +1278,9 @@ PLIST_API void plist_dict_remove_item(plist_t node, const char* key)
         if (old_item)
         {
             plist_t key_node = node_prev_sibling(old_item);
-            hashtable_t* ht = ((plist_data_t)((node_t*)node)->data)->hashtable;
+            hashtable_t* ht = plist_get_data(node)->hashtable;
             if (ht) {
-                hash_table_remove(ht, ((node_t*)key_node)->data);
+                hash_table_remove(ht, plist_get_data(key_node));
             }
             plist_free(key_node);
             plist_free(old_item);
@@ -976,9 +1540,6 @@ int plist_data_compare(const void *a, const void *b)
     if (!a || !b)
         return FALSE;
 
-    if (!((node_t*) a)->data || !((node_t*) b)->data)
-        return FALSE;
-
     val_a = plist_get_data((plist_t) a);
     val_b = plist_get_data((plist_t) b);
 
@@ -1042,11 +1603,11 @@ static void plist_set_element_val(plist_t node, plist_type type, const void *val
     {
     case PLIST_KEY:
     case PLIST_STRING:
-        free(data->strval);
+        plist_free_strval(data);
         data->strval = NULL;
         break;
     case PLIST_DATA:
-        free(data->buff);
+        plist_free_buff(data);
         data->buff = NULL;
         break;
     default:
@@ -1057,6 +1618,13 @@ static void plist_set_element_val(plist_t node, plist_type type, const void *val
 
     data->type = type;
     data->length = length;
+    data->flags &= ~PLIST_FLAG_BORROWED;
+    if (data->flags & PLIST_FLAG_ARENA) {
+        struct plist_arena_root_s *root = plist_get_arena_root(node);
+        if (root) {
+            root->dirty = 1;
+        }
+    }
 
     switch (type)
     {
@@ -1072,12 +1640,15 @@ static void plist_set_element_val(plist_t node, plist_type type, const void *val
         data->realval = *((double *) value);
         break;
     case PLIST_KEY:
+        plist_set_key_atom(data, (const char*)value, length);
+        break;
     case PLIST_STRING:
-        data->strval = strdup((char *) value);
+        data->strval = refbuf_strndup((const char *) value, length);
+        data->flags |= PLIST_FLAG_REFBUF;
         break;
     case PLIST_DATA:
-        data->buff = (uint8_t *) malloc(length);
-        memcpy(data->buff, value, length);
+        data->buff = (uint8_t *) refbuf_dup(value, length);
+        data->flags |= PLIST_FLAG_REFBUF;
         break;
     case PLIST_ARRAY:
     case PLIST_DICT:
@@ -1093,7 +1664,15 @@ PLIST_API void plist_set_key_val(plist_t node, const char *val)
     if (item) {
         return;
     }
+    /* the dict index is keyed on the key's content */
+    hashtable_t *ht = (PLIST_DICT == plist_get_node_type(father)) ? (hashtable_t*)plist_get_data(father)->hashtable : NULL;
+    if (ht) {
+        hash_table_remove(ht, plist_get_data(node));
+    }
     plist_set_element_val(node, PLIST_KEY, val, strlen(val));
+    if (ht && hash_table_insert(ht, plist_get_data(node), node_next_sibling(node)) < 0) {
+        _plist_dict_drop_index(father, ht);
+    }
 }
 
 PLIST_API void plist_set_string_val(plist_t node, const char *val)
@@ -27,6 +27,8 @@
 #endif
 
 #include "plist/plist.h"
+#include "arena.h"
+#include <node.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -60,15 +62,45 @@ struct plist_data_s
     };
     uint64_t length;
     plist_type type;
+    uint32_t flags;
 };
 
+/* node and its data live in a document arena and are not freed individually */
+#define PLIST_FLAG_ARENA      (1 << 0)
+/* node is the root of a document arena; freeing it releases the arena */
+#define PLIST_FLAG_ARENA_ROOT (1 << 1)
+/* strval/buff is not owned by the node (arena or caller memory) and must not be freed */
+#define PLIST_FLAG_BORROWED   (1 << 2)
+/* strval of a key node is an interned atom holding a reference (see atom.h) */
+#define PLIST_FLAG_ATOM       (1 << 3)
+/* strval/buff of a string or data node is a shared refbuf holding a reference (see refbuf.h) */
+#define PLIST_FLAG_REFBUF     (1 << 4)
+
 typedef struct plist_data_s *plist_data_t;
 
-plist_t plist_new_node(plist_data_t data);
-plist_data_t plist_get_data(const plist_t node);
-plist_data_t plist_new_plist_data(void);
+/* a plist node is a tree node and its data in a single allocation */
+struct plist_node_s
+{
+    node_t node;
+    struct plist_data_s data;
+};
+
+static inline plist_data_t plist_get_data(const plist_t node)
+{
+    if (!node)
+        return NULL;
+    return &((struct plist_node_s*)node)->data;
+}
+
+plist_t plist_new_node(void);
 void plist_free_data(plist_data_t data);
 int plist_data_compare(const void *a, const void *b);
 
+plist_t plist_new_node_in(arena_t *arena, int is_root);
+void plist_arena_finish(arena_t *arena, plist_t root);
+void plist_arena_free_ptrarray(void *ptr);
+void plist_dict_set_item_in(arena_t *arena, plist_t node, const char* key, plist_t item);
+void plist_dict_index_in(arena_t *arena, plist_t node);
+
 
 #endif
@@ -21,12 +21,17 @@
 #include "ptrarray.h"
 #include <string.h>
 
-ptrarray_t *ptr_array_new(int capacity)
+ptrarray_t *ptr_array_new(long capacity)
 {
 	ptrarray_t *pa = (ptrarray_t*)malloc(sizeof(ptrarray_t));
+	if (!pa) return NULL;
+	if (capacity < 1) capacity = 1;
 	pa->pdata = (void**)malloc(sizeof(void*) * capacity);
+	if (!pa->pdata) {
+		free(pa);
+		return NULL;
+	}
 	pa->capacity = capacity;
-	pa->capacity_step = (capacity > 4096) ? 4096 : capacity;
 	pa->len = 0;
 	return pa;
 }
@@ -40,13 +45,16 @@ void ptr_array_free(ptrarray_t *pa)
 	free(pa);
 }
 
-void ptr_array_insert(ptrarray_t *pa, void *data, long array_index)
+int ptr_array_insert(ptrarray_t *pa, void *data, long array_index)
 {
-	if (!pa || !pa->pdata) return;
-	long remaining = pa->capacity-pa->len;
-	if (remaining == 0) {
-		pa->pdata = realloc(pa->pdata, sizeof(void*) * (pa->capacity + pa->capacity_step));
-		pa->capacity += pa->capacity_step;
+	if (!pa || !pa->pdata) return -1;
+	if (pa->len == pa->capacity) {
+		/* grow geometrically to keep appends amortized O(1) */
+		long new_capacity = pa->capacity << 1;
+		void **pdata = realloc(pa->pdata, sizeof(void*) * new_capacity);
+		if (!pdata) return -1;
+		pa->pdata = pdata;
+		pa->capacity = new_capacity;
 	}
 	if (array_index < 0 || array_index >= pa->len) {
 		pa->pdata[pa->len] = data;
@@ -55,11 +63,12 @@ void ptr_array_insert(ptrarray_t *pa, void *data, long array_index)
 		pa->pdata[array_index] = data;
 	}
 	pa->len++;
+	return 0;
 }
 
-void ptr_array_add(ptrarray_t *pa, void *data)
+int ptr_array_add(ptrarray_t *pa, void *data)
 {
-	ptr_array_insert(pa, data, -1);
+	return ptr_array_insert(pa, data, -1);
 }
 
 void ptr_array_remove(ptrarray_t *pa, long array_index)
@@ -0,0 +1,72 @@
+/*
+ * refbuf.c
+ * shared, reference counted value buffers
+ *
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <string.h>
+#include <stddef.h>
+#include "refbuf.h"
+#include "refcount.h"
+
+typedef struct refbuf_t {
+	refcount_t refcount;
+	unsigned char data[];
+} refbuf_t;
+
+#define REFBUF_FROM_PTR(p) ((refbuf_t*)((char*)(p) - offsetof(refbuf_t, data)))
+
+void *refbuf_alloc(size_t size)
+{
+	refbuf_t *buf = (refbuf_t*)malloc(sizeof(refbuf_t) + size);
+	if (!buf) return NULL;
+	buf->refcount = 1;
+	return buf->data;
+}
+
+void *refbuf_dup(const void *data, size_t size)
+{
+	void *ptr = refbuf_alloc(size);
+	if (ptr && size > 0) {
+		memcpy(ptr, data, size);
+	}
+	return ptr;
+}
+
+char *refbuf_strndup(const char *str, size_t len)
+{
+	char *ptr = (char*)refbuf_alloc(len + 1);
+	if (!ptr) return NULL;
+	memcpy(ptr, str, len);
+	ptr[len] = '\0';
+	return ptr;
+}
+
+void refbuf_retain(const void *ptr)
+{
+	if (!ptr) return;
+	refcount_add(&REFBUF_FROM_PTR(ptr)->refcount, 1);
+}
+
+void refbuf_release(void *ptr)
+{
+	if (!ptr) return;
+	refbuf_t *buf = REFBUF_FROM_PTR(ptr);
+	if (refcount_add(&buf->refcount, -1) == 0) {
+		free(buf);
+	}
+}
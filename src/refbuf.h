@@ -0,0 +1,36 @@
+/*
+ * refbuf.h
+ * header file for shared, reference counted value buffers
+ *
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef REFBUF_H
+#define REFBUF_H
+#include <stdlib.h>
+
+/* A refbuf is a heap buffer with a reference count in front of it, handed
+ * out as a plain pointer to its payload. Buffers are never modified once
+ * they are shared; a node that changes its value drops its reference and
+ * takes a new buffer. */
+
+void *refbuf_alloc(size_t size);
+void *refbuf_dup(const void *data, size_t size);
+char *refbuf_strndup(const char *str, size_t len);
+void refbuf_retain(const void *ptr);
+void refbuf_release(void *ptr);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * refcount.h
+ * atomic reference counter helpers
+ *
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef REFCOUNT_H
+#define REFCOUNT_H
+
+#ifdef WIN32
+#include <windows.h>
+typedef volatile LONG refcount_t;
+#else
+typedef long refcount_t;
+#endif
+
+/* add n to the counter and return the new value */
+static inline long refcount_add(refcount_t *ref, long n)
+{
+#ifdef WIN32
+	return InterlockedExchangeAdd(ref, n) + n;
+#else
+	return __atomic_add_fetch(ref, n, __ATOMIC_ACQ_REL);
+#endif
+}
+
+/* take a reference unless the last one is already gone */
+static inline int refcount_try_add(refcount_t *ref)
+{
+#ifdef WIN32
+	LONG cur = *ref;
+	while (cur > 0) {
+		LONG prev = InterlockedCompareExchange(ref, cur + 1, cur);
+		if (prev == cur) return 1;
+		cur = prev;
+	}
+#else
+	long cur = __atomic_load_n(ref, __ATOMIC_ACQUIRE);
+	while (cur > 0) {
+		if (__atomic_compare_exchange_n(ref, &cur, cur + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			return 1;
+		}
+	}
+#endif
+	return 0;
+}
+
+#endif
@@ -0,0 +1,435 @@
+/*
+ * utf.c
+ * UTF-8 <-> UTF-16BE transcoding with vectorized ASCII fast paths
+ *
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <string.h>
+#include "utf.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTF_HAVE_SSE2
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#include <immintrin.h>
+#define UTF_HAVE_AVX2
+#define UTF_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define UTF_HAVE_NEON
+#endif
+
+/* The kernels only deal with runs of ASCII, which make up the bulk of
+ * almost every string. Each one handles as many whole blocks of ASCII as
+ * it finds at the start of the input and returns how many characters that
+ * was; the scalar code takes care of everything else. */
+struct utf_kernels {
+	/* number of leading ASCII bytes */
+	size_t (*ascii_prefix)(const unsigned char *in, size_t len);
+	/* widen leading ASCII bytes to UTF-16BE */
+	size_t (*widen)(const unsigned char *in, size_t len, uint8_t *out);
+	/* number of leading ASCII code units */
+	size_t (*utf16_ascii_prefix)(const uint8_t *in, size_t units);
+	/* narrow leading ASCII code units to bytes */
+	size_t (*narrow)(const uint8_t *in, size_t units, unsigned char *out);
+};
+
+static size_t ascii_prefix_scalar(const unsigned char *in, size_t len)
+{
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, in + i, sizeof(w));
+		if (w & 0x8080808080808080ULL) break;
+	}
+	return i;
+}
+
+#if !defined(UTF_HAVE_SSE2) && !defined(UTF_HAVE_NEON)
+/* plain C has nothing to gain over the scalar conversion loops */
+static size_t widen_scalar(const unsigned char *in, size_t len, uint8_t *out)
+{
+	(void)in; (void)len; (void)out;
+	return 0;
+}
+
+static size_t utf16_ascii_prefix_scalar(const uint8_t *in, size_t units)
+{
+	(void)in; (void)units;
+	return 0;
+}
+
+static size_t narrow_scalar(const uint8_t *in, size_t units, unsigned char *out)
+{
+	(void)in; (void)units; (void)out;
+	return 0;
+}
+
+static const struct utf_kernels utf_kernels_scalar = {
+	ascii_prefix_scalar,
+	widen_scalar,
+	utf16_ascii_prefix_scalar,
+	narrow_scalar
+};
+#endif
+
+#ifdef UTF_HAVE_SSE2
+static size_t ascii_prefix_sse2(const unsigned char *in, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+		if (_mm_movemask_epi8(v)) break;
+	}
+	return i;
+}
+
+static size_t widen_sse2(const unsigned char *in, size_t len, uint8_t *out)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+		if (_mm_movemask_epi8(v)) break;
+		/* interleaving with zero bytes yields big endian code units */
+		_mm_storeu_si128((__m128i*)(out + i*2), _mm_unpacklo_epi8(zero, v));
+		_mm_storeu_si128((__m128i*)(out + i*2 + 16), _mm_unpackhi_epi8(zero, v));
+	}
+	return i;
+}
+
+/* a big endian code unit is ASCII if its first byte is 0 and its second
+ * byte is below 0x80; loaded as little endian that is (unit & 0x80FF) == 0 */
+static size_t utf16_ascii_prefix_sse2(const uint8_t *in, size_t units)
+{
+	const __m128i mask = _mm_set1_epi16((short)0x80FF);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 8 <= units; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i*2));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), zero)) != 0xFFFF) break;
+	}
+	return i;
+}
+
+static size_t narrow_sse2(const uint8_t *in, size_t units, unsigned char *out)
+{
+	const __m128i mask = _mm_set1_epi16((short)0x80FF);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= units; i += 16) {
+		__m128i v0 = _mm_loadu_si128((const __m128i*)(in + i*2));
+		__m128i v1 = _mm_loadu_si128((const __m128i*)(in + i*2 + 16));
+		__m128i bad = _mm_or_si128(_mm_and_si128(v0, mask), _mm_and_si128(v1, mask));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(bad, zero)) != 0xFFFF) break;
+		v0 = _mm_srli_epi16(v0, 8);
+		v1 = _mm_srli_epi16(v1, 8);
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(v0, v1));
+	}
+	return i;
+}
+
+static const struct utf_kernels utf_kernels_sse2 = {
+	ascii_prefix_sse2,
+	widen_sse2,
+	utf16_ascii_prefix_sse2,
+	narrow_sse2
+};
+#endif
+
+#ifdef UTF_HAVE_AVX2
+UTF_TARGET_AVX2 static size_t ascii_prefix_avx2(const unsigned char *in, size_t len)
+{
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+		if (_mm256_movemask_epi8(v)) break;
+	}
+	return i;
+}
+
+UTF_TARGET_AVX2 static size_t widen_avx2(const unsigned char *in, size_t len, uint8_t *out)
+{
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+		if (_mm256_movemask_epi8(v)) break;
+		__m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+		__m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+		_mm256_storeu_si256((__m256i*)(out + i*2), _mm256_slli_epi16(lo, 8));
+		_mm256_storeu_si256((__m256i*)(out + i*2 + 32), _mm256_slli_epi16(hi, 8));
+	}
+	return i;
+}
+
+UTF_TARGET_AVX2 static size_t utf16_ascii_prefix_avx2(const uint8_t *in, size_t units)
+{
+	const __m256i mask = _mm256_set1_epi16((short)0x80FF);
+	size_t i = 0;
+	for (; i + 16 <= units; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(in + i*2));
+		if (!_mm256_testz_si256(v, mask)) break;
+	}
+	return i;
+}
+
+UTF_TARGET_AVX2 static size_t narrow_avx2(const uint8_t *in, size_t units, unsigned char *out)
+{
+	const __m256i mask = _mm256_set1_epi16((short)0x80FF);
+	size_t i = 0;
+	for (; i + 16 <= units; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(in + i*2));
+		if (!_mm256_testz_si256(v, mask)) break;
+		v = _mm256_srli_epi16(v, 8);
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+	}
+	return i;
+}
+
+static const struct utf_kernels utf_kernels_avx2 = {
+	ascii_prefix_avx2,
+	widen_avx2,
+	utf16_ascii_prefix_avx2,
+	narrow_avx2
+};
+#endif
+
+#ifdef UTF_HAVE_NEON
+static size_t ascii_prefix_neon(const unsigned char *in, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		if (vmaxvq_u8(vld1q_u8(in + i)) >= 0x80) break;
+	}
+	return i;
+}
+
+static size_t widen_neon(const unsigned char *in, size_t len, uint8_t *out)
+{
+	const uint8x16_t zero = vdupq_n_u8(0);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(in + i);
+		if (vmaxvq_u8(v) >= 0x80) break;
+		vst1q_u8(out + i*2, vzip1q_u8(zero, v));
+		vst1q_u8(out + i*2 + 16, vzip2q_u8(zero, v));
+	}
+	return i;
+}
+
+static size_t utf16_ascii_prefix_neon(const uint8_t *in, size_t units)
+{
+	const uint16x8_t mask = vdupq_n_u16(0x80FF);
+	size_t i = 0;
+	for (; i + 8 <= units; i += 8) {
+		uint16x8_t v = vreinterpretq_u16_u8(vld1q_u8(in + i*2));
+		if (vmaxvq_u16(vandq_u16(v, mask))) break;
+	}
+	return i;
+}
+
+static size_t narrow_neon(const uint8_t *in, size_t units, unsigned char *out)
+{
+	const uint16x8_t mask = vdupq_n_u16(0x80FF);
+	size_t i = 0;
+	for (; i + 8 <= units; i += 8) {
+		uint16x8_t v = vreinterpretq_u16_u8(vld1q_u8(in + i*2));
+		if (vmaxvq_u16(vandq_u16(v, mask))) break;
+		vst1_u8(out + i, vshrn_n_u16(v, 8));
+	}
+	return i;
+}
+
+static const struct utf_kernels utf_kernels_neon = {
+	ascii_prefix_neon,
+	widen_neon,
+	utf16_ascii_prefix_neon,
+	narrow_neon
+};
+#endif
+
+#if defined(UTF_HAVE_SSE2)
+static const struct utf_kernels *utf_kernels = &utf_kernels_sse2;
+#elif defined(UTF_HAVE_NEON)
+static const struct utf_kernels *utf_kernels = &utf_kernels_neon;
+#else
+static const struct utf_kernels *utf_kernels = &utf_kernels_scalar;
+#endif
+
+void utf_init(void)
+{
+#ifdef UTF_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		utf_kernels = &utf_kernels_avx2;
+	}
+#endif
+}
+
+int utf8_is_ascii(const char *str, size_t len)
+{
+	const unsigned char *s = (const unsigned char*)str;
+	size_t i = utf_kernels->ascii_prefix(s, len);
+	if (i + 8 <= len) {
+		i += ascii_prefix_scalar(s + i, len - i);
+	}
+	for (; i < len; i++) {
+		if (s[i] >= 0x80) return 0;
+	}
+	return 1;
+}
+
+size_t utf8_to_utf16be(const char *in, size_t len, uint8_t *out, size_t *consumed)
+{
+	const unsigned char *s = (const unsigned char*)in;
+	size_t p = 0;
+	size_t i = 0;
+
+	unsigned char c0;
+	unsigned char c1;
+	unsigned char c2;
+	unsigned char c3;
+
+	uint32_t w;
+
+#define PUT_UNIT(u) \
+	do { \
+		if (out) { \
+			out[p*2] = (uint8_t)((u) >> 8); \
+			out[p*2+1] = (uint8_t)(u); \
+		} \
+		p++; \
+	} while (0)
+
+	while (i < len) {
+		c0 = s[i];
+		if (c0 < 0x80) {
+			size_t n = (out) ? utf_kernels->widen(s + i, len - i, out + p*2) : utf_kernels->ascii_prefix(s + i, len - i);
+			if (n > 0) {
+				i += n;
+				p += n;
+				continue;
+			}
+		}
+		c1 = (i+1 < len) ? s[i+1] : 0;
+		c2 = (i+2 < len) ? s[i+2] : 0;
+		c3 = (i+3 < len) ? s[i+3] : 0;
+		if ((c0 >= 0xF0) && (i+3 < len) && (c1 >= 0x80) && (c2 >= 0x80) && (c3 >= 0x80)) {
+			// 4 byte sequence.  Need to generate UTF-16 surrogate pair
+			w = ((((c0 & 7) << 18) + ((c1 & 0x3F) << 12) + ((c2 & 0x3F) << 6) + (c3 & 0x3F)) & 0x1FFFFF) - 0x010000;
+			PUT_UNIT(0xD800 + (w >> 10));
+			PUT_UNIT(0xDC00 + (w & 0x3FF));
+			i+=4;
+		} else if ((c0 >= 0xE0) && (i+2 < len) && (c1 >= 0x80) && (c2 >= 0x80)) {
+			// 3 byte sequence
+			PUT_UNIT(((c2 & 0x3F) + ((c1 & 3) << 6)) + (((c1 >> 2) & 15) << 8) + ((c0 & 15) << 12));
+			i+=3;
+		} else if ((c0 >= 0xC0) && (i+1 < len) && (c1 >= 0x80)) {
+			// 2 byte sequence
+			PUT_UNIT(((c1 & 0x3F) + ((c0 & 3) << 6)) + (((c0 >> 2) & 7) << 8));
+			i+=2;
+		} else if (c0 < 0x80) {
+			// 1 byte sequence
+			PUT_UNIT(c0);
+			i+=1;
+		} else {
+			// invalid character
+			break;
+		}
+	}
+#undef PUT_UNIT
+
+	if (consumed) {
+		*consumed = i;
+	}
+	return p;
+}
+
+size_t utf16be_to_utf8(const uint8_t *in, size_t units, char *out)
+{
+	size_t p = 0;
+	size_t i = 0;
+
+	uint16_t wc;
+	uint32_t w = 0;
+	int read_lead_surrogate = 0;
+
+	while (i < units) {
+		wc = (uint16_t)((in[i*2] << 8) | in[i*2+1]);
+		if (wc < 0x80) {
+			/* ASCII doesn't touch the surrogate state */
+			size_t n = (out) ? utf_kernels->narrow(in + i*2, units - i, (unsigned char*)out + p) : utf_kernels->utf16_ascii_prefix(in + i*2, units - i);
+			if (n > 0) {
+				i += n;
+				p += n;
+				continue;
+			}
+		}
+		i++;
+		if (wc >= 0xD800 && wc <= 0xDBFF) {
+			if (!read_lead_surrogate) {
+				read_lead_surrogate = 1;
+				w = 0x010000 + ((wc & 0x3FF) << 10);
+			} else {
+				// This is invalid, the next 16 bit char should be a trail surrogate.
+				// Handling error by skipping.
+				read_lead_surrogate = 0;
+			}
+		} else if (wc >= 0xDC00 && wc <= 0xDFFF) {
+			if (read_lead_surrogate) {
+				read_lead_surrogate = 0;
+				w = w | (wc & 0x3FF);
+				if (out) {
+					out[p] = (char)(0xF0 + ((w >> 18) & 0x7));
+					out[p+1] = (char)(0x80 + ((w >> 12) & 0x3F));
+					out[p+2] = (char)(0x80 + ((w >> 6) & 0x3F));
+					out[p+3] = (char)(0x80 + (w & 0x3F));
+				}
+				p += 4;
+			} else {
+				// This is invalid.  A trail surrogate should always follow a lead surrogate.
+				// Handling error by skipping
+			}
+		} else if (wc >= 0x800) {
+			if (out) {
+				out[p] = (char)(0xE0 + ((wc >> 12) & 0xF));
+				out[p+1] = (char)(0x80 + ((wc >> 6) & 0x3F));
+				out[p+2] = (char)(0x80 + (wc & 0x3F));
+			}
+			p += 3;
+		} else if (wc >= 0x80) {
+			if (out) {
+				out[p] = (char)(0xC0 + ((wc >> 6) & 0x1F));
+				out[p+1] = (char)(0x80 + (wc & 0x3F));
+			}
+			p += 2;
+		} else {
+			if (out) {
+				out[p] = (char)(wc & 0x7F);
+			}
+			p++;
+		}
+	}
+	if (out) {
+		out[p] = '\0';
+	}
+	return p;
+}
@@ -0,0 +1,46 @@
+/*
+ * utf.h
+ * header file for UTF-8 <-> UTF-16BE transcoding
+ *
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef UTF_H
+#define UTF_H
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Select the fastest kernels the CPU supports. Without it the portable
+ * ones are used. */
+void utf_init(void);
+
+int utf8_is_ascii(const char *str, size_t len);
+
+/* Convert len bytes of UTF-8 to big endian UTF-16. out may sit at any
+ * alignment; with out == NULL nothing is written and only the number of
+ * code units is determined, which is exactly what a conversion produces.
+ * Conversion stops at the first invalid sequence; consumed (if not NULL)
+ * receives the number of input bytes used. Returns the number of code
+ * units. */
+size_t utf8_to_utf16be(const char *in, size_t len, uint8_t *out, size_t *consumed);
+
+/* Convert units big endian UTF-16 code units to UTF-8. Unpaired surrogates
+ * are skipped. With out == NULL only the output length is determined,
+ * otherwise out needs room for that many bytes plus a terminating NUL.
+ * Returns the number of bytes, not counting the NUL. */
+size_t utf16be_to_utf8(const uint8_t *in, size_t units, char *out);
+
+#endif
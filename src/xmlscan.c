@@ -0,0 +1,184 @@
+/*
+ * xmlscan.c
+ * Classification of XML input in blocks of 64 bytes, with vectorized
+ * kernels
+ *
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <string.h>
+#include "xmlscan.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define XML_SCAN_HAVE_SSE2
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#include <immintrin.h>
+#define XML_SCAN_HAVE_AVX2
+#define XML_SCAN_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define XML_SCAN_HAVE_NEON
+#endif
+
+typedef void (*xml_scan_kernel_t)(const char *block, uint64_t masks[XML_SCAN_CLASSES]);
+
+#if !defined(XML_SCAN_HAVE_SSE2) && !defined(XML_SCAN_HAVE_NEON)
+static void xml_scan_block_scalar(const char *block, uint64_t masks[XML_SCAN_CLASSES])
+{
+	unsigned int i;
+	memset(masks, 0, XML_SCAN_CLASSES * sizeof(uint64_t));
+	for (i = 0; i < XML_SCAN_BLOCK; i++) {
+		uint64_t bit = 1ULL << i;
+		switch (block[i]) {
+		case '<':
+			masks[XML_SCAN_LT] |= bit;
+			break;
+		case '>':
+			masks[XML_SCAN_GT] |= bit;
+			break;
+		case '"':
+			masks[XML_SCAN_QUOTE] |= bit;
+			break;
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\n':
+			masks[XML_SCAN_WS] |= bit;
+			break;
+		default:
+			break;
+		}
+	}
+}
+#endif
+
+#ifdef XML_SCAN_HAVE_SSE2
+static void xml_scan_block_sse2(const char *block, uint64_t masks[XML_SCAN_CLASSES])
+{
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	unsigned int i;
+	memset(masks, 0, XML_SCAN_CLASSES * sizeof(uint64_t));
+	for (i = 0; i < XML_SCAN_BLOCK; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(block + i));
+		__m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+					  _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+		masks[XML_SCAN_LT] |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lt)) << i;
+		masks[XML_SCAN_GT] |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, gt)) << i;
+		masks[XML_SCAN_QUOTE] |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << i;
+		masks[XML_SCAN_WS] |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << i;
+	}
+}
+#endif
+
+#ifdef XML_SCAN_HAVE_AVX2
+XML_SCAN_TARGET_AVX2 static void xml_scan_block_avx2(const char *block, uint64_t masks[XML_SCAN_CLASSES])
+{
+	const __m256i lt = _mm256_set1_epi8('<');
+	const __m256i gt = _mm256_set1_epi8('>');
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	__m256i lo = _mm256_loadu_si256((const __m256i*)block);
+	__m256i hi = _mm256_loadu_si256((const __m256i*)(block + 32));
+	__m256i ws_lo = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(lo, space), _mm256_cmpeq_epi8(lo, tab)),
+					_mm256_or_si256(_mm256_cmpeq_epi8(lo, cr), _mm256_cmpeq_epi8(lo, lf)));
+	__m256i ws_hi = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(hi, space), _mm256_cmpeq_epi8(hi, tab)),
+					_mm256_or_si256(_mm256_cmpeq_epi8(hi, cr), _mm256_cmpeq_epi8(hi, lf)));
+#define XML_SCAN_MASK64(l, h) \
+	((uint64_t)(uint32_t)_mm256_movemask_epi8(l) | ((uint64_t)(uint32_t)_mm256_movemask_epi8(h) << 32))
+	masks[XML_SCAN_LT] = XML_SCAN_MASK64(_mm256_cmpeq_epi8(lo, lt), _mm256_cmpeq_epi8(hi, lt));
+	masks[XML_SCAN_GT] = XML_SCAN_MASK64(_mm256_cmpeq_epi8(lo, gt), _mm256_cmpeq_epi8(hi, gt));
+	masks[XML_SCAN_QUOTE] = XML_SCAN_MASK64(_mm256_cmpeq_epi8(lo, quote), _mm256_cmpeq_epi8(hi, quote));
+	masks[XML_SCAN_WS] = XML_SCAN_MASK64(ws_lo, ws_hi);
+#undef XML_SCAN_MASK64
+}
+#endif
+
+#ifdef XML_SCAN_HAVE_NEON
+static const uint8_t xml_scan_bit_weights[16] = {
+	1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+};
+
+/* NEON has no movemask; weigh each byte of the comparison results with
+ * its bit and add them up pairwise until 64 bits remain */
+static uint64_t xml_scan_mask64_neon(uint8x16_t m0, uint8x16_t m1, uint8x16_t m2, uint8x16_t m3)
+{
+	const uint8x16_t weights = vld1q_u8(xml_scan_bit_weights);
+	uint8x16_t s0 = vpaddq_u8(vandq_u8(m0, weights), vandq_u8(m1, weights));
+	uint8x16_t s1 = vpaddq_u8(vandq_u8(m2, weights), vandq_u8(m3, weights));
+	s0 = vpaddq_u8(s0, s1);
+	s0 = vpaddq_u8(s0, s0);
+	return vgetq_lane_u64(vreinterpretq_u64_u8(s0), 0);
+}
+
+static void xml_scan_block_neon(const char *block, uint64_t masks[XML_SCAN_CLASSES])
+{
+	const uint8_t *in = (const uint8_t*)block;
+	uint8x16_t v[4];
+	uint8x16_t m[4];
+	unsigned int i;
+	for (i = 0; i < 4; i++) {
+		v[i] = vld1q_u8(in + i*16);
+	}
+	for (i = 0; i < 4; i++) m[i] = vceqq_u8(v[i], vdupq_n_u8('<'));
+	masks[XML_SCAN_LT] = xml_scan_mask64_neon(m[0], m[1], m[2], m[3]);
+	for (i = 0; i < 4; i++) m[i] = vceqq_u8(v[i], vdupq_n_u8('>'));
+	masks[XML_SCAN_GT] = xml_scan_mask64_neon(m[0], m[1], m[2], m[3]);
+	for (i = 0; i < 4; i++) m[i] = vceqq_u8(v[i], vdupq_n_u8('"'));
+	masks[XML_SCAN_QUOTE] = xml_scan_mask64_neon(m[0], m[1], m[2], m[3]);
+	for (i = 0; i < 4; i++) {
+		m[i] = vorrq_u8(vorrq_u8(vceqq_u8(v[i], vdupq_n_u8(' ')), vceqq_u8(v[i], vdupq_n_u8('\t'))),
+				vorrq_u8(vceqq_u8(v[i], vdupq_n_u8('\r')), vceqq_u8(v[i], vdupq_n_u8('\n'))));
+	}
+	masks[XML_SCAN_WS] = xml_scan_mask64_neon(m[0], m[1], m[2], m[3]);
+}
+#endif
+
+#if defined(XML_SCAN_HAVE_SSE2)
+static xml_scan_kernel_t xml_scan_kernel = xml_scan_block_sse2;
+#elif defined(XML_SCAN_HAVE_NEON)
+static xml_scan_kernel_t xml_scan_kernel = xml_scan_block_neon;
+#else
+static xml_scan_kernel_t xml_scan_kernel = xml_scan_block_scalar;
+#endif
+
+void xml_scan_init(void)
+{
+#ifdef XML_SCAN_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		xml_scan_kernel = xml_scan_block_avx2;
+	}
+#endif
+}
+
+void xml_scan_block(const char *block, uint64_t masks[XML_SCAN_CLASSES])
+{
+	xml_scan_kernel(block, masks);
+}
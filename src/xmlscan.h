@@ -0,0 +1,59 @@
+/*
+ * xmlscan.h
+ * header file for classifying XML input in blocks of 64 bytes
+ *
+ * Copyright (c) 2026 agent, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifndef XMLSCAN_H
+#define XMLSCAN_H
+#include <stdint.h>
+
+#define XML_SCAN_BLOCK 64
+
+/* the classes of characters a block is classified into */
+enum {
+	XML_SCAN_LT,	/* '<' */
+	XML_SCAN_GT,	/* '>' */
+	XML_SCAN_QUOTE,	/* '"' */
+	XML_SCAN_WS,	/* ' ', '\t', '\r' and '\n' */
+	XML_SCAN_CLASSES
+};
+
+/* Select the fastest kernel the CPU supports. Without it the portable
+ * one is used. */
+void xml_scan_init(void);
+
+/* Classify the XML_SCAN_BLOCK bytes at block: bit i of masks[c] is set if
+ * block[i] belongs to class c. */
+void xml_scan_block(const char *block, uint64_t masks[XML_SCAN_CLASSES]);
+
+/* index of the lowest set bit of a non-zero mask */
+#if defined(__GNUC__) || defined(__clang__)
+#define xml_scan_first(mask) ((unsigned int)__builtin_ctzll(mask))
+#else
+static inline unsigned int xml_scan_first(uint64_t mask)
+{
+	unsigned int i = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		i++;
+	}
+	return i;
+}
+#endif
+
+#endif
@@ -41,12 +41,12 @@
 #include <limits.h>
 
 #include <node.h>
-#include <node_list.h>
 
 #include "plist.h"
 #include "base64.h"
 #include "strbuf.h"
 #include "time64.h"
+#include "xmlscan.h"
 
 #define XPLIST_KEY	"key"
 #define XPLIST_KEY_LEN 3
@@ -88,6 +88,7 @@ static int plist_xml_debug = 0;
 void plist_xml_init(void)
 {
     /* init XML stuff */
+    xml_scan_init();
 #ifdef DEBUG
     char *env_debug = getenv("PLIST_XML_DEBUG");
     if (env_debug && !strcmp(env_debug, "1")) {
@@ -125,7 +126,8 @@ static size_t dtostr(char *buf, size_t bufsize, double realval)
     return len;
 }
 
-static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
+/* write a single node; for arrays and dicts with items only the opening tag */
+static void node_to_xml_node(node_t* node, bytearray_t **outbuf, uint32_t depth)
 {
     plist_data_t node_data = NULL;
 
@@ -196,12 +198,12 @@ static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
     case PLIST_ARRAY:
         tag = XPLIST_ARRAY;
         tag_len = XPLIST_ARRAY_LEN;
-        isStruct = (node->children) ? TRUE : FALSE;
+        isStruct = (node->count > 0) ? TRUE : FALSE;
         break;
     case PLIST_DICT:
         tag = XPLIST_DICT;
         tag_len = XPLIST_DICT_LEN;
-        isStruct = (node->children) ? TRUE : FALSE;
+        isStruct = (node->count > 0) ? TRUE : FALSE;
         break;
     case PLIST_DATE:
         tag = XPLIST_DATE;
@@ -284,7 +286,7 @@ static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
         tagOpen = TRUE;
         str_buf_append(*outbuf, "\n", 1);
         if (node_data->length > 0) {
-            uint32_t j = 0;
+            uint64_t j = 0;
             uint32_t indent = (depth > 8) ? 8 : depth;
             uint32_t maxread = MAX_DATA_BYTES_PER_LINE(indent);
             size_t count = 0;
@@ -345,22 +347,13 @@ static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
     free(val);
 
     if (isStruct) {
-        /* add newline for structured types */
+        /* add newline for structured types, the child nodes and the closing
+         * tag follow when node_to_xml() walks them */
         str_buf_append(*outbuf, "\n", 1);
-
-        /* add child nodes */
-        if (node_data->type == PLIST_DICT && node->children) {
-            assert((node->children->count % 2) == 0);
-        }
-        node_t *ch;
-        for (ch = node_first_child(node); ch; ch = node_next_sibling(ch)) {
-            node_to_xml(ch, outbuf, depth+1);
-        }
-
-        /* fix indent for structured types */
-        for (i = 0; i < depth; i++) {
-            str_buf_append(*outbuf, "\t", 1);
+        if (node_data->type == PLIST_DICT) {
+            assert((node->count % 2) == 0);
         }
+        return;
     }
 
     if (tagOpen) {
@@ -374,6 +367,35 @@ static void node_to_xml(node_t* node, bytearray_t **outbuf, uint32_t depth)
     return;
 }
 
+static void node_to_xml(node_t* top, bytearray_t **outbuf)
+{
+    node_t *node = top;
+    int leaving = 0;
+    uint32_t depth = 0;
+    uint32_t i = 0;
+
+    while (node) {
+        if (leaving) {
+            depth--;
+            /* fix indent for structured types */
+            for (i = 0; i < depth; i++) {
+                str_buf_append(*outbuf, "\t", 1);
+            }
+            if (plist_get_data(node)->type == PLIST_DICT) {
+                str_buf_append(*outbuf, "</" XPLIST_DICT ">\n", XPLIST_DICT_LEN + 4);
+            } else {
+                str_buf_append(*outbuf, "</" XPLIST_ARRAY ">\n", XPLIST_ARRAY_LEN + 4);
+            }
+        } else {
+            node_to_xml_node(node, outbuf, depth);
+            if (node->first) {
+                depth++;
+            }
+        }
+        node = node_walk_next(top, node, &leaving);
+    }
+}
+
 static void parse_date(const char *strval, struct TM *btime)
 {
     if (!btime) return;
@@ -432,18 +454,12 @@ static int num_digits_u(uint64_t i)
     return n;
 }
 
-static void node_estimate_size(node_t *node, uint64_t *size, uint32_t depth)
+/* estimated size of a node without children, or of the tags of a
+ * structured node with children */
+static void node_estimate_size_single(node_t *node, uint64_t *size, uint32_t depth)
 {
-    plist_data_t data;
-    if (!node) {
-        return;
-    }
-    data = plist_get_data(node);
-    if (node->children) {
-        node_t *ch;
-        for (ch = node_first_child(node); ch; ch = node_next_sibling(ch)) {
-            node_estimate_size(ch, size, depth + 1);
-        }
+    plist_data_t data = plist_get_data(node);
+    if (node->count > 0) {
         switch (data->type) {
         case PLIST_DICT:
             *size += (XPLIST_DICT_LEN << 1) + 7;
@@ -453,76 +469,94 @@ static void node_estimate_size(node_t *node, uint64_t *size, uint32_t depth)
             break;
         default:
             break;
-	}
+        }
         *size += (depth << 1);
-    } else {
-        uint32_t indent = (depth > 8) ? 8 : depth;
-        switch (data->type) {
-        case PLIST_DATA: {
-            uint32_t req_lines = (data->length / MAX_DATA_BYTES_PER_LINE(indent)) + 1;
-            uint32_t b64len = data->length + (data->length / 3);
-            b64len += b64len % 4;
-            *size += b64len;
-            *size += (XPLIST_DATA_LEN << 1) + 5 + (indent+1) * (req_lines+1) + 1;
-        }   break;
-        case PLIST_STRING:
-            *size += data->length;
-            *size += (XPLIST_STRING_LEN << 1) + 6;
-            break;
-        case PLIST_KEY:
-            *size += data->length;
-            *size += (XPLIST_KEY_LEN << 1) + 6;
-            break;
-        case PLIST_UINT:
-            if (data->length == 16) {
-                *size += num_digits_u(data->intval);
-            } else {
-                *size += num_digits_i((int64_t)data->intval);
-            }
-            *size += (XPLIST_INT_LEN << 1) + 6;
-            break;
-        case PLIST_REAL:
-            *size += num_digits_i((int64_t)data->realval) + 7;
-            *size += (XPLIST_REAL_LEN << 1) + 6;
-            break;
-        case PLIST_DATE:
-            *size += 20; /* YYYY-MM-DDThh:mm:ssZ */
-            *size += (XPLIST_DATE_LEN << 1) + 6;
-            break;
-        case PLIST_BOOLEAN:
-            *size += ((data->boolval) ? XPLIST_TRUE_LEN : XPLIST_FALSE_LEN) + 4;
-            break;
-        case PLIST_DICT:
-            *size += XPLIST_DICT_LEN + 4; /* <dict/> */
-            break;
-        case PLIST_ARRAY:
-            *size += XPLIST_ARRAY_LEN + 4; /* <array/> */
-            break;
-        case PLIST_UID:
+        return;
+    }
+    uint32_t indent = (depth > 8) ? 8 : depth;
+    switch (data->type) {
+    case PLIST_DATA: {
+        uint64_t req_lines = (data->length / MAX_DATA_BYTES_PER_LINE(indent)) + 1;
+        uint64_t b64len = data->length + (data->length / 3);
+        b64len += b64len % 4;
+        *size += b64len;
+        *size += (XPLIST_DATA_LEN << 1) + 5 + (indent+1) * (req_lines+1) + 1;
+    }   break;
+    case PLIST_STRING:
+        *size += data->length;
+        *size += (XPLIST_STRING_LEN << 1) + 6;
+        break;
+    case PLIST_KEY:
+        *size += data->length;
+        *size += (XPLIST_KEY_LEN << 1) + 6;
+        break;
+    case PLIST_UINT:
+        if (data->length == 16) {
+            *size += num_digits_u(data->intval);
+        } else {
             *size += num_digits_i((int64_t)data->intval);
-            *size += (XPLIST_DICT_LEN << 1) + 7;
-            *size += indent + ((indent+1) << 1);
-            *size += 18; /* <key>CF$UID</key> */
-            *size += (XPLIST_INT_LEN << 1) + 6;
-            break;
-        default:
-            break;
         }
-        *size += indent;
+        *size += (XPLIST_INT_LEN << 1) + 6;
+        break;
+    case PLIST_REAL:
+        *size += num_digits_i((int64_t)data->realval) + 7;
+        *size += (XPLIST_REAL_LEN << 1) + 6;
+        break;
+    case PLIST_DATE:
+        *size += 20; /* YYYY-MM-DDThh:mm:ssZ */
+        *size += (XPLIST_DATE_LEN << 1) + 6;
+        break;
+    case PLIST_BOOLEAN:
+        *size += ((data->boolval) ? XPLIST_TRUE_LEN : XPLIST_FALSE_LEN) + 4;
+        break;
+    case PLIST_DICT:
+        *size += XPLIST_DICT_LEN + 4; /* <dict/> */
+        break;
+    case PLIST_ARRAY:
+        *size += XPLIST_ARRAY_LEN + 4; /* <array/> */
+        break;
+    case PLIST_UID:
+        *size += num_digits_i((int64_t)data->intval);
+        *size += (XPLIST_DICT_LEN << 1) + 7;
+        *size += indent + ((indent+1) << 1);
+        *size += 18; /* <key>CF$UID</key> */
+        *size += (XPLIST_INT_LEN << 1) + 6;
+        break;
+    default:
+        break;
+    }
+    *size += indent;
+}
+
+static void node_estimate_size(node_t *top, uint64_t *size)
+{
+    node_t *node = top;
+    int leaving = 0;
+    uint32_t depth = 0;
+    while (node) {
+        if (leaving) {
+            depth--;
+        } else {
+            node_estimate_size_single(node, size, depth);
+            if (node->first) {
+                depth++;
+            }
+        }
+        node = node_walk_next(top, node, &leaving);
     }
 }
 
-PLIST_API void plist_to_xml(plist_t plist, char **plist_xml, uint32_t * length)
+PLIST_API void plist_to_xml64(plist_t plist, char **plist_xml, uint64_t * length)
 {
     uint64_t size = 0;
-    node_estimate_size(plist, &size, 0);
+    node_estimate_size(plist, &size);
     size += sizeof(XML_PLIST_PROLOG) + sizeof(XML_PLIST_EPILOG) - 1;
 
     strbuf_t *outbuf = str_buf_new(size);
 
     str_buf_append(outbuf, XML_PLIST_PROLOG, sizeof(XML_PLIST_PROLOG)-1);
 
-    node_to_xml(plist, &outbuf, 0);
+    node_to_xml(plist, &outbuf);
 
     str_buf_append(outbuf, XML_PLIST_EPILOG, sizeof(XML_PLIST_EPILOG));
 
@@ -533,6 +567,19 @@ PLIST_API void plist_to_xml(plist_t plist, char **plist_xml, uint32_t * length)
     str_buf_free(outbuf);
 }
 
+PLIST_API void plist_to_xml(plist_t plist, char **plist_xml, uint32_t * length)
+{
+    uint64_t len = 0;
+    plist_to_xml64(plist, plist_xml, &len);
+    if (*plist_xml && len > UINT32_MAX) {
+        /* the length can not be represented, don't hand out a truncated one */
+        free(*plist_xml);
+        *plist_xml = NULL;
+        len = 0;
+    }
+    *length = (uint32_t)len;
+}
+
 PLIST_API void plist_to_xml_free(char *plist_xml)
 {
     free(plist_xml);
@@ -542,18 +589,117 @@ struct _parse_ctx {
     const char *pos;
     const char *end;
     int err;
+    arena_t *arena;
+    const char *start;
+    const char *block;
+    uint64_t masks[XML_SCAN_CLASSES];
 };
 typedef struct _parse_ctx* parse_ctx;
 
+#define PARSE_CTX_INIT(xml, length) { (xml), (xml) + (length), 0, NULL, (xml), NULL, { 0 } }
+
+/* Classify the block of input holding ctx->pos unless it already is the
+ * current one, and return the offset of ctx->pos inside of it. Blocks are
+ * aligned to the start of the input; the last one is padded with zeros,
+ * which belong to no class. */
+static unsigned int parse_scan_block(parse_ctx ctx)
+{
+    size_t offset = ctx->pos - ctx->start;
+    const char *block = ctx->start + (offset & ~(size_t)(XML_SCAN_BLOCK - 1));
+    if (block != ctx->block) {
+        if (ctx->end - block >= XML_SCAN_BLOCK) {
+            xml_scan_block(block, ctx->masks);
+        } else {
+            char tail[XML_SCAN_BLOCK];
+            memset(tail, '\0', sizeof(tail));
+            memcpy(tail, block, ctx->end - block);
+            xml_scan_block(tail, ctx->masks);
+        }
+        ctx->block = block;
+    }
+    return (unsigned int)(offset & (XML_SCAN_BLOCK - 1));
+}
+
+/* Advance ctx->pos to the next character that is in one of the given
+ * classes (or, if negate is set, in none of them), or to the end. */
+static void parse_scan(parse_ctx ctx, unsigned int classes, int negate)
+{
+    while (ctx->pos < ctx->end) {
+        unsigned int shift = parse_scan_block(ctx);
+        uint64_t mask = 0;
+        int i;
+        for (i = 0; i < XML_SCAN_CLASSES; i++) {
+            if (classes & (1 << i)) {
+                mask |= ctx->masks[i];
+            }
+        }
+        if (negate) {
+            mask = ~mask;
+        }
+        mask >>= shift;
+        if (mask) {
+            size_t skip = xml_scan_first(mask);
+            ctx->pos = ((size_t)(ctx->end - ctx->pos) > skip) ? ctx->pos + skip : ctx->end;
+            return;
+        }
+        if (ctx->end - ctx->block <= XML_SCAN_BLOCK) {
+            break;
+        }
+        ctx->pos = ctx->block + XML_SCAN_BLOCK;
+    }
+    ctx->pos = ctx->end;
+}
+
+/* the class of c, or -1 if it is not one of the classified characters */
+static int parse_scan_class(char c)
+{
+    switch (c) {
+    case '<':
+        return XML_SCAN_LT;
+    case '>':
+        return XML_SCAN_GT;
+    case '"':
+        return XML_SCAN_QUOTE;
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+        return XML_SCAN_WS;
+    default:
+        return -1;
+    }
+}
+
 static void parse_skip_ws(parse_ctx ctx)
 {
-    while (ctx->pos < ctx->end && ((*(ctx->pos) == ' ') || (*(ctx->pos) == '\t') || (*(ctx->pos) == '\r') || (*(ctx->pos) == '\n'))) {
-        ctx->pos++;
+    if (ctx->pos < ctx->end && ((*(ctx->pos) == ' ') || (*(ctx->pos) == '\t') || (*(ctx->pos) == '\r') || (*(ctx->pos) == '\n'))) {
+        parse_scan(ctx, 1 << XML_SCAN_WS, 1);
     }
 }
 
 static void find_char(parse_ctx ctx, char c, int skip_quotes)
 {
+    int cls = parse_scan_class(c);
+    if (cls >= 0 && cls != XML_SCAN_WS) {
+        unsigned int classes = 1 << cls;
+        if (skip_quotes && (c != '"')) {
+            classes |= 1 << XML_SCAN_QUOTE;
+        }
+        while (1) {
+            parse_scan(ctx, classes, 0);
+            if (ctx->pos >= ctx->end || *(ctx->pos) == c) {
+                return;
+            }
+            /* a double quote to skip */
+            ctx->pos++;
+            parse_scan(ctx, 1 << XML_SCAN_QUOTE, 0);
+            if (ctx->pos >= ctx->end) {
+                PLIST_XML_ERR("EOF while looking for matching double quote\n");
+                return;
+            }
+            ctx->pos++;
+        }
+    }
     while (ctx->pos < ctx->end && (*(ctx->pos) != c)) {
         if (skip_quotes && (c != '"') && (*(ctx->pos) == '"')) {
             ctx->pos++;
@@ -573,6 +719,21 @@ static void find_char(parse_ctx ctx, char c, int skip_quotes)
 
 static void find_str(parse_ctx ctx, const char *str, size_t len, int skip_quotes)
 {
+    if (!skip_quotes) {
+        while (ctx->pos < (ctx->end - len)) {
+            const char *p = memchr(ctx->pos, str[0], (ctx->end - len) - ctx->pos);
+            if (!p) {
+                ctx->pos = ctx->end - len;
+                break;
+            }
+            ctx->pos = p;
+            if (!memcmp(ctx->pos, str, len)) {
+                break;
+            }
+            ctx->pos++;
+        }
+        return;
+    }
     while (ctx->pos < (ctx->end - len)) {
         if (!strncmp(ctx->pos, str, len)) {
             break;
@@ -595,7 +756,38 @@ static void find_str(parse_ctx ctx, const char *str, size_t len, int skip_quotes
 
 static void find_next(parse_ctx ctx, const char *nextchars, int numchars, int skip_quotes)
 {
+    unsigned int classes = 0;
+    int num_ws = 0;
     int i = 0;
+    for (i = 0; i < numchars; i++) {
+        int cls = parse_scan_class(nextchars[i]);
+        if (cls < 0 || cls == XML_SCAN_QUOTE) {
+            break;
+        }
+        if (cls == XML_SCAN_WS) {
+            num_ws++;
+        }
+        classes |= 1 << cls;
+    }
+    /* whitespace can only be looked up as a whole */
+    if (i == numchars && (num_ws == 0 || num_ws == 4)) {
+        if (skip_quotes) {
+            classes |= 1 << XML_SCAN_QUOTE;
+        }
+        while (1) {
+            parse_scan(ctx, classes, 0);
+            if (ctx->pos >= ctx->end || !skip_quotes || *(ctx->pos) != '"') {
+                return;
+            }
+            ctx->pos++;
+            parse_scan(ctx, 1 << XML_SCAN_QUOTE, 0);
+            if (ctx->pos >= ctx->end) {
+                PLIST_XML_ERR("EOF while looking for matching double quote\n");
+                return;
+            }
+            ctx->pos++;
+        }
+    }
     while (ctx->pos < ctx->end) {
         if (skip_quotes && (*(ctx->pos) == '"')) {
             ctx->pos++;
@@ -779,6 +971,100 @@ static text_part_t* get_text_parts(parse_ctx ctx, const char* tag, size_t tag_le
     return parts;
 }
 
+/* Decode the entity between '&' and ';' (entp points after the '&', entlen
+ * excludes the ';') into out. Returns the number of bytes written, or -1
+ * if the entity is invalid. */
+static int decode_entity(const char *entp, int entlen, char *out)
+{
+    if (!strncmp(entp, "amp", 3)) {
+        out[0] = '&';
+    } else if (!strncmp(entp, "apos", 4)) {
+        out[0] = '\'';
+    } else if (!strncmp(entp, "quot", 4)) {
+        out[0] = '"';
+    } else if (!strncmp(entp, "lt", 2)) {
+        out[0] = '<';
+    } else if (!strncmp(entp, "gt", 2)) {
+        out[0] = '>';
+    } else if (*entp == '#') {
+        /* numerical  character reference */
+        uint64_t val = 0;
+        char* ep = NULL;
+        if (entlen > 8) {
+            PLIST_XML_ERR("Invalid numerical character reference encountered, sequence too long: &%.*s;\n", entlen, entp);
+            return -1;
+        }
+        if (*(entp+1) == 'x' || *(entp+1) == 'X') {
+            if (entlen < 3) {
+                PLIST_XML_ERR("Invalid numerical character reference encountered, sequence too short: &%.*s;\n", entlen, entp);
+                return -1;
+            }
+            val = strtoull(entp+2, &ep, 16);
+        } else {
+            if (entlen < 2) {
+                PLIST_XML_ERR("Invalid numerical character reference encountered, sequence too short: &%.*s;\n", entlen, entp);
+                return -1;
+            }
+            val = strtoull(entp+1, &ep, 10);
+        }
+        if (val == 0 || val > 0x10FFFF || ep-entp != entlen) {
+            PLIST_XML_ERR("Invalid numerical character reference found: &%.*s;\n", entlen, entp);
+            return -1;
+        }
+        /* convert to UTF8 */
+        if (val >= 0x10000) {
+            /* four bytes */
+            out[0] = (char)(0xF0 + ((val >> 18) & 0x7));
+            out[1] = (char)(0x80 + ((val >> 12) & 0x3F));
+            out[2] = (char)(0x80 + ((val >> 6) & 0x3F));
+            out[3] = (char)(0x80 + (val & 0x3F));
+            return 4;
+        } else if (val >= 0x800) {
+            /* three bytes */
+            out[0] = (char)(0xE0 + ((val >> 12) & 0xF));
+            out[1] = (char)(0x80 + ((val >> 6) & 0x3F));
+            out[2] = (char)(0x80 + (val & 0x3F));
+            return 3;
+        } else if (val >= 0x80) {
+            /* two bytes */
+            out[0] = (char)(0xC0 + ((val >> 6) & 0x1F));
+            out[1] = (char)(0x80 + (val & 0x3F));
+            return 2;
+        } else {
+            /* one byte */
+            out[0] = (char)(val & 0x7F);
+        }
+    } else {
+        PLIST_XML_ERR("Invalid entity encountered: &%.*s;\n", entlen, entp);
+        return -1;
+    }
+    return 1;
+}
+
+/* Find the entity starting at str[*i] == '&'; on return *i is the index of
+ * the terminating ';'. Returns the length of the entity name, or -1 if it
+ * is not terminated or empty. */
+static int find_entity(const char *str, size_t len, size_t *i)
+{
+    const char *entp = str + *i + 1;
+    while (*i < len && str[*i] != ';') {
+        (*i)++;
+    }
+    if (*i >= len) {
+        PLIST_XML_ERR("Invalid entity sequence encountered (missing terminating ';')\n");
+        return -1;
+    }
+    if (str + *i - entp > INT_MAX) {
+        PLIST_XML_ERR("Invalid entity encountered, sequence too long\n");
+        return -1;
+    }
+    if (str + *i < entp + 1) {
+        PLIST_XML_ERR("Invalid empty entity sequence &;\n");
+        return -1;
+    }
+    return (int)(str + *i - entp);
+}
+
 static int unescape_entities(char *str, size_t *length)
 {
     size_t i = 0;
@@ -786,89 +1072,22 @@ static int unescape_entities(char *str, size_t *length)
     while (len > 0 && i < len-1) {
         if (str[i] == '&') {
             char *entp = str + i + 1;
-            while (i < len && str[i] != ';') {
-                i++;
-            }
-            if (i >= len) {
-                PLIST_XML_ERR("Invalid entity sequence encountered (missing terminating ';')\n");
+            char buf[4];
+            int entlen = find_entity(str, len, &i);
+            int bytelen;
+            if (entlen < 0) {
                 return -1;
             }
-            if (str+i >= entp+1) {
-                int entlen = str+i - entp;
-                int bytelen = 1;
-                if (!strncmp(entp, "amp", 3)) {
-                    /* the '&' is already there */
-                } else if (!strncmp(entp, "apos", 4)) {
-                    *(entp-1) = '\'';
-                } else if (!strncmp(entp, "quot", 4)) {
-                    *(entp-1) = '"';
-                } else if (!strncmp(entp, "lt", 2)) {
-                    *(entp-1) = '<';
-                } else if (!strncmp(entp, "gt", 2)) {
-                    *(entp-1) = '>';
-                } else if (*entp == '#') {
-                    /* numerical  character reference */
-                    uint64_t val = 0;
-                    char* ep = NULL;
-                    if (entlen > 8) {
-                        PLIST_XML_ERR("Invalid numerical character reference encountered, sequence too long: &%.*s;\n", entlen, entp);
-                        return -1;
-                    }
-                    if (*(entp+1) == 'x' || *(entp+1) == 'X') {
-                        if (entlen < 3) {
-                            PLIST_XML_ERR("Invalid numerical character reference encountered, sequence too short: &%.*s;\n", entlen, entp);
-                            return -1;
-                        }
-                        val = strtoull(entp+2, &ep, 16);
-                    } else {
-                        if (entlen < 2) {
-                            PLIST_XML_ERR("Invalid numerical character reference encountered, sequence too short: &%.*s;\n", entlen, entp);
-                            return -1;
-                        }
-                        val = strtoull(entp+1, &ep, 10);
-                    }
-                    if (val == 0 || val > 0x10FFFF || ep-entp != entlen) {
-                        PLIST_XML_ERR("Invalid numerical character reference found: &%.*s;\n", entlen, entp);
-                        return -1;
-                    }
-                    /* convert to UTF8 */
-                    if (val >= 0x10000) {
-                        /* four bytes */
-                        *(entp-1) = (char)(0xF0 + ((val >> 18) & 0x7));
-                        *(entp+0) = (char)(0x80 + ((val >> 12) & 0x3F));
-                        *(entp+1) = (char)(0x80 + ((val >> 6) & 0x3F));
-                        *(entp+2) = (char)(0x80 + (val & 0x3F));
-                        entp+=3;
-                        bytelen = 4;
-                    } else if (val >= 0x800) {
-                        /* three bytes */
-                        *(entp-1) = (char)(0xE0 + ((val >> 12) & 0xF));
-                        *(entp+0) = (char)(0x80 + ((val >> 6) & 0x3F));
-                        *(entp+1) = (char)(0x80 + (val & 0x3F));
-                        entp+=2;
-                        bytelen = 3;
-                    } else if (val >= 0x80) {
-                        /* two bytes */
-                        *(entp-1) = (char)(0xC0 + ((val >> 6) & 0x1F));
-                        *(entp+0) = (char)(0x80 + (val & 0x3F));
-                        entp++;
-                        bytelen = 2;
-                    } else {
-                        /* one byte */
-                        *(entp-1) = (char)(val & 0x7F);
-                    }
-                } else {
-                    PLIST_XML_ERR("Invalid entity encountered: &%.*s;\n", entlen, entp);
-                    return -1;
-                }
-                memmove(entp, str+i+1, len - i);
-                i -= entlen+1 - bytelen;
-                len -= entlen+2 - bytelen;
-                continue;
-            } else {
-                PLIST_XML_ERR("Invalid empty entity sequence &;\n");
+            bytelen = decode_entity(entp, entlen, buf);
+            if (bytelen < 0) {
                 return -1;
             }
+            memcpy(entp-1, buf, bytelen);
+            entp += bytelen-1;
+            memmove(entp, str+i+1, len - i);
+            i -= entlen+1 - bytelen;
+            len -= entlen+2 - bytelen;
+            continue;
         }
         i++;
     }
@@ -876,7 +1095,24 @@ static int unescape_entities(char *str, size_t *length)
     return 0;
 }
 
-static char* text_parts_get_content(text_part_t *tp, int unesc_entities, size_t *length, int *requires_free)
+/* same checks as unescape_entities(), without modifying str */
+static int check_entities(const char *str, size_t len)
+{
+    size_t i = 0;
+    while (len > 0 && i < len-1) {
+        if (str[i] == '&') {
+            char buf[4];
+            int entlen = find_entity(str, len, &i);
+            if (entlen < 0 || decode_entity(str + i - entlen, entlen, buf) < 0) {
+                return -1;
+            }
+        }
+        i++;
+    }
+    return 0;
+}
+
+static char* text_parts_get_content(text_part_t *tp, int unesc_entities, size_t *length, int *requires_free, arena_t *arena)
 {
     char *str = NULL;
     size_t total_length = 0;
@@ -899,7 +1135,7 @@ static char* text_parts_get_content(text_part_t *tp, int unesc_entities, size_t
         total_length += tp->length;
         tp = tp->next;
     }
-    str = malloc(total_length + 1);
+    str = (arena) ? arena_alloc(arena, total_length + 1) : malloc(total_length + 1);
     assert(str);
     p = str;
     tp = tmp;
@@ -909,7 +1145,9 @@ static char* text_parts_get_content(text_part_t *tp, int unesc_entities, size_t
         p[len] = '\0';
         if (!tp->is_cdata && unesc_entities) {
             if (unescape_entities(p, &len) < 0) {
-                free(str);
+                if (!arena) {
+                    free(str);
+                }
                 return NULL;
             }
         }
@@ -917,6 +1155,9 @@ static char* text_parts_get_content(text_part_t *tp, int unesc_entities, size_t
         tp = tp->next;
     }
     *p = '\0';
+    if (arena) {
+        arena_shrink(arena, str, total_length + 1, p - str + 1);
+    }
     if (length) {
         *length = p - str;
     }
@@ -926,22 +1167,15 @@ static char* text_parts_get_content(text_part_t *tp, int unesc_entities, size_t
     return str;
 }
 
-static void node_from_xml(parse_ctx ctx, plist_t *plist)
+/* Skip whitespace, the XML declaration, comments and the DOCTYPE up to the
+ * next element tag and read its name. Returns 1 with the name (including a
+ * leading '/' for closing tags) pointing into the input, 0 at the end of
+ * the input, or -1 on error. */
+static int parse_next_tag(parse_ctx ctx, const char **name, int *name_len, int *is_empty)
 {
-    char *tag = NULL;
-    char *keyname = NULL;
-    plist_t subnode = NULL;
     const char *p = NULL;
-    plist_t parent = NULL;
-    int has_content = 0;
-
-    struct node_path_item {
-        const char *type;
-        void *prev;
-    };
-    struct node_path_item* node_path = NULL;
 
-    while (ctx->pos < ctx->end && !ctx->err) {
+    while (ctx->pos < ctx->end) {
         parse_skip_ws(ctx);
         if (ctx->pos >= ctx->end) {
             break;
@@ -951,13 +1185,13 @@ static void node_from_xml(parse_ctx ctx, plist_t *plist)
             find_next(ctx, " \t\r\n", 4, 0);
             PLIST_XML_ERR("Expected: opening tag, found: %.*s\n", (int)(ctx->pos - p), p);
             ctx->err++;
-            goto err_out;
+            return -1;
         }
         ctx->pos++;
         if (ctx->pos >= ctx->end) {
             PLIST_XML_ERR("EOF while parsing tag\n");
             ctx->err++;
-            goto err_out;
+            return -1;
         }
 
         if (*(ctx->pos) == '?') {
@@ -965,12 +1199,12 @@ static void node_from_xml(parse_ctx ctx, plist_t *plist)
             if (ctx->pos > ctx->end-2) {
                 PLIST_XML_ERR("EOF while looking for <? tag closing marker\n");
                 ctx->err++;
-                goto err_out;
+                return -1;
             }
             if (strncmp(ctx->pos, "?>", 2)) {
                 PLIST_XML_ERR("Couldn't find <? tag closing marker\n");
                 ctx->err++;
-                goto err_out;
+                return -1;
             }
             ctx->pos += 2;
             continue;
@@ -982,7 +1216,7 @@ static void node_from_xml(parse_ctx ctx, plist_t *plist)
                 if (ctx->pos > ctx->end-3 || strncmp(ctx->pos, "-->", 3)) {
                     PLIST_XML_ERR("Couldn't find end of comment\n");
                     ctx->err++;
-                    goto err_out;
+                    return -1;
                 }
                 ctx->pos+=3;
             } else if (((ctx->end - ctx->pos) > 8) && !strncmp(ctx->pos, "!DOCTYPE", 8)) {
@@ -993,7 +1227,7 @@ static void node_from_xml(parse_ctx ctx, plist_t *plist)
                     if (ctx->pos >= ctx->end) {
                         PLIST_XML_ERR("EOF while parsing !DOCTYPE\n");
                         ctx->err++;
-                        goto err_out;
+                        return -1;
                     }
                     if (*ctx->pos == '[') {
                         embedded_dtd = 1;
@@ -1011,7 +1245,7 @@ static void node_from_xml(parse_ctx ctx, plist_t *plist)
                     if (ctx->pos > ctx->end-2 || strncmp(ctx->pos, "]>", 2)) {
                         PLIST_XML_ERR("Couldn't find end of DOCTYPE\n");
                         ctx->err++;
-                        goto err_out;
+                        return -1;
                     }
                     ctx->pos += 2;
                 }
@@ -1020,385 +1254,428 @@ static void node_from_xml(parse_ctx ctx, plist_t *plist)
                 find_next(ctx, " \r\n\t>", 5, 1);
                 PLIST_XML_ERR("Invalid or incomplete special tag <%.*s> encountered\n", (int)(ctx->pos - p), p);
                 ctx->err++;
-                goto err_out;
+                return -1;
             }
             continue;
-        } else {
-            int is_empty = 0;
-            int closing_tag = 0;
-            p = ctx->pos;
-            find_next(ctx," \r\n\t<>", 6, 0);
-            if (ctx->pos >= ctx->end) {
-                PLIST_XML_ERR("Unexpected EOF while parsing XML\n");
+        }
+
+        p = ctx->pos;
+        find_next(ctx," \r\n\t<>", 6, 0);
+        if (ctx->pos >= ctx->end) {
+            PLIST_XML_ERR("Unexpected EOF while parsing XML\n");
+            ctx->err++;
+            return -1;
+        }
+        *name = p;
+        *name_len = ctx->pos - p;
+        if (*ctx->pos != '>') {
+            find_next(ctx, "<>", 2, 1);
+        }
+        if (ctx->pos >= ctx->end) {
+            PLIST_XML_ERR("Unexpected EOF while parsing XML\n");
+            ctx->err++;
+            return -1;
+        }
+        if (*ctx->pos != '>') {
+            PLIST_XML_ERR("Missing '>' for tag <%.*s\n", *name_len, p);
+            ctx->err++;
+            return -1;
+        }
+        *is_empty = 0;
+        if (*(ctx->pos-1) == '/') {
+            int idx = ctx->pos - p - 1;
+            if (idx < *name_len)
+                *name_len = idx;
+            *is_empty = 1;
+        }
+        ctx->pos++;
+        return 1;
+    }
+    return 0;
+}
+
+static void node_from_xml(parse_ctx ctx, plist_t *plist)
+{
+    char *tag = NULL;
+    char *keyname = NULL;
+    plist_t subnode = NULL;
+    const char *p = NULL;
+    plist_t parent = NULL;
+    int has_content = 0;
+
+    struct node_path_item {
+        const char *type;
+        void *prev;
+    };
+    struct node_path_item* node_path = NULL;
+
+    while (ctx->pos < ctx->end && !ctx->err) {
+        int is_empty = 0;
+        int closing_tag = 0;
+        int taglen = 0;
+        int res = parse_next_tag(ctx, &p, &taglen, &is_empty);
+        if (res == 0) {
+            break;
+        }
+        if (res < 0) {
+            goto err_out;
+        }
+        tag = malloc(taglen + 1);
+        strncpy(tag, p, taglen);
+        tag[taglen] = '\0';
+        if (!strcmp(tag, "plist")) {
+            free(tag);
+            tag = NULL;
+            has_content = 0;
+
+            if (!node_path && *plist) {
+                /* we don't allow another top-level <plist> */
+                break;
+            }
+            if (is_empty) {
+                PLIST_XML_ERR("Empty plist tag\n");
                 ctx->err++;
                 goto err_out;
             }
-            int taglen = ctx->pos - p;
-            tag = malloc(taglen + 1);
-            strncpy(tag, p, taglen);
-            tag[taglen] = '\0';
-            if (*ctx->pos != '>') {
-                find_next(ctx, "<>", 2, 1);
+
+            struct node_path_item *path_item = malloc(sizeof(struct node_path_item));
+            if (!path_item) {
+                PLIST_XML_ERR("out of memory when allocating node path item\n");
+                ctx->err++;
+                goto err_out;
             }
-            if (ctx->pos >= ctx->end) {
-                PLIST_XML_ERR("Unexpected EOF while parsing XML\n");
+            path_item->type = "plist";
+            path_item->prev = node_path;
+            node_path = path_item;
+
+            continue;
+        } else if (!strcmp(tag, "/plist")) {
+            if (!has_content) {
+                PLIST_XML_ERR("encountered empty plist tag\n");
                 ctx->err++;
                 goto err_out;
             }
-            if (*ctx->pos != '>') {
-                PLIST_XML_ERR("Missing '>' for tag <%s\n", tag);
+            if (!node_path) {
+                PLIST_XML_ERR("node path is empty while trying to match closing tag with opening tag\n");
                 ctx->err++;
                 goto err_out;
             }
-            if (*(ctx->pos-1) == '/') {
-                int idx = ctx->pos - p - 1;
-                if (idx < taglen)
-                    tag[idx] = '\0';
-                is_empty = 1;
+            if (strcmp(node_path->type, tag+1) != 0) {
+                PLIST_XML_ERR("mismatching closing tag <%s> found for opening tag <%s>\n", tag, node_path->type);
+                ctx->err++;
+                goto err_out;
             }
-            ctx->pos++;
-            if (!strcmp(tag, "plist")) {
-                free(tag);
-                tag = NULL;
-                has_content = 0;
+            struct node_path_item *path_item = node_path;
+            node_path = node_path->prev;
+            free(path_item);
 
-                if (!node_path && *plist) {
-                    /* we don't allow another top-level <plist> */
-                    break;
-                }
-                if (is_empty) {
-                    PLIST_XML_ERR("Empty plist tag\n");
-                    ctx->err++;
-                    goto err_out;
-                }
+            free(tag);
+            tag = NULL;
 
-                struct node_path_item *path_item = malloc(sizeof(struct node_path_item));
-                if (!path_item) {
-                    PLIST_XML_ERR("out of memory when allocating node path item\n");
-                    ctx->err++;
-                    goto err_out;
-                }
-                path_item->type = "plist";
-                path_item->prev = node_path;
-                node_path = path_item;
+            continue;
+        }
 
-                continue;
-            } else if (!strcmp(tag, "/plist")) {
-                if (!has_content) {
-                    PLIST_XML_ERR("encountered empty plist tag\n");
-                    ctx->err++;
-                    goto err_out;
-                }
-                if (!node_path) {
-                    PLIST_XML_ERR("node path is empty while trying to match closing tag with opening tag\n");
-                    ctx->err++;
-                    goto err_out;
-                }
-                if (strcmp(node_path->type, tag+1) != 0) {
-                    PLIST_XML_ERR("mismatching closing tag <%s> found for opening tag <%s>\n", tag, node_path->type);
+        /* values are parsed into sdata; the node is created once the
+         * tag turned out to describe one */
+        struct plist_data_s sdata;
+        plist_data_t data = &sdata;
+        memset(&sdata, '\0', sizeof(struct plist_data_s));
+        has_content = 1;
+
+        if (!strcmp(tag, XPLIST_DICT)) {
+            data->type = PLIST_DICT;
+        } else if (!strcmp(tag, XPLIST_ARRAY)) {
+            data->type = PLIST_ARRAY;
+        } else if (!strcmp(tag, XPLIST_INT)) {
+            if (!is_empty) {
+                text_part_t first_part = { NULL, 0, 0, NULL };
+                text_part_t *tp = get_text_parts(ctx, tag, taglen, 1, &first_part);
+                if (!tp) {
+                    PLIST_XML_ERR("Could not parse text content for '%s' node\n", tag);
+                    text_parts_free(first_part.next);
                     ctx->err++;
                     goto err_out;
                 }
-                struct node_path_item *path_item = node_path;
-                node_path = node_path->prev;
-                free(path_item);
-
-                free(tag);
-                tag = NULL;
-
-                continue;
-            }
-
-            plist_data_t data = plist_new_plist_data();
-            subnode = plist_new_node(data);
-            has_content = 1;
-
-            if (!strcmp(tag, XPLIST_DICT)) {
-                data->type = PLIST_DICT;
-            } else if (!strcmp(tag, XPLIST_ARRAY)) {
-                data->type = PLIST_ARRAY;
-            } else if (!strcmp(tag, XPLIST_INT)) {
-                if (!is_empty) {
-                    text_part_t first_part = { NULL, 0, 0, NULL };
-                    text_part_t *tp = get_text_parts(ctx, tag, taglen, 1, &first_part);
-                    if (!tp) {
-                        PLIST_XML_ERR("Could not parse text content for '%s' node\n", tag);
+                if (tp->begin) {
+                    int requires_free = 0;
+                    char *str_content = text_parts_get_content(tp, 0, NULL, &requires_free, NULL);
+                    if (!str_content) {
+                        PLIST_XML_ERR("Could not get text content for '%s' node\n", tag);
                         text_parts_free(first_part.next);
                         ctx->err++;
                         goto err_out;
                     }
-                    if (tp->begin) {
-                        int requires_free = 0;
-                        char *str_content = text_parts_get_content(tp, 0, NULL, &requires_free);
-                        if (!str_content) {
-                            PLIST_XML_ERR("Could not get text content for '%s' node\n", tag);
-                            text_parts_free(first_part.next);
-                            ctx->err++;
-                            goto err_out;
-                        }
-                        char *str = str_content;
-                        int is_negative = 0;
-                        if ((str[0] == '-') || (str[0] == '+')) {
-                            if (str[0] == '-') {
-                                is_negative = 1;
-                            }
-                            str++;
+                    char *str = str_content;
+                    int is_negative = 0;
+                    if ((str[0] == '-') || (str[0] == '+')) {
+                        if (str[0] == '-') {
+                            is_negative = 1;
                         }
-                        data->intval = strtoull((char*)str, NULL, 0);
-                        if (is_negative || (data->intval <= INT64_MAX)) {
-                            uint64_t v = data->intval;
-                            if (is_negative) {
-                                v = -v;
-                            }
-                            data->intval = v;
-                            data->length = 8;
-                        } else {
-                            data->length = 16;
-                        }
-                        if (requires_free) {
-                            free(str_content);
+                        str++;
+                    }
+                    data->intval = strtoull((char*)str, NULL, 0);
+                    if (is_negative || (data->intval <= INT64_MAX)) {
+                        uint64_t v = data->intval;
+                        if (is_negative) {
+                            v = -v;
                         }
+                        data->intval = v;
+                        data->length = 8;
                     } else {
-                        is_empty = 1;
+                        data->length = 16;
                     }
-                    text_parts_free(tp->next);
+                    if (requires_free) {
+                        free(str_content);
+                    }
+                } else {
+                    is_empty = 1;
                 }
-                if (is_empty) {
-                    data->intval = 0;
-                    data->length = 8;
+                text_parts_free(tp->next);
+            }
+            if (is_empty) {
+                data->intval = 0;
+                data->length = 8;
+            }
+            data->type = PLIST_UINT;
+        } else if (!strcmp(tag, XPLIST_REAL)) {
+            if (!is_empty) {
+                text_part_t first_part = { NULL, 0, 0, NULL };
+                text_part_t *tp = get_text_parts(ctx, tag, taglen, 1, &first_part);
+                if (!tp) {
+                    PLIST_XML_ERR("Could not parse text content for '%s' node\n", tag);
+                    text_parts_free(first_part.next);
+                    ctx->err++;
+                    goto err_out;
                 }
-                data->type = PLIST_UINT;
-            } else if (!strcmp(tag, XPLIST_REAL)) {
-                if (!is_empty) {
-                    text_part_t first_part = { NULL, 0, 0, NULL };
-                    text_part_t *tp = get_text_parts(ctx, tag, taglen, 1, &first_part);
-                    if (!tp) {
-                        PLIST_XML_ERR("Could not parse text content for '%s' node\n", tag);
+                if (tp->begin) {
+                    int requires_free = 0;
+                    char *str_content = text_parts_get_content(tp, 0, NULL, &requires_free, NULL);
+                    if (!str_content) {
+                        PLIST_XML_ERR("Could not get text content for '%s' node\n", tag);
                         text_parts_free(first_part.next);
                         ctx->err++;
                         goto err_out;
                     }
-                    if (tp->begin) {
-                        int requires_free = 0;
-                        char *str_content = text_parts_get_content(tp, 0, NULL, &requires_free);
-                        if (!str_content) {
-                            PLIST_XML_ERR("Could not get text content for '%s' node\n", tag);
-                            text_parts_free(first_part.next);
-                            ctx->err++;
-                            goto err_out;
-                        }
-                        data->realval = atof(str_content);
-                        if (requires_free) {
-                            free(str_content);
-                        }
+                    data->realval = atof(str_content);
+                    if (requires_free) {
+                        free(str_content);
                     }
-                    text_parts_free(tp->next);
                 }
-                data->type = PLIST_REAL;
-                data->length = 8;
-            } else if (!strcmp(tag, XPLIST_TRUE)) {
-                if (!is_empty) {
-                    get_text_parts(ctx, tag, taglen, 1, NULL);
+                text_parts_free(tp->next);
+            }
+            data->type = PLIST_REAL;
+            data->length = 8;
+        } else if (!strcmp(tag, XPLIST_TRUE)) {
+            if (!is_empty) {
+                get_text_parts(ctx, tag, taglen, 1, NULL);
+            }
+            data->type = PLIST_BOOLEAN;
+            data->boolval = 1;
+            data->length = 1;
+        } else if (!strcmp(tag, XPLIST_FALSE)) {
+            if (!is_empty) {
+                get_text_parts(ctx, tag, taglen, 1, NULL);
+            }
+            data->type = PLIST_BOOLEAN;
+            data->boolval = 0;
+            data->length = 1;
+        } else if (!strcmp(tag, XPLIST_STRING) || !strcmp(tag, XPLIST_KEY)) {
+            if (!is_empty) {
+                text_part_t first_part = { NULL, 0, 0, NULL };
+                text_part_t *tp = get_text_parts(ctx, tag, taglen, 0, &first_part);
+                char *str = NULL;
+                size_t length = 0;
+                if (!tp) {
+                    PLIST_XML_ERR("Could not parse text content for '%s' node\n", tag);
+                    text_parts_free(first_part.next);
+                    ctx->err++;
+                    goto err_out;
                 }
-                data->type = PLIST_BOOLEAN;
-                data->boolval = 1;
-                data->length = 1;
-            } else if (!strcmp(tag, XPLIST_FALSE)) {
-                if (!is_empty) {
-                    get_text_parts(ctx, tag, taglen, 1, NULL);
+                int is_key = (!strcmp(tag, "key") && !keyname && parent && (plist_get_node_type(parent) == PLIST_DICT));
+                str = text_parts_get_content(tp, 1, &length, NULL, (is_key) ? NULL : ctx->arena);
+                text_parts_free(first_part.next);
+                if (!str) {
+                    PLIST_XML_ERR("Could not get text content for '%s' node\n", tag);
+                    ctx->err++;
+                    goto err_out;
                 }
-                data->type = PLIST_BOOLEAN;
-                data->boolval = 0;
-                data->length = 1;
-            } else if (!strcmp(tag, XPLIST_STRING) || !strcmp(tag, XPLIST_KEY)) {
-                if (!is_empty) {
-                    text_part_t first_part = { NULL, 0, 0, NULL };
-                    text_part_t *tp = get_text_parts(ctx, tag, taglen, 0, &first_part);
-                    char *str = NULL;
-                    size_t length = 0;
-                    if (!tp) {
-                        PLIST_XML_ERR("Could not parse text content for '%s' node\n", tag);
-                        text_parts_free(first_part.next);
-                        ctx->err++;
-                        goto err_out;
-                    }
-                    str = text_parts_get_content(tp, 1, &length, NULL);
-                    text_parts_free(first_part.next);
-                    if (!str) {
-                        PLIST_XML_ERR("Could not get text content for '%s' node\n", tag);
-                        ctx->err++;
-                        goto err_out;
-                    }
-                    if (!strcmp(tag, "key") && !keyname && parent && (plist_get_node_type(parent) == PLIST_DICT)) {
-                        keyname = str;
-                        free(tag);
-                        tag = NULL;
-                        plist_free(subnode);
-                        subnode = NULL;
-                        continue;
-                    } else {
-                        data->strval = str;
-                        data->length = length;
-                    }
+                if (is_key) {
+                    keyname = str;
+                    free(tag);
+                    tag = NULL;
+                    continue;
                 } else {
-                    data->strval = strdup("");
-                    data->length = 0;
+                    data->strval = str;
+                    data->length = length;
                 }
-                data->type = PLIST_STRING;
-            } else if (!strcmp(tag, XPLIST_DATA)) {
-                if (!is_empty) {
-                    text_part_t first_part = { NULL, 0, 0, NULL };
-                    text_part_t *tp = get_text_parts(ctx, tag, taglen, 1, &first_part);
-                    if (!tp) {
-                        PLIST_XML_ERR("Could not parse text content for '%s' node\n", tag);
+            } else {
+                data->strval = (ctx->arena) ? arena_strndup(ctx->arena, "", 0) : strdup("");
+                data->length = 0;
+            }
+            data->type = PLIST_STRING;
+        } else if (!strcmp(tag, XPLIST_DATA)) {
+            if (!is_empty) {
+                text_part_t first_part = { NULL, 0, 0, NULL };
+                text_part_t *tp = get_text_parts(ctx, tag, taglen, 1, &first_part);
+                if (!tp) {
+                    PLIST_XML_ERR("Could not parse text content for '%s' node\n", tag);
+                    text_parts_free(first_part.next);
+                    ctx->err++;
+                    goto err_out;
+                }
+                if (tp->begin) {
+                    int requires_free = 0;
+                    char *str_content = text_parts_get_content(tp, 0, NULL, &requires_free, NULL);
+                    if (!str_content) {
+                        PLIST_XML_ERR("Could not get text content for '%s' node\n", tag);
                         text_parts_free(first_part.next);
                         ctx->err++;
                         goto err_out;
                     }
-                    if (tp->begin) {
-                        int requires_free = 0;
-                        char *str_content = text_parts_get_content(tp, 0, NULL, &requires_free);
-                        if (!str_content) {
-                            PLIST_XML_ERR("Could not get text content for '%s' node\n", tag);
-                            text_parts_free(first_part.next);
-                            ctx->err++;
-                            goto err_out;
-                        }
-                        size_t size = tp->length;
-                        if (size > 0) {
-                            data->buff = base64decode(str_content, &size);
-                            data->length = size;
-                        }
+                    size_t size = tp->length;
+                    if (size > 0 && ctx->arena) {
+                        data->buff = arena_alloc(ctx->arena, BASE64_DECODE_BUFSIZE(size));
+                        data->length = base64decode_buf(data->buff, str_content, size);
+                        arena_shrink(ctx->arena, data->buff, BASE64_DECODE_BUFSIZE(size), data->length);
+                    } else if (size > 0) {
+                        data->buff = base64decode(str_content, &size);
+                        data->length = size;
+                    }
 
-                        if (requires_free) {
-                            free(str_content);
-                        }
+                    if (requires_free) {
+                        free(str_content);
                     }
-                    text_parts_free(tp->next);
                 }
-                data->type = PLIST_DATA;
-            } else if (!strcmp(tag, XPLIST_DATE)) {
-                if (!is_empty) {
-                    text_part_t first_part = { NULL, 0, 0, NULL };
-                    text_part_t *tp = get_text_parts(ctx, tag, taglen, 1, &first_part);
-                    if (!tp) {
-                        PLIST_XML_ERR("Could not parse text content for '%s' node\n", tag);
+                text_parts_free(tp->next);
+            }
+            data->type = PLIST_DATA;
+        } else if (!strcmp(tag, XPLIST_DATE)) {
+            if (!is_empty) {
+                text_part_t first_part = { NULL, 0, 0, NULL };
+                text_part_t *tp = get_text_parts(ctx, tag, taglen, 1, &first_part);
+                if (!tp) {
+                    PLIST_XML_ERR("Could not parse text content for '%s' node\n", tag);
+                    text_parts_free(first_part.next);
+                    ctx->err++;
+                    goto err_out;
+                }
+                Time64_T timev = 0;
+                if (tp->begin) {
+                    int requires_free = 0;
+                    size_t length = 0;
+                    char *str_content = text_parts_get_content(tp, 0, &length, &requires_free, NULL);
+                    if (!str_content) {
+                        PLIST_XML_ERR("Could not get text content for '%s' node\n", tag);
                         text_parts_free(first_part.next);
                         ctx->err++;
                         goto err_out;
                     }
-                    Time64_T timev = 0;
-                    if (tp->begin) {
-                        int requires_free = 0;
-                        size_t length = 0;
-                        char *str_content = text_parts_get_content(tp, 0, &length, &requires_free);
-                        if (!str_content) {
-                            PLIST_XML_ERR("Could not get text content for '%s' node\n", tag);
-                            text_parts_free(first_part.next);
-                            ctx->err++;
-                            goto err_out;
-                        }
 
-                        if ((length >= 11) && (length < 32)) {
-                            /* we need to copy here and 0-terminate because sscanf will read the entire string (whole rest of XML data) which can be huge */
-                            char strval[32];
-                            struct TM btime;
-                            strncpy(strval, str_content, length);
-                            strval[tp->length] = '\0';
-                            parse_date(strval, &btime);
-                            timev = timegm64(&btime);
-                        } else {
-                            PLIST_XML_ERR("Invalid text content in date node\n");
-                        }
-                        if (requires_free) {
-                            free(str_content);
-                        }
+                    if ((length >= 11) && (length < 32)) {
+                        /* we need to copy here and 0-terminate because sscanf will read the entire string (whole rest of XML data) which can be huge */
+                        char strval[32];
+                        struct TM btime;
+                        strncpy(strval, str_content, length);
+                        strval[tp->length] = '\0';
+                        parse_date(strval, &btime);
+                        timev = timegm64(&btime);
+                    } else {
+                        PLIST_XML_ERR("Invalid text content in date node\n");
+                    }
+                    if (requires_free) {
+                        free(str_content);
                     }
-                    text_parts_free(tp->next);
-                    data->realval = (double)(timev - MAC_EPOCH);
                 }
-                data->length = sizeof(double);
-                data->type = PLIST_DATE;
-            } else if (tag[0] == '/') {
-                 closing_tag = 1;
-            } else {
-                PLIST_XML_ERR("Unexpected tag <%s%s> encountered\n", tag, (is_empty) ? "/" : "");
-                ctx->pos = ctx->end;
-                ctx->err++;
-                goto err_out;
+                text_parts_free(tp->next);
+                data->realval = (double)(timev - MAC_EPOCH);
             }
-            if (subnode && !closing_tag) {
-                if (!*plist) {
-                    /* first node, make this node the parent node */
-                    *plist = subnode;
-                    if (data->type != PLIST_DICT && data->type != PLIST_ARRAY) {
-                        /* if the first node is not a structered node, we're done */
-                        subnode = NULL;
-                        goto err_out;
-                    }
-                    parent = subnode;
-                } else if (parent) {
-                    switch (plist_get_node_type(parent)) {
-                    case PLIST_DICT:
-                        if (!keyname) {
-                            PLIST_XML_ERR("missing key name while adding dict item\n");
-                            ctx->err++;
-                            goto err_out;
-                        }
-                        plist_dict_set_item(parent, keyname, subnode);
-                        break;
-                    case PLIST_ARRAY:
-                        plist_array_append_item(parent, subnode);
-                        break;
-                    default:
-                        /* should not happen */
-                        PLIST_XML_ERR("parent is not a structured node\n");
-                        ctx->err++;
-                        goto err_out;
-                    }
+            data->length = sizeof(double);
+            data->type = PLIST_DATE;
+        } else if (tag[0] == '/') {
+             closing_tag = 1;
+        } else {
+            PLIST_XML_ERR("Unexpected tag <%s%s> encountered\n", tag, (is_empty) ? "/" : "");
+            ctx->pos = ctx->end;
+            ctx->err++;
+            goto err_out;
+        }
+        if (!closing_tag) {
+            subnode = plist_new_node_in(ctx->arena, (*plist == NULL));
+            data = plist_get_data(subnode);
+            sdata.flags = data->flags;
+            memcpy(data, &sdata, sizeof(struct plist_data_s));
+        }
+        if (subnode && !closing_tag) {
+            if (!*plist) {
+                /* first node, make this node the parent node */
+                *plist = subnode;
+                if (data->type != PLIST_DICT && data->type != PLIST_ARRAY) {
+                    /* if the first node is not a structered node, we're done */
+                    subnode = NULL;
+                    goto err_out;
                 }
-                if (!is_empty && (data->type == PLIST_DICT || data->type == PLIST_ARRAY)) {
-                    struct node_path_item *path_item = malloc(sizeof(struct node_path_item));
-                    if (!path_item) {
-                        PLIST_XML_ERR("out of memory when allocating node path item\n");
+                parent = subnode;
+            } else if (parent) {
+                switch (plist_get_node_type(parent)) {
+                case PLIST_DICT:
+                    if (!keyname) {
+                        PLIST_XML_ERR("missing key name while adding dict item\n");
                         ctx->err++;
                         goto err_out;
                     }
-                    path_item->type = (data->type == PLIST_DICT) ? XPLIST_DICT : XPLIST_ARRAY;
-                    path_item->prev = node_path;
-                    node_path = path_item;
-
-                    parent = subnode;
-                }
-                subnode = NULL;
-            } else if (closing_tag) {
-                if (!node_path) {
-                    PLIST_XML_ERR("node path is empty while trying to match closing tag with opening tag\n");
+                    plist_dict_set_item_in(ctx->arena, parent, keyname, subnode);
+                    break;
+                case PLIST_ARRAY:
+                    plist_array_append_item(parent, subnode);
+                    break;
+                default:
+                    /* should not happen */
+                    PLIST_XML_ERR("parent is not a structured node\n");
                     ctx->err++;
                     goto err_out;
                 }
-                if (strcmp(node_path->type, tag+1) != 0) {
-                    PLIST_XML_ERR("unexpected %s found (for opening %s)\n", tag, node_path->type);
+            }
+            if (!is_empty && (data->type == PLIST_DICT || data->type == PLIST_ARRAY)) {
+                struct node_path_item *path_item = malloc(sizeof(struct node_path_item));
+                if (!path_item) {
+                    PLIST_XML_ERR("out of memory when allocating node path item\n");
                     ctx->err++;
                     goto err_out;
                 }
-                struct node_path_item *path_item = node_path;
-                node_path = node_path->prev;
-                free(path_item);
+                path_item->type = (data->type == PLIST_DICT) ? XPLIST_DICT : XPLIST_ARRAY;
+                path_item->prev = node_path;
+                node_path = path_item;
 
-                parent = ((node_t*)parent)->parent;
-                if (!parent) {
-                    goto err_out;
-                }
+                parent = subnode;
             }
-
-            free(tag);
-            tag = NULL;
-            free(keyname);
-            keyname = NULL;
-            plist_free(subnode);
             subnode = NULL;
+        } else if (closing_tag) {
+            if (!node_path) {
+                PLIST_XML_ERR("node path is empty while trying to match closing tag with opening tag\n");
+                ctx->err++;
+                goto err_out;
+            }
+            if (strcmp(node_path->type, tag+1) != 0) {
+                PLIST_XML_ERR("unexpected %s found (for opening %s)\n", tag, node_path->type);
+                ctx->err++;
+                goto err_out;
+            }
+            struct node_path_item *path_item = node_path;
+            node_path = node_path->prev;
+            free(path_item);
+
+            parent = ((node_t*)parent)->parent;
+            if (!parent) {
+                goto err_out;
+            }
         }
+
+        free(tag);
+        tag = NULL;
+        free(keyname);
+        keyname = NULL;
+        plist_free(subnode);
+        subnode = NULL;
     }
 
     if (node_path) {
@@ -1425,13 +1702,276 @@ err_out:
 }
 
 PLIST_API void plist_from_xml(const char *plist_xml, uint32_t length, plist_t * plist)
+{
+    plist_from_xml_with_options(plist_xml, length, plist, PLIST_PARSE_DEFAULT);
+}
+
+PLIST_API void plist_from_xml64(const char *plist_xml, uint64_t length, plist_t * plist)
+{
+    plist_from_xml_with_options(plist_xml, length, plist, PLIST_PARSE_DEFAULT);
+}
+
+PLIST_API void plist_from_xml_with_options(const char *plist_xml, uint64_t length, plist_t * plist, plist_parse_options_t options)
 {
     if (!plist_xml || (length == 0)) {
         *plist = NULL;
         return;
     }
 
-    struct _parse_ctx ctx = { plist_xml, plist_xml + length, 0 };
+    struct _parse_ctx ctx = PARSE_CTX_INIT(plist_xml, length);
 
+    if (options & PLIST_PARSE_ARENA) {
+        /* the text is a good upper bound for the size of the document */
+        ctx.arena = arena_new((length > (1 << 26)) ? (1 << 26) : length);
+        if (!ctx.arena) {
+            PLIST_XML_ERR("failed to create memory arena. Out of memory?\n");
+            *plist = NULL;
+            return;
+        }
+    }
+
+    *plist = NULL;
     node_from_xml(&ctx, plist);
+
+    if (ctx.arena) {
+        plist_arena_finish(ctx.arena, *plist);
+    }
+}
+
+struct xml_validate_stack {
+    char *items;
+    size_t count;
+    size_t capacity;
+};
+
+static int xml_validate_push(struct xml_validate_stack *stack, char type)
+{
+    if (stack->count == stack->capacity) {
+        size_t capacity = (stack->capacity) ? stack->capacity * 2 : 32;
+        char *items = realloc(stack->items, capacity);
+        if (!items) {
+            PLIST_XML_ERR("out of memory when allocating node path item\n");
+            return -1;
+        }
+        stack->items = items;
+        stack->capacity = capacity;
+    }
+    stack->items[stack->count++] = type;
+    return 0;
+}
+
+static const char* xml_validate_type_name(char type)
+{
+    switch (type) {
+    case 'd':
+        return XPLIST_DICT;
+    case 'a':
+        return XPLIST_ARRAY;
+    default:
+        return "plist";
+    }
+}
+
+/* Walks the document exactly like node_from_xml() does, but only keeps
+ * track of the open elements instead of building nodes. */
+PLIST_API int plist_validate_xml(const char *plist_xml, uint64_t length, uint64_t *num_objects, uint32_t *max_depth)
+{
+    struct _parse_ctx ctx = PARSE_CTX_INIT(plist_xml, length);
+    /* the open elements ('p'list, 'd'ict, 'a'rray) as in node_path, and
+     * the containers the parser's parent pointer moves through */
+    struct xml_validate_stack node_path = { NULL, 0, 0 };
+    struct xml_validate_stack parents = { NULL, 0, 0 };
+    int has_root = 0;
+    int has_key = 0;
+    int has_content = 0;
+    int done = 0;
+    uint64_t objects = 0;
+    uint32_t depth = 0;
+
+    if (!plist_xml || (length == 0)) {
+        return -1;
+    }
+
+    while (ctx.pos < ctx.end && !ctx.err) {
+        const char *p = NULL;
+        const char *nul = NULL;
+        /* long enough for every tag name the parser knows */
+        char tag[16];
+        int taglen = 0;
+        int is_empty = 0;
+        char type = 0;
+        int res = parse_next_tag(&ctx, &p, &taglen, &is_empty);
+        if (res <= 0) {
+            break;
+        }
+        /* the parser works on a 0-terminated copy of the tag name */
+        nul = memchr(p, '\0', taglen);
+        if ((nul ? nul - p : taglen) >= (int)sizeof(tag)) {
+            PLIST_XML_ERR("Unexpected tag <%.*s> encountered\n", taglen, p);
+            ctx.err++;
+            break;
+        }
+        memcpy(tag, p, (nul) ? (size_t)(nul - p) : (size_t)taglen);
+        tag[(nul) ? nul - p : taglen] = '\0';
+
+        if (!strcmp(tag, "plist")) {
+            has_content = 0;
+            if (node_path.count == 0 && has_root) {
+                break;
+            }
+            if (is_empty) {
+                PLIST_XML_ERR("Empty plist tag\n");
+                ctx.err++;
+                break;
+            }
+            if (xml_validate_push(&node_path, 'p') < 0) {
+                ctx.err++;
+                break;
+            }
+            continue;
+        } else if (!strcmp(tag, "/plist")) {
+            if (!has_content) {
+                PLIST_XML_ERR("encountered empty plist tag\n");
+                ctx.err++;
+                break;
+            }
+            if (node_path.count == 0 || node_path.items[node_path.count-1] != 'p') {
+                PLIST_XML_ERR("mismatching closing tag <%s> found\n", tag);
+                ctx.err++;
+                break;
+            }
+            node_path.count--;
+            continue;
+        }
+
+        has_content = 1;
+        if (!strcmp(tag, XPLIST_DICT)) {
+            type = 'd';
+        } else if (!strcmp(tag, XPLIST_ARRAY)) {
+            type = 'a';
+        } else if (!strcmp(tag, XPLIST_TRUE) || !strcmp(tag, XPLIST_FALSE)) {
+            if (!is_empty) {
+                get_text_parts(&ctx, tag, taglen, 1, NULL);
+            }
+            type = 'v';
+        } else if (!strcmp(tag, XPLIST_INT) || !strcmp(tag, XPLIST_REAL) || !strcmp(tag, XPLIST_DATE)
+                || !strcmp(tag, XPLIST_STRING) || !strcmp(tag, XPLIST_KEY) || !strcmp(tag, XPLIST_DATA)) {
+            if (!is_empty) {
+                int is_text = (!strcmp(tag, XPLIST_STRING) || !strcmp(tag, XPLIST_KEY));
+                int is_data = !strcmp(tag, XPLIST_DATA);
+                text_part_t first_part = { NULL, 0, 0, NULL };
+                text_part_t *tp = get_text_parts(&ctx, tag, taglen, !is_text, &first_part);
+                if (!tp) {
+                    PLIST_XML_ERR("Could not parse text content for '%s' node\n", tag);
+                    text_parts_free(first_part.next);
+                    ctx.err++;
+                    break;
+                }
+                while (tp && tp->begin) {
+                    if (is_text && !tp->is_cdata && check_entities(tp->begin, tp->length) < 0) {
+                        ctx.err++;
+                        break;
+                    }
+                    if (is_data && base64check(tp->begin, tp->length) < 0) {
+                        PLIST_XML_ERR("Invalid base64 content in data node\n");
+                        ctx.err++;
+                        break;
+                    }
+                    tp = tp->next;
+                }
+                text_parts_free(first_part.next);
+            }
+            /* an empty <key/> is taken as a string value */
+            if (!is_empty && !strcmp(tag, XPLIST_KEY) && !has_key && parents.count > 0 && parents.items[parents.count-1] == 'd') {
+                has_key = 1;
+                continue;
+            }
+            type = 'v';
+        } else if (tag[0] == '/') {
+            type = '/';
+        } else {
+            PLIST_XML_ERR("Unexpected tag <%s%s> encountered\n", tag, (is_empty) ? "/" : "");
+            ctx.err++;
+            break;
+        }
+        if (ctx.err) {
+            break;
+        }
+
+        if (type != '/') {
+            if (!has_root) {
+                has_root = 1;
+                objects++;
+                depth = 1;
+                if (type == 'v') {
+                    /* a scalar root ends the document */
+                    done = 1;
+                    break;
+                }
+                if (xml_validate_push(&parents, type) < 0) {
+                    ctx.err++;
+                    break;
+                }
+                if (!is_empty && xml_validate_push(&node_path, type) < 0) {
+                    ctx.err++;
+                    break;
+                }
+            } else if (parents.count > 0) {
+                if (parents.items[parents.count-1] == 'd' && !has_key) {
+                    PLIST_XML_ERR("missing key name while adding dict item\n");
+                    ctx.err++;
+                    break;
+                }
+                objects++;
+                if (parents.count + 1 > depth) {
+                    depth = parents.count + 1;
+                }
+                if (!is_empty && type != 'v') {
+                    if (xml_validate_push(&node_path, type) < 0 || xml_validate_push(&parents, type) < 0) {
+                        ctx.err++;
+                        break;
+                    }
+                }
+            }
+        } else {
+            if (node_path.count == 0) {
+                PLIST_XML_ERR("node path is empty while trying to match closing tag with opening tag\n");
+                ctx.err++;
+                break;
+            }
+            if (strcmp(xml_validate_type_name(node_path.items[node_path.count-1]), tag+1) != 0) {
+                PLIST_XML_ERR("unexpected %s found (for opening %s)\n", tag, xml_validate_type_name(node_path.items[node_path.count-1]));
+                ctx.err++;
+                break;
+            }
+            node_path.count--;
+            if (parents.count > 0) {
+                parents.count--;
+            }
+            if (parents.count == 0) {
+                /* the root container is complete */
+                done = 1;
+                break;
+            }
+        }
+        has_key = 0;
+    }
+
+    if (!ctx.err && !done && node_path.count > 0) {
+        PLIST_XML_ERR("EOF encountered while </%s> was expected\n", xml_validate_type_name(node_path.items[node_path.count-1]));
+        ctx.err++;
+    }
+    free(node_path.items);
+    free(parents.items);
+
+    if (ctx.err || !has_root) {
+        return -1;
+    }
+    if (num_objects) {
+        *num_objects = objects;
+    }
+    if (max_depth) {
+        *max_depth = depth;
+    }
+    return 0;
 }
@@ -26,12 +26,527 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #ifdef _MSC_VER
 #pragma warning(disable:4996)
 #endif
 
 
+/* rebuild a plist by walking a binary plist view */
+static plist_t view_to_plist(plist_bin_view_t view, plist_bin_ref_t ref)
+{
+    plist_t node = NULL;
+    uint64_t i = 0;
+    uint64_t size = plist_bin_view_get_size(view, ref);
+    switch (plist_bin_view_get_type(view, ref))
+    {
+    case PLIST_ARRAY:
+        node = plist_new_array();
+        for (i = 0; i < size; i++)
+        {
+            plist_t item = view_to_plist(view, plist_bin_view_array_get_item(view, ref, i));
+            if (!item)
+            {
+                plist_free(node);
+                return NULL;
+            }
+            plist_array_append_item(node, item);
+        }
+        break;
+    case PLIST_DICT:
+        node = plist_new_dict();
+        for (i = 0; i < size; i++)
+        {
+            char *key = NULL;
+            plist_bin_ref_t item_ref = plist_bin_view_dict_get_item_at(view, ref, i, &key);
+            plist_t item = NULL;
+            if (key && plist_bin_view_dict_get_item(view, ref, key) == item_ref)
+                item = view_to_plist(view, item_ref);
+            if (!item)
+            {
+                free(key);
+                plist_free(node);
+                return NULL;
+            }
+            plist_dict_set_item(node, key, item);
+            free(key);
+        }
+        break;
+    case PLIST_NONE:
+        break;
+    default:
+        node = plist_bin_view_get_node(view, ref);
+        break;
+    }
+    return node;
+}
+
+struct update_buf {
+    char *data;
+    size_t len;
+};
+
+static int update_append(const void *buf, size_t len, void *user_data)
+{
+    struct update_buf *out = (struct update_buf *) user_data;
+    char *data = (char *) realloc(out->data, out->len + len);
+    if (!data)
+        return -1;
+    memcpy(data + out->len, buf, len);
+    out->data = data;
+    out->len += len;
+    return 0;
+}
+
+/* return the first node of the given type in a depth-first walk */
+static plist_t find_node(plist_t node, plist_type type)
+{
+    plist_t found = NULL;
+    uint32_t i = 0;
+    if (plist_get_node_type(node) == type)
+        return node;
+    if (plist_get_node_type(node) == PLIST_ARRAY)
+    {
+        for (i = 0; !found && i < plist_array_get_size(node); i++)
+            found = find_node(plist_array_get_item(node, i), type);
+    }
+    else if (plist_get_node_type(node) == PLIST_DICT)
+    {
+        plist_dict_iter it = NULL;
+        plist_t val = NULL;
+        plist_dict_new_iter(node, &it);
+        do
+        {
+            char *key = NULL;
+            val = NULL;
+            plist_dict_next_item(node, it, &key, &val);
+            free(key);
+            if (val)
+                found = find_node(val, type);
+        } while (!found && val);
+        free(it);
+    }
+    return found;
+}
+
+/* change values, insert, replace and remove items of a parsed tree so
+ * that it ends up with the content it had before */
+static void mutate_plist(plist_t root)
+{
+    plist_t node = find_node(root, PLIST_STRING);
+    if (node)
+    {
+        char *val = NULL;
+        plist_get_string_val(node, &val);
+        plist_set_string_val(node, "plist_test");
+        plist_set_string_val(node, val);
+        free(val);
+    }
+    node = find_node(root, PLIST_DATA);
+    if (node)
+    {
+        char *val = NULL;
+        uint64_t len = 0;
+        plist_get_data_val(node, &val, &len);
+        plist_set_data_val(node, "plist_test", 10);
+        plist_set_data_val(node, val, len);
+        free(val);
+    }
+    node = find_node(root, PLIST_ARRAY);
+    if (node && plist_array_get_size(node) > 0)
+    {
+        plist_array_insert_item(node, plist_new_bool(1), 0);
+        plist_array_remove_item(node, 0);
+        plist_array_set_item(node, plist_copy(plist_array_get_item(node, 0)), 0);
+    }
+    node = find_node(root, PLIST_DICT);
+    if (node && plist_dict_get_size(node) > 0)
+    {
+        plist_dict_iter it = NULL;
+        char *key = NULL;
+        char *last = NULL;
+        plist_t val = NULL;
+        plist_dict_set_item(node, "plist_test", plist_new_string("plist_test"));
+        plist_dict_remove_item(node, "plist_test");
+        /* the last entry can be removed and added again without
+         * changing the order */
+        plist_dict_new_iter(node, &it);
+        do
+        {
+            free(last);
+            last = key;
+            key = NULL;
+            plist_dict_next_item(node, it, &key, &val);
+        } while (key);
+        free(it);
+        val = plist_copy(plist_dict_get_item(node, last));
+        plist_dict_remove_item(node, last);
+        plist_dict_set_item(node, last, val);
+        free(last);
+    }
+}
+
+/* change the string and data values of a copy, which share their
+ * payload with root, and check that root keeps its content */
+static int test_copy_sharing(plist_t root)
+{
+    plist_t copy = plist_copy(root);
+    plist_t node = NULL;
+    char *before = NULL;
+    char *after = NULL;
+    char *val = NULL;
+    uint32_t len_before = 0;
+    uint32_t len_after = 0;
+    uint64_t len = 0;
+    int res = 0;
+    plist_to_xml(root, &before, &len_before);
+    node = find_node(copy, PLIST_STRING);
+    if (node)
+    {
+        plist_set_string_val(node, "plist_test");
+        plist_get_string_val(node, &val);
+        if (!val || strcmp(val, "plist_test") != 0)
+            res = -1;
+        free(val);
+        val = NULL;
+    }
+    node = find_node(copy, PLIST_DATA);
+    if (node)
+    {
+        plist_set_data_val(node, "plist_test", 10);
+        plist_get_data_val(node, &val, &len);
+        if (!val || len != 10 || memcmp(val, "plist_test", 10) != 0)
+            res = -1;
+        free(val);
+    }
+    /* the original must be unchanged, also once the copy is gone */
+    plist_to_xml(root, &after, &len_after);
+    if (!before || !after || len_before != len_after || memcmp(before, after, len_before) != 0)
+        res = -1;
+    free(after);
+    after = NULL;
+    plist_free(copy);
+    plist_to_xml(root, &after, &len_after);
+    if (!after || len_before != len_after || memcmp(before, after, len_before) != 0)
+        res = -1;
+    free(before);
+    free(after);
+    return res;
+}
+
+/* check that the 64-bit codec functions agree with the 32-bit ones */
+/* copies of one dictionary written by the compact writer, which expand
+ * to more nodes than a default parse accepts for the size of the output */
+#define COMPACT_COPIES 40000
+#define COMPACT_KEYS 20
+
+/* the compact output must read back with PLIST_PARSE_UNBOUNDED */
+static int test_compact_expansion(void)
+{
+    plist_t dict = plist_new_dict();
+    plist_t array = plist_new_array();
+    plist_t parsed = NULL;
+    char *bin = NULL;
+    uint64_t len = 0;
+    char *out1 = NULL;
+    char *out2 = NULL;
+    uint32_t len1 = 0;
+    uint32_t len2 = 0;
+    char key[16];
+    int res = 0;
+    int i = 0;
+
+    for (i = 0; i < COMPACT_KEYS; i++)
+    {
+        snprintf(key, sizeof(key), "key%d", i);
+        plist_dict_set_item(dict, key, plist_new_uint(i));
+    }
+    for (i = 0; i < COMPACT_COPIES; i++)
+        plist_array_append_item(array, plist_copy(dict));
+    plist_free(dict);
+    plist_to_bin_with_options(array, &bin, &len, PLIST_WRITE_COMPACT);
+    if (!bin)
+        res = -1;
+    else
+    {
+        /* too many nodes for the size of the input by default */
+        plist_from_bin(bin, (uint32_t)len, &parsed);
+        if (parsed)
+            res = -1;
+        plist_free(parsed);
+        parsed = NULL;
+        plist_from_bin_with_options(bin, len, &parsed, PLIST_PARSE_UNBOUNDED);
+        plist_to_bin(array, &out1, &len1);
+        plist_to_bin(parsed, &out2, &len2);
+        if (!out1 || !out2 || len1 != len2 || memcmp(out1, out2, len1) != 0)
+            res = -1;
+        free(out1);
+        free(out2);
+        plist_free(parsed);
+    }
+    free(bin);
+    plist_free(array);
+    return res;
+}
+
+/* lookups done on a single view, more than the node budget of a parse */
+#define VIEW_LOOKUPS (1 << 20)
+
+/* look up a key that is stored as UTF-16 over and over on the same view,
+ * each lookup decodes the key object */
+static int test_view_lookups(void)
+{
+    plist_t dict = plist_new_dict();
+    plist_bin_view_t view = NULL;
+    plist_bin_ref_t root = PLIST_BIN_REF_INVALID;
+    char *bin = NULL;
+    uint32_t len = 0;
+    int res = 0;
+    int i = 0;
+
+    plist_dict_set_item(dict, "\xc3\xa9t\xc3\xa9", plist_new_uint(1));
+    plist_to_bin(dict, &bin, &len);
+    plist_free(dict);
+    view = plist_bin_view_open(bin, len);
+    if (!view)
+        res = -1;
+    else
+        root = plist_bin_view_get_root(view);
+    for (i = 0; i < VIEW_LOOKUPS && res == 0; i++)
+    {
+        char *key = NULL;
+        if (plist_bin_view_dict_get_item(view, root, "\xc3\xa9t\xc3\xa9") == PLIST_BIN_REF_INVALID
+         || plist_bin_view_dict_get_item_at(view, root, 0, &key) == PLIST_BIN_REF_INVALID)
+            res = -1;
+        free(key);
+    }
+    plist_bin_view_close(view);
+    free(bin);
+    return res;
+}
+
+#ifndef _WIN32
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/* Build a binary plist with more than UINT32_MAX objects, whose root array
+ * holds a reference to object UINT32_MAX + 6. That object is the string
+ * "B", while object 5 is "A", so a reference truncated to 32 bits shows.
+ * Apart from the few objects used, the offset table is never touched. */
+static int test_64bit_refs(void)
+{
+    uint64_t num_objects = (uint64_t)UINT32_MAX + 7;
+    uint64_t far_ref = num_objects - 1;
+    uint64_t table_offset = 21;
+    uint64_t big_len = table_offset + num_objects + 32;
+    char *big = NULL;
+    char *trailer = NULL;
+    plist_bin_view_t view = NULL;
+    plist_t node = NULL;
+    const char *str = NULL;
+    uint64_t str_len = 0;
+    int res = 0;
+    int i = 0;
+
+    big = (char *) mmap(NULL, big_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (big == MAP_FAILED)
+    {
+        printf("Skipping the test of a binary plist with more than 4G objects\n");
+        return 0;
+    }
+    memcpy(big, "bplist00", 8);
+    /* object 0: an array holding one 8 byte reference */
+    big[8] = (char)0xA1;
+    for (i = 0; i < 8; i++)
+        big[9 + i] = (char)(far_ref >> (8 * (7 - i)));
+    memcpy(big + 17, "\x51" "A" "\x51" "B", 4);
+    big[table_offset] = 8;
+    big[table_offset + 5] = 17;
+    big[table_offset + far_ref] = 19;
+    trailer = big + big_len - 32;
+    trailer[6] = 1;
+    trailer[7] = 8;
+    for (i = 0; i < 8; i++)
+    {
+        trailer[8 + i] = (char)(num_objects >> (8 * (7 - i)));
+        trailer[24 + i] = (char)(table_offset >> (8 * (7 - i)));
+    }
+
+    view = plist_bin_view_open(big, big_len);
+    if (!view || plist_bin_view_array_get_item(view, plist_bin_view_get_root(view), 0) != far_ref)
+        res = -1;
+    else
+    {
+        node = plist_bin_view_get_node(view, plist_bin_view_get_root(view));
+        str = plist_get_string_ptr(plist_array_get_item(node, 0), &str_len);
+        if (!str || str_len != 1 || str[0] != 'B')
+            res = -1;
+        plist_free(node);
+    }
+    plist_bin_view_close(view);
+    munmap(big, big_len);
+    return res;
+}
+#endif
+
+static int test_64bit(plist_t root)
+{
+    char *out32 = NULL;
+    char *out64 = NULL;
+    uint32_t len32 = 0;
+    uint64_t len64 = 0;
+    plist_t parsed[3] = { NULL, NULL, NULL };
+    char *xml = NULL;
+    uint32_t xml_len = 0;
+    int res = 0;
+    int i = 0;
+
+    plist_to_xml(root, &out32, &len32);
+    plist_to_xml64(root, &out64, &len64);
+    if (!out32 || !out64 || len64 != len32 || memcmp(out32, out64, len32) != 0)
+        res = -1;
+    if (out64)
+    {
+        plist_from_xml64(out64, len64, &parsed[0]);
+        plist_from_memory64(out64, len64, &parsed[1]);
+    }
+    free(out32);
+    free(out64);
+    out32 = out64 = NULL;
+
+    plist_to_bin(root, &out32, &len32);
+    plist_to_bin64(root, &out64, &len64);
+    if (!out32 || !out64 || len64 != len32 || memcmp(out32, out64, len32) != 0)
+        res = -1;
+    if (out64)
+        plist_from_bin64(out64, len64, &parsed[2]);
+    free(out64);
+
+    plist_to_xml(root, &xml, &xml_len);
+    for (i = 0; i < 3; i++)
+    {
+        char *xml2 = NULL;
+        uint32_t xml2_len = 0;
+        plist_to_xml(parsed[i], &xml2, &xml2_len);
+        if (!xml || !xml2 || xml_len != xml2_len || memcmp(xml, xml2, xml_len) != 0)
+            res = -1;
+        free(xml2);
+        plist_free(parsed[i]);
+    }
+
+#ifndef _WIN32
+    if (out32 && sizeof(size_t) > 4)
+    {
+        /* Move the offset table and the trailer of the binary plist past
+         * 4 GB, so the document is longer than UINT32_MAX. The gap is
+         * never touched, so the mapping does not need that much memory. */
+        uint64_t table_offset = 0;
+        uint64_t big_offset = (uint64_t)UINT32_MAX + 1;
+        uint64_t big_len = 0;
+        char *big = NULL;
+        plist_t node = NULL;
+        for (i = 0; i < 8; i++)
+            table_offset = (table_offset << 8) | (uint8_t)out32[len32 - 8 + i];
+        big_len = big_offset + (len32 - table_offset);
+        big = (char *) mmap(NULL, big_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (big != MAP_FAILED)
+        {
+            memcpy(big, out32, table_offset);
+            memcpy(big + big_offset, out32 + table_offset, len32 - table_offset);
+            for (i = 0; i < 8; i++)
+                big[big_len - 1 - i] = (char)(big_offset >> (8 * i));
+            plist_from_bin64(big, big_len, &node);
+            if (node)
+            {
+                char *xml2 = NULL;
+                uint32_t xml2_len = 0;
+                plist_to_xml(node, &xml2, &xml2_len);
+                if (!xml || !xml2 || xml_len != xml2_len || memcmp(xml, xml2, xml_len) != 0)
+                    res = -1;
+                free(xml2);
+                plist_free(node);
+            }
+            else
+                res = -1;
+            /* the same document must not parse with a truncated length */
+            node = NULL;
+            plist_from_bin(big, (uint32_t)big_len, &node);
+            if (node)
+            {
+                plist_free(node);
+                res = -1;
+            }
+            munmap(big, big_len);
+        }
+        else
+            printf("Skipping the test of a binary plist larger than 4 GB\n");
+        if (test_64bit_refs() != 0)
+            res = -1;
+    }
+#endif
+    free(out32);
+    free(xml);
+    return res;
+}
+
+/* levels of arrays to nest a tree in, far more than a recursive walk
+ * could handle, and the innermost levels that are also written as XML */
+#define DEEP_LEVELS 300000
+#define DEEP_XML_LEVELS 5000
+
+/* nest a copy of root in arrays, copy the result and check that both
+ * are written the same way, then free them */
+static int test_deep_nesting(plist_t root)
+{
+    plist_t deep = plist_new_array();
+    plist_t copy = NULL;
+    plist_t cur = deep;
+    plist_t inner = NULL;
+    plist_t inner_copy = NULL;
+    char *out1 = NULL;
+    char *out2 = NULL;
+    uint32_t len1 = 0;
+    uint32_t len2 = 0;
+    uint32_t i = 0;
+    int res = 0;
+    for (i = 1; i < DEEP_LEVELS; i++)
+    {
+        plist_t item = plist_new_array();
+        plist_array_append_item(cur, item);
+        cur = item;
+        if (i == DEEP_LEVELS - DEEP_XML_LEVELS)
+            inner = item;
+    }
+    plist_array_append_item(cur, plist_copy(root));
+
+    copy = plist_copy(deep);
+    plist_to_bin(deep, &out1, &len1);
+    plist_to_bin(copy, &out2, &len2);
+    if (!out1 || !out2 || len1 != len2 || memcmp(out1, out2, len1) != 0)
+        res = -1;
+    free(out1);
+    free(out2);
+    out1 = out2 = NULL;
+
+    inner_copy = copy;
+    for (i = 0; i < DEEP_LEVELS - DEEP_XML_LEVELS; i++)
+        inner_copy = plist_array_get_item(inner_copy, 0);
+    plist_to_xml(inner, &out1, &len1);
+    plist_to_xml(inner_copy, &out2, &len2);
+    if (!out1 || !out2 || len1 != len2 || memcmp(out1, out2, len1) != 0)
+        res = -1;
+    free(out1);
+    free(out2);
+
+    plist_free(copy);
+    plist_free(deep);
+    return res;
+}
+
 int main(int argc, char *argv[])
 {
     FILE *iplist = NULL;
@@ -45,7 +560,48 @@ int main(int argc, char *argv[])
     uint32_t size_out2 = 0;
     char *file_in = NULL;
     char *file_out = NULL;
+    plist_parse_options_t parse_options = PLIST_PARSE_DEFAULT;
+    int use_view = 0;
+    int use_stream = 0;
+    int use_compact = 0;
+    int use_validate = 0;
+    int use_update = 0;
+    int use_mutate = 0;
+    int use_deep = 0;
+    int use_copy = 0;
+    int use_64bit = 0;
     struct stat *filestats = (struct stat *) malloc(sizeof(struct stat));
+    while (argc > 3 && argv[1][0] == '-')
+    {
+        if (!strcmp(argv[1], "-a"))
+            parse_options |= PLIST_PARSE_ARENA;
+        else if (!strcmp(argv[1], "-b"))
+            parse_options |= PLIST_PARSE_BORROW;
+        else if (!strcmp(argv[1], "-p"))
+            parse_options |= PLIST_PARSE_PARALLEL;
+        else if (!strcmp(argv[1], "-v"))
+            use_view = 1;
+        else if (!strcmp(argv[1], "-s"))
+            use_stream = 1;
+        else if (!strcmp(argv[1], "-c"))
+            use_compact = 1;
+        else if (!strcmp(argv[1], "-V"))
+            use_validate = 1;
+        else if (!strcmp(argv[1], "-u"))
+            use_update = 1;
+        else if (!strcmp(argv[1], "-m"))
+            use_mutate = 1;
+        else if (!strcmp(argv[1], "-d"))
+            use_deep = 1;
+        else if (!strcmp(argv[1], "-C"))
+            use_copy = 1;
+        else if (!strcmp(argv[1], "-l"))
+            use_64bit = 1;
+        else
+            break;
+        argc--;
+        argv++;
+    }
     if (argc != 3)
     {
         printf("Wrong input\n");
@@ -71,7 +627,7 @@ int main(int argc, char *argv[])
 
 
     //convert one format to another
-    plist_from_xml(plist_xml, size_in, &root_node1);
+    plist_from_xml_with_options(plist_xml, size_in, &root_node1, parse_options);
     if (!root_node1)
     {
         printf("PList XML parsing failed\n");
@@ -80,6 +636,42 @@ int main(int argc, char *argv[])
     else
         printf("PList XML parsing succeeded\n");
 
+    if (use_mutate)
+    {
+        mutate_plist(root_node1);
+        printf("PList modification succeeded\n");
+    }
+
+    if (use_copy)
+    {
+        if (test_copy_sharing(root_node1) != 0)
+        {
+            printf("PList copy changed the original\n");
+            return 4;
+        }
+        printf("PList copy succeeded\n");
+    }
+
+    if (use_64bit)
+    {
+        if (test_64bit(root_node1) != 0)
+        {
+            printf("PList 64-bit conversion failed\n");
+            return 4;
+        }
+        printf("PList 64-bit conversion succeeded\n");
+    }
+
+    if (use_deep)
+    {
+        if (test_deep_nesting(root_node1) != 0)
+        {
+            printf("PList deep nesting failed\n");
+            return 4;
+        }
+        printf("PList deep nesting succeeded\n");
+    }
+
     plist_to_bin(root_node1, &plist_bin, &size_out);
     if (!plist_bin)
     {
@@ -89,7 +681,143 @@ int main(int argc, char *argv[])
     else
         printf("PList BIN writing succeeded\n");
 
-    plist_from_bin(plist_bin, size_out, &root_node2);
+    if (use_compact)
+    {
+        char *plist_bin_compact = NULL;
+        uint64_t size_compact = 0;
+        plist_to_bin_with_options(root_node1, &plist_bin_compact, &size_compact, PLIST_WRITE_COMPACT);
+        if (!plist_bin_compact || size_compact > size_out)
+        {
+            printf("PList BIN compact writing failed\n");
+            return 4;
+        }
+        printf("PList BIN compact writing succeeded (%u -> %u bytes)\n", size_out, (uint32_t)size_compact);
+        if (test_compact_expansion() != 0)
+        {
+            printf("PList BIN compact round-trip failed\n");
+            return 4;
+        }
+        free(plist_bin);
+        plist_bin = plist_bin_compact;
+        size_out = (uint32_t)size_compact;
+    }
+
+    if (use_validate)
+    {
+        uint64_t objects_xml = 0;
+        uint64_t objects_bin = 0;
+        uint32_t depth_xml = 0;
+        uint32_t depth_bin = 0;
+        if (plist_validate_xml(plist_xml, size_in, &objects_xml, &depth_xml) != 0
+         || plist_validate_bin(plist_bin, size_out, &objects_bin, &depth_bin) != 0
+         || objects_xml != objects_bin || depth_xml != depth_bin)
+        {
+            printf("PList validation failed\n");
+            return 4;
+        }
+        printf("PList validation succeeded (%llu objects, depth %u)\n", (unsigned long long)objects_bin, depth_bin);
+    }
+
+    if (parse_options & PLIST_PARSE_PARALLEL)
+    {
+        char *plist_bin_parallel = NULL;
+        uint64_t size_parallel = 0;
+        plist_to_bin_with_options(root_node1, &plist_bin_parallel, &size_parallel, PLIST_WRITE_PARALLEL);
+        if (!plist_bin_parallel || size_parallel != size_out || memcmp(plist_bin, plist_bin_parallel, size_out) != 0)
+        {
+            printf("PList BIN parallel output differs\n");
+            return 4;
+        }
+        free(plist_bin_parallel);
+        printf("PList BIN parallel writing succeeded\n");
+    }
+
+    if (use_stream)
+    {
+        FILE *stream = tmpfile();
+        char *plist_bin_stream = NULL;
+        long size_stream = 0;
+        if (!stream || plist_to_bin_file(root_node1, stream) != 0)
+        {
+            printf("PList BIN stream writing failed\n");
+            return 4;
+        }
+        size_stream = ftell(stream);
+        rewind(stream);
+        plist_bin_stream = (char *) malloc(size_stream);
+        if ((uint32_t)size_stream != size_out || fread(plist_bin_stream, 1, size_stream, stream) != (size_t)size_stream || memcmp(plist_bin, plist_bin_stream, size_out) != 0)
+        {
+            printf("PList BIN stream output differs\n");
+            return 4;
+        }
+        fclose(stream);
+        /* continue with what was read back from the stream */
+        free(plist_bin);
+        plist_bin = plist_bin_stream;
+        printf("PList BIN stream writing succeeded\n");
+    }
+
+    if (use_update)
+    {
+        /* set the first entry to what it is, then add another one and
+         * remove it again, so the document must come out unchanged */
+        plist_bin_view_t view = plist_bin_view_open(plist_bin, size_out);
+        plist_bin_ref_t root = plist_bin_view_get_root(view);
+        plist_bin_change_t changes[3];
+        plist_t first = NULL;
+        plist_t extra = plist_new_string("plist_test");
+        struct update_buf delta = { NULL, 0 };
+        memset(changes, 0, sizeof(changes));
+        if (plist_bin_view_get_type(view, root) == PLIST_DICT)
+        {
+            char *key = NULL;
+            first = plist_bin_view_get_node(view, plist_bin_view_dict_get_item_at(view, root, 0, &key));
+            changes[0].key = key;
+            changes[1].key = "plist_test";
+            changes[2].key = "plist_test";
+        }
+        else
+        {
+            first = plist_bin_view_get_node(view, plist_bin_view_array_get_item(view, root, 0));
+            changes[1].index = plist_bin_view_get_size(view, root);
+            changes[2].index = changes[1].index;
+        }
+        changes[0].container = changes[1].container = changes[2].container = root;
+        changes[0].value = first;
+        changes[1].value = extra;
+        if (!first || plist_bin_update(plist_bin, size_out, changes, 3, 0, update_append, &delta) != 0)
+        {
+            printf("PList BIN update failed\n");
+            return 4;
+        }
+        plist_bin_view_close(view);
+        free((char*)changes[0].key);
+        plist_free(first);
+        plist_free(extra);
+        printf("PList BIN update succeeded (%u + %u bytes)\n", size_out, (uint32_t)delta.len);
+        /* continue with the updated document */
+        plist_bin = (char *) realloc(plist_bin, size_out + delta.len);
+        memcpy(plist_bin + size_out, delta.data, delta.len);
+        size_out += (uint32_t)delta.len;
+        free(delta.data);
+    }
+
+    if (use_view)
+    {
+        plist_bin_view_t view = plist_bin_view_open(plist_bin, size_out);
+        if (view)
+        {
+            root_node2 = view_to_plist(view, plist_bin_view_get_root(view));
+            plist_bin_view_close(view);
+        }
+        if (test_view_lookups() != 0)
+        {
+            printf("PList BIN view lookups failed\n");
+            return 5;
+        }
+    }
+    else
+        plist_from_bin_with_options(plist_bin, size_out, &root_node2, parse_options);
     if (!root_node2)
     {
         printf("PList BIN parsing failed\n");
@@ -98,6 +826,9 @@ int main(int argc, char *argv[])
     else
         printf("PList BIN parsing succeeded\n");
 
+    if (use_mutate)
+        mutate_plist(root_node2);
+
     plist_to_xml(root_node2, &plist_xml2, &size_out2);
     if (!plist_xml2)
     {
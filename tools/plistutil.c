@@ -107,12 +107,12 @@ static options_t *parse_arguments(int argc, char *argv[])
 
 int main(int argc, char *argv[])
 {
-    FILE *iplist = NULL;
     plist_t root_node = NULL;
+    plist_format_t in_fmt = PLIST_FORMAT_NONE;
+    plist_format_t out_fmt;
     char *plist_out = NULL;
-    uint32_t size = 0;
-    int read_size = 0;
-    char *plist_entire = NULL;
+    uint64_t size = 0;
+    int res;
     struct stat filestats;
     options_t *options = parse_arguments(argc, argv);
 
@@ -122,63 +122,55 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    // pipes and devices have no size to check upfront
+    memset(&filestats, '\0', sizeof(struct stat));
+    if (stat(options->in_file, &filestats) == 0 && S_ISREG(filestats.st_mode) && filestats.st_size < 8) {
+        printf("ERROR: Input file is too small to contain valid plist data.\n");
+        free(options);
+        return -1;
+    }
+
     // read input file
-    iplist = fopen(options->in_file, "rb");
-    if (!iplist) {
+    res = plist_read_from_file(options->in_file, &root_node, &in_fmt);
+    if (res == -1) {
         printf("ERROR: Could not open input file '%s': %s\n", options->in_file, strerror(errno));
         free(options);
         return 1;
     }
-
-    memset(&filestats, '\0', sizeof(struct stat));
-    fstat(fileno(iplist), &filestats);
-
-    if (filestats.st_size < 8) {
-        printf("ERROR: Input file is too small to contain valid plist data.\n");
+    if (res != 0) {
+        printf("ERROR: Failed to convert input file.\n");
         free(options);
-        fclose(iplist);
-        return -1;
+        return 0;
     }
 
-    plist_entire = (char *) malloc(sizeof(char) * (filestats.st_size + 1));
-    read_size = fread(plist_entire, sizeof(char), filestats.st_size, iplist);
-    fclose(iplist);
-
     // convert from binary to xml or vice-versa
-    if (plist_is_binary(plist_entire, read_size))
+    out_fmt = (in_fmt == PLIST_FORMAT_BINARY) ? PLIST_FORMAT_XML : PLIST_FORMAT_BINARY;
+
+    if (options->out_file != NULL)
     {
-        plist_from_bin(plist_entire, read_size, &root_node);
-        plist_to_xml(root_node, &plist_out, &size);
+        if (plist_write_to_file(root_node, options->out_file, out_fmt, PLIST_WRITE_DEFAULT) != 0) {
+            printf("ERROR: Could not write output file '%s': %s\n", options->out_file, strerror(errno));
+            plist_free(root_node);
+            free(options);
+            return 1;
+        }
     }
+    // if no output file specified, write to stdout
     else
     {
-        plist_from_xml(plist_entire, read_size, &root_node);
-        plist_to_bin(root_node, &plist_out, &size);
-    }
-    plist_free(root_node);
-    free(plist_entire);
-
-    if (plist_out)
-    {
-        if (options->out_file != NULL)
+        if (out_fmt == PLIST_FORMAT_XML)
+            plist_to_xml64(root_node, &plist_out, &size);
+        else
+            plist_to_bin64(root_node, &plist_out, &size);
+        if (plist_out)
         {
-            FILE *oplist = fopen(options->out_file, "wb");
-            if (!oplist) {
-                printf("ERROR: Could not open output file '%s': %s\n", options->out_file, strerror(errno));
-                free(options);
-                return 1;
-            }
-            fwrite(plist_out, size, sizeof(char), oplist);
-            fclose(oplist);
+            fwrite(plist_out, size, sizeof(char), stdout);
+            free(plist_out);
         }
-        // if no output file specified, write to stdout
         else
-            fwrite(plist_out, size, sizeof(char), stdout);
-
-        free(plist_out);
+            printf("ERROR: Failed to convert input file.\n");
     }
-    else
-        printf("ERROR: Failed to convert input file.\n");
+    plist_free(root_node);
 
     free(options);
     return 0;